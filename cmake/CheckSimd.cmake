@@ -1,84 +1,64 @@
 
-include(CheckCXXSourceRuns)
+# Checks which instruction sets the compiler can generate code for. The kernels of every instruction set are
+# compiled in separate files with these flags and selected at runtime by the CPU, so the machine building the
+# library does not need to support them.
+
+include(CheckCXXSourceCompiles)
 
 # save old configuration
 set(OLD_CMAKE_REQUIRED_FLAGS ${CMAKE_REQUIRED_FLAGS})
 
 # set flags
-set(AVX_FLAGS)
 set(AVX2_FLAGS)
 set(AVX512_FLAGS)
 if ("${CMAKE_CXX_COMPILER_ID}" MATCHES "MSVC")
-  set(AVX_FLAGS "/arch:AVX")
   set(AVX2_FLAGS "/arch:AVX2")
-  # set(AVX512_FLAGS "/arch:AVX512") found no option for msvc
+  set(AVX512_FLAGS "/arch:AVX512")
 endif()
 if ("${CMAKE_CXX_COMPILER_ID}" MATCHES "GNU" OR "${CMAKE_CXX_COMPILER_ID}" MATCHES "Clang")
-  set(AVX_FLAGS "-mavx")
   set(AVX2_FLAGS "-mavx2")
-  set(AVX512_FLAGS "-mavx512f" "-mavx512cd") # xeon processors have more flags
-endif()
-
-
-# check for AVX
-set(CMAKE_REQUIRED_FLAGS ${OLD_CMAKE_REQUIRED_FLAGS} ${AVX_FLAGS})
-CHECK_CXX_SOURCE_RUNS("
-    #include <immintrin.h>
-    int main(){
-      const float src[8] = { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f };
-      float dst[8];
-      __m256 a = _mm256_loadu_ps( src );
-      __m256 b = _mm256_add_ps( a, a );
-      _mm256_storeu_ps( dst, b );
-      for( int i = 0; i < 8; i++ )
-        if( ( src[i] + src[i] ) != dst[i] ) return -1;
-      return 0;
-    }"
-    AVX_ENABLED)
-# remove flags if cpu does not support AVX
-if(NOT AVX_ENABLED)
-  set(AVX_FLAGS "")
+  set(AVX512_FLAGS "-mavx512f")
 endif()
 
 
 # check for AVX2
 set(CMAKE_REQUIRED_FLAGS ${OLD_CMAKE_REQUIRED_FLAGS} ${AVX2_FLAGS})
-CHECK_CXX_SOURCE_RUNS("
+CHECK_CXX_SOURCE_COMPILES("
     #include <immintrin.h>
+    #ifndef __AVX2__
+    #error AVX2 not enabled
+    #endif
     int main(){
-      const int src[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
-      int dst[8];
-      __m256i a =  _mm256_loadu_si256( (__m256i*)src );
-      __m256i b = _mm256_add_epi32( a, a );
+      const long long src[4] = { 1, 2, 3, 4 };
+      long long dst[4];
+      __m256i a = _mm256_loadu_si256( (const __m256i*)src );
+      __m256i b = _mm256_cmpeq_epi64( a, a );
       _mm256_storeu_si256( (__m256i*)dst, b );
-      for( int i = 0; i < 8; i++ )
-        if( ( src[i] + src[i] ) != dst[i] ) return -1;
-      return 0;
+      return (int)dst[0];
     }"
-    AVX2_ENABLED)
-# remove flags if cpu does not support AVX
-if(NOT AVX2_ENABLED)
+    AVX2_SUPPORTED)
+# remove flags if the compiler does not support AVX2
+if(NOT AVX2_SUPPORTED)
   set(AVX2_FLAGS "")
 endif()
 
 
 # check for AVX512
 set(CMAKE_REQUIRED_FLAGS ${OLD_CMAKE_REQUIRED_FLAGS} ${AVX512_FLAGS})
-CHECK_CXX_SOURCE_RUNS("
-    #include <zmmintrin.h>
+CHECK_CXX_SOURCE_COMPILES("
+    #include <immintrin.h>
+    #ifndef __AVX512F__
+    #error AVX512 not enabled
+    #endif
     int main(){
-      const int src[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 1, 2, 3, 4, 5, 6, 7, 8 };
-      int dst[16];
-      __m512i a =  _mm512_loadu_si512( (__m512i*)src );
-      __m512i b = _mm512_add_epi32( a, a );
-      _mm512_storeu_si512( (__m512i*)dst, b );
-      for( int i = 0; i < 16; i++ )
-        if( ( src[i] + src[i] ) != dst[i] ) return -1;
-      return 0;
+      const double src[8] = { 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0 };
+      __m512d a = _mm512_loadu_pd( src );
+      __m512d b = _mm512_maskz_mov_pd( _mm512_cmp_pd_mask( a, a, _CMP_LT_OQ ), a );
+      return (int)_mm512_reduce_add_pd( b );
     }"
-    AVX512_ENABLED)
-# remove flags if cpu does not support AVX
-if(NOT AVX512_ENABLED)
+    AVX512_SUPPORTED)
+# remove flags if the compiler does not support AVX512
+if(NOT AVX512_SUPPORTED)
   set(AVX512_FLAGS "")
 endif()
 
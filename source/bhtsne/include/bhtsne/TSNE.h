@@ -33,6 +33,9 @@
 #pragma once
 
 
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 #include <random>
@@ -47,18 +50,83 @@ static inline double sign(double x) { return (x == .0 ? .0 : (x < .0 ? -1.0 : 1.
 
 namespace bhtsne
 {
+
+
+template<unsigned int D>
+class SpacePartitioningTree;
+
+template<unsigned int D>
+class FFTInterpolation;
+
+struct GradientWorkspace;
+
+class NeighborSearch;
+
+
+/**
+*  @brief
+*    Methods to approximate the repulsive forces of the gradient
+*/
+enum class GradientMethod
+{
+    BarnesHut,    ///< every point traverses a space-partitioning tree on its own
+    DualTree,     ///< cells of the tree interact with cells, the results are pushed down to their points
+    Interpolation ///< the kernel is interpolated on a grid and convolved by FFT (FIt-SNE), 1 or 2 output dimensions
+};
+
+
+/**
+*  @brief
+*    Methods to find the nearest neighbors of the input points
+*/
+enum class NeighborMethod
+{
+    Automatic,                      ///< BruteForce for medium-sized high-dimensional inputs, else VantagePointTree
+    VantagePointTree,               ///< exact search in a vantage point tree
+    BruteForce,                     ///< exact search comparing all pairs of points in cache-sized tiles
+    RandomProjectionForest,         ///< approximate search in a forest of random projection trees (like Annoy)
+    NearestNeighborDescent,         ///< approximate neighbor graph refined by NN-Descent (like PyNNDescent)
+    HierarchicalNavigableSmallWorld ///< approximate search in a hierarchical navigable small world (like hnswlib)
+};
+
+
+/**
+*  @brief
+*    Metrics of the distances between the input points
+*/
+enum class DistanceMetric
+{
+    Euclidean,              ///< squared Euclidean distance
+    Cosine,                 ///< 1 - cosine similarity, e.g. for text embeddings
+    NormalizedInnerProduct, ///< 1 - inner product, the cosine distance of inputs that are normalized already
+    Manhattan,              ///< sum of the absolute differences
+    Hamming                 ///< number of different values of binary inputs (non-zero values are 1), bit-packed
+};
+
+
 /**
 *  @brief
 *    Representation of the Barnes-Hut approximation for
 *    the t-distributed stochastic neighbor embedding algorithm
 *
 *    Default parameters are:
-*    - randomSeed          random
-*    - perplexity          50
-*    - gradientAccuracy    0.2
-*    - iterations          1000
-*    - outputDimensions    2
-*    - outputFile          "./result"
+*    - randomSeed                random
+*    - perplexity                50
+*    - perplexities              {} (single perplexity)
+*    - pointPerplexities         {} (same perplexity for all points)
+*    - gradientAccuracy          0.2
+*    - gradientMethod            BarnesHut
+*    - neighborMethod            Automatic
+*    - distanceMetric            Euclidean
+*    - randomProjectionTrees     10
+*    - neighborSearchBudget      0 (trees times neighbors)
+*    - neighborDescentThreshold  0.001
+*    - neighborIndexFile         "" (none)
+*    - similarityCacheFile       "" (none)
+*    - iterations                1000
+*    - reorderInterval           0
+*    - outputDimensions          2
+*    - outputFile                "./result"
 *
 *    This class follows the method object pattern (SmalltalkBestPracticePatterns, page 34-37).
 */
@@ -98,6 +166,57 @@ public:
     */
     void setPerplexity(double perplexity);
 
+    /**
+    *  @brief
+    *    Get multi-scale perplexities
+    *
+    *  @return
+    *    Perplexities whose similarities are averaged, empty to use perplexity() only
+    *
+    *  @remarks
+    *    The similarities of every point are the mean of its similarities at each of the perplexities, which
+    *    preserves local and global structure in one embedding (multi-scale t-SNE). The neighbors are searched once
+    *    for the largest of the perplexities and shared by all of them. Cannot be combined with
+    *    pointPerplexities() or exact t-SNE.
+    */
+    std::vector<double> perplexities() const;
+
+    /**
+    *  @brief
+    *    Set multi-scale perplexities
+    *
+    *  @param[in] perplexities
+    *    Perplexities whose similarities are averaged, empty to use perplexity() only
+    *
+    *  @see perplexities()
+    */
+    void setPerplexities(const std::vector<double> & perplexities);
+
+    /**
+    *  @brief
+    *    Get perplexities of the points
+    *
+    *  @return
+    *    Perplexity of every point, empty to use perplexity() for all of them
+    *
+    *  @remarks
+    *    The similarities of every point are computed for its own 3 * perplexity nearest neighbors, the neighbors
+    *    are searched once for the largest of the perplexities. Cannot be combined with perplexities() or exact
+    *    t-SNE.
+    */
+    std::vector<double> pointPerplexities() const;
+
+    /**
+    *  @brief
+    *    Set perplexities of the points
+    *
+    *  @param[in] perplexities
+    *    Perplexity of every point (one per point of the data set), empty to use perplexity() for all of them
+    *
+    *  @see pointPerplexities()
+    */
+    void setPointPerplexities(const std::vector<double> & perplexities);
+
     /**
     *  @brief
     *    Get gradient accuracy
@@ -122,6 +241,213 @@ public:
     */
     void setGradientAccuracy(double accuracy);
 
+    /**
+    *  @brief
+    *    Get gradient method
+    *
+    *  @return
+    *    Method used to approximate the repulsive forces
+    *
+    *  @remarks
+    *    DualTree interacts whole cells of the tree with each other instead of every point with the cells,
+    *    which saves most of the traversal on large datasets. Both methods use gradientAccuracy() as theta.
+    *    Interpolation needs time linear in the number of points, but is only available for one or two
+    *    output dimensions; BarnesHut is used for other output dimensionalities.
+    */
+    GradientMethod gradientMethod() const;
+
+    /**
+    *  @brief
+    *    Set gradient method
+    *
+    *  @param[in] method
+    *    Method used to approximate the repulsive forces
+    *
+    *  @see gradientMethod()
+    */
+    void setGradientMethod(GradientMethod method);
+
+    /**
+    *  @brief
+    *    Get neighbor method
+    *
+    *  @return
+    *    Method used to find the nearest neighbors of the input points
+    *
+    *  @remarks
+    *    The similarities of every point are computed for its 3 * perplexity nearest neighbors. The exact search of
+    *    VantagePointTree degrades to a brute-force search on high-dimensional inputs, where BruteForce is faster as
+    *    long as there are not too many points; Automatic chooses between both. RandomProjectionForest is much
+    *    faster on such inputs and finds most of the neighbors, which is accurate enough for the similarities.
+    *    NearestNeighborDescent builds the neighbor graph of all points at once and usually finds almost all of the
+    *    neighbors on high-dimensional inputs. HierarchicalNavigableSmallWorld is fast to build and query on
+    *    high-dimensional inputs and can be saved to neighborIndexFile() to be reused in later runs.
+    */
+    NeighborMethod neighborMethod() const;
+
+    /**
+    *  @brief
+    *    Set neighbor method
+    *
+    *  @param[in] method
+    *    Method used to find the nearest neighbors of the input points
+    *
+    *  @see neighborMethod()
+    */
+    void setNeighborMethod(NeighborMethod method);
+
+    /**
+    *  @brief
+    *    Get distance metric
+    *
+    *  @return
+    *    Metric of the distances between the input points
+    *
+    *  @remarks
+    *    The similarities are a Gaussian kernel of the distances, so the perplexity may need to be adjusted to the
+    *    metric. The input is zero-centered and scaled for the Euclidean and Manhattan metrics only; the other
+    *    metrics use it as it is loaded, without normalized copies. Hamming packs the binary input into bits, one
+    *    64 bit word per 64 input dimensions, and compares them with popcount.
+    */
+    DistanceMetric distanceMetric() const;
+
+    /**
+    *  @brief
+    *    Set distance metric
+    *
+    *  @param[in] metric
+    *    Metric of the distances between the input points
+    *
+    *  @see distanceMetric()
+    */
+    void setDistanceMetric(DistanceMetric metric);
+
+    /**
+    *  @brief
+    *    Get number of random projection trees
+    *
+    *  @return
+    *    Number of trees of the RandomProjectionForest neighbor method
+    *
+    *  @remarks
+    *    More trees find more of the true neighbors, but take longer to build and more memory.
+    */
+    unsigned int randomProjectionTrees() const;
+
+    /**
+    *  @brief
+    *    Set number of random projection trees
+    *
+    *  @param[in] trees
+    *    Number of trees of the RandomProjectionForest neighbor method (at least 1)
+    *
+    *  @see randomProjectionTrees()
+    */
+    void setRandomProjectionTrees(unsigned int trees);
+
+    /**
+    *  @brief
+    *    Get neighbor search budget
+    *
+    *  @return
+    *    Number of candidates an approximate neighbor search compares to every point, 0 for the default of the
+    *    method (the number of trees times the number of neighbors or twice the number of neighbors)
+    *
+    *  @remarks
+    *    A larger budget finds more of the true neighbors, but takes longer.
+    */
+    unsigned int neighborSearchBudget() const;
+
+    /**
+    *  @brief
+    *    Set neighbor search budget
+    *
+    *  @param[in] candidates
+    *    Number of candidates an approximate neighbor search compares to every point, 0 for the default
+    *
+    *  @see neighborSearchBudget()
+    */
+    void setNeighborSearchBudget(unsigned int candidates);
+
+    /**
+    *  @brief
+    *    Get convergence threshold of NN-Descent
+    *
+    *  @return
+    *    Fraction of the neighbors of all points; the NearestNeighborDescent neighbor method stops when an
+    *    iteration finds fewer new neighbors
+    *
+    *  @remarks
+    *    A smaller threshold finds more of the true neighbors, but takes more iterations.
+    */
+    double neighborDescentThreshold() const;
+
+    /**
+    *  @brief
+    *    Set convergence threshold of NN-Descent
+    *
+    *  @param[in] threshold
+    *    Fraction of the neighbors of all points; the NearestNeighborDescent neighbor method stops when an
+    *    iteration finds fewer new neighbors
+    *
+    *  @see neighborDescentThreshold()
+    */
+    void setNeighborDescentThreshold(double threshold);
+
+    /**
+    *  @brief
+    *    Get neighbor index file
+    *
+    *  @return
+    *    File the neighbor search index is loaded from and saved to, empty for none
+    *
+    *  @remarks
+    *    The index is loaded from the file if it holds an index of the same input data (which is checked by a
+    *    checksum), otherwise it is created and saved to the file. Only the HierarchicalNavigableSmallWorld
+    *    neighbor method can be saved. The index does not depend on the perplexity, so runs with other
+    *    parameters on the same data skip building it.
+    */
+    std::string neighborIndexFile() const;
+
+    /**
+    *  @brief
+    *    Set neighbor index file
+    *
+    *  @param[in] file
+    *    File the neighbor search index is loaded from and saved to, empty for none
+    *
+    *  @see neighborIndexFile()
+    */
+    void setNeighborIndexFile(const std::string & file);
+
+    /**
+    *  @brief
+    *    Get similarity cache file
+    *
+    *  @return
+    *    File the input similarities are loaded from and saved to, empty for none
+    *
+    *  @remarks
+    *    The similarities are loaded from the file if they were computed from the same input data with the same
+    *    perplexities, distance metric, neighbor method and parameters of that method (which is checked by a
+    *    checksum), otherwise they are computed and saved to the file. Runs that only change the iterations, the
+    *    random seed, the output dimensions or the gradient skip the neighbor search and the perplexity
+    *    calibration; the random seed of approximate neighbor searches is not part of the checksum. Precomputed
+    *    neighbors or similarities are not cached.
+    */
+    std::string similarityCacheFile() const;
+
+    /**
+    *  @brief
+    *    Set similarity cache file
+    *
+    *  @param[in] file
+    *    File the input similarities are loaded from and saved to, empty for none
+    *
+    *  @see similarityCacheFile()
+    */
+    void setSimilarityCacheFile(const std::string & file);
+
     /**
     *  @brief
     *    Get number of iterations
@@ -146,6 +472,31 @@ public:
     */
     void setIterations(unsigned int iterations);
 
+    /**
+    *  @brief
+    *    Get reorder interval
+    *
+    *  @return
+    *    Number of iterations between reorderings of the points, 0 if the points are never reordered
+    *
+    *  @remarks
+    *    The points can be reordered internally along the Z-order curve of the current embedding, so that points
+    *    processed one after another are close to each other, which improves the memory locality on large datasets.
+    *    The result is always stored in the order of the input.
+    */
+    unsigned int reorderInterval() const;
+
+    /**
+    *  @brief
+    *    Set reorder interval
+    *
+    *  @param[in] iterations
+    *    Number of iterations between reorderings of the points, 0 to disable reordering
+    *
+    *  @see reorderInterval()
+    */
+    void setReorderInterval(unsigned int iterations);
+
     /**
     *  @brief
     *    Get output dimensionality
@@ -329,6 +680,89 @@ public:
     */
     bool loadTSNE(const std::string & file);
 
+    /**
+    *  @brief
+    *    Loads precomputed nearest neighbors from a ".knn" file
+    *
+    *  @param[in] file
+    *    Input file path
+    *
+    *  @post
+    *    If this fuction returns true, the neighbors were loaded and run() can be called without a dataset.
+    *
+    *  @remarks
+    *    The file must contain the following binary information:
+    *    - int         number of datapoints
+    *    - int         number of neighbors per datapoint
+    *    - int...      the indices of the neighbors as an interleaved buffer (datapoints * neighbors)
+    *    - double...   the distances to the neighbors as an interleaved buffer (datapoints * neighbors)
+    *
+    *  @see setNeighbors()
+    */
+    bool loadNeighbors(const std::string & file);
+
+    /**
+    *  @brief
+    *    Loads precomputed input similarities from a ".p" file
+    *
+    *  @param[in] file
+    *    Input file path
+    *
+    *  @post
+    *    If this fuction returns true, the similarities were loaded and run() can be called without a dataset.
+    *
+    *  @remarks
+    *    The file must contain the following binary information:
+    *    - int         number of datapoints
+    *    - int         number of similarities
+    *    - int...      the offsets of the rows into the similarities (datapoints + 1)
+    *    - int...      the columns of the similarities
+    *    - double...   the similarities
+    *
+    *  @see setSimilarities()
+    */
+    bool loadSimilarities(const std::string & file);
+
+    /**
+    *  @brief
+    *    Sets precomputed nearest neighbors
+    *
+    *  @param[in] indices
+    *    Indices of the neighbors, one row of neighbors per datapoint
+    *
+    *  @param[in] distances
+    *    Distances to the neighbors in the same layout
+    *
+    *  @return
+    *    false if the neighbors are inconsistent, e.g. an index is out of range
+    *
+    *  @remarks
+    *    run() skips the neighbor search and computes the similarities of every point to its 3 * perplexity
+    *    nearest neighbors of the given ones, which do not need to be sorted. A point listed as its own neighbor
+    *    is ignored. The distances are expected in the metric of distanceMetric(), Euclidean distances unsquared
+    *    as most neighbor searches return them. Precomputed similarities take precedence over the neighbors, and
+    *    both take precedence over a loaded dataset.
+    */
+    bool setNeighbors(Vector2D<unsigned int> && indices, Vector2D<double> && distances);
+
+    /**
+    *  @brief
+    *    Sets precomputed input similarities
+    *
+    *  @param[in] similarities
+    *    Symmetric matrix of the similarities between the datapoints, the rows are the datapoints
+    *
+    *  @return
+    *    false if the matrix is inconsistent, e.g. a column is out of range
+    *
+    *  @remarks
+    *    run() uses the similarities as the joint probabilities P of t-SNE as they are, skipping the neighbor
+    *    search, the perplexity calibration and the symmetrization; they are only normalized to sum up to 1.
+    *
+    *  @see setNeighbors()
+    */
+    bool setSimilarities(SparseMatrix && similarities);
+
 
     //run method------------------------------------------------------------------------------------
 
@@ -337,7 +771,8 @@ public:
     *    Runs the algorithm
     *
     *  @pre
-    *    A dataset must be loaded by any of the "load" functions.
+    *    A dataset, precomputed neighbors or precomputed similarities must be loaded by any of the "load" or
+    *    "set" functions.
     *
     *  @post
     *    The result is computed and ready to be saved by any of the "save" functions.
@@ -414,27 +849,57 @@ public:
 
 protected:
     void runApproximation();
+    template<unsigned int D>
+    void learnEmbedding(SparseMatrix & similarities);
     void runExact();
 
     template<unsigned int D>
-    Vector2D<double> computeGradient(SparseMatrix & similarities);
-    Vector2D<double> computeGradientExact(const Vector2D<double> & Perplexity);
-    template<unsigned int D>
-    double evaluateError(SparseMatrix & similarities);
-    double evaluateErrorExact(const Vector2D<double> & Perplexity);
+    const Vector2D<double> & computeGradient(SparseMatrix & similarities, SpacePartitioningTree<D> & tree,
+                                             FFTInterpolation<D> & interpolation, GradientWorkspace & workspace,
+                                             double & sumQ);
+    const Vector2D<double> & computeGradientExact(const Vector2D<double> & Perplexity, GradientWorkspace & workspace);
+    double evaluateError(const SparseMatrix & similarities, double sumQ) const;
+    double evaluateErrorExact(const Vector2D<double> & Perplexity, GradientWorkspace & workspace);
     void computeGaussianPerplexity(SparseMatrix & similarities) const;
+    void computeGaussianPerplexityFromNeighbors(SparseMatrix & similarities) const;
+    void calibrateSimilarities(SparseMatrix & similarities) const;
+    void computeConditionalSimilarities(const double * distances, unsigned int neighbors, double perplexity,
+                                        double * similarities) const;
+    double maximumPerplexity() const;
+    unsigned int neighborCount(unsigned int point, unsigned int neighbors) const;
+    std::uint64_t similarityCacheKey() const;
+    bool loadSimilarityCache(SparseMatrix & similarities, std::uint64_t key) const;
+    void saveSimilarityCache(const SparseMatrix & similarities, std::uint64_t key) const;
+    NeighborMethod resolveNeighborMethod() const;
+    std::unique_ptr<NeighborSearch> createNeighborSearch(unsigned int neighbors) const;
     Vector2D<double> computeGaussianPerplexityExact();
+    Vector2D<double> computeInputDistances() const;
+    void normalizeInput();
 
     // params
     double       m_perplexity;         ///< balance local/global data aspects, see documentation of perplexity()
+    std::vector<double> m_perplexities;      ///< perplexities of multi-scale similarities, empty for m_perplexity
+    std::vector<double> m_pointPerplexities; ///< perplexity of every point, empty for m_perplexity
     double       m_gradientAccuracy;   ///< used as the width for the gauss sampling kernel
+    GradientMethod m_gradientMethod;   ///< approximation of the repulsive forces
+    NeighborMethod m_neighborMethod;   ///< search of the nearest neighbors of the input points
+    DistanceMetric m_distanceMetric;   ///< metric of the distances between the input points
+    unsigned int m_randomProjectionTrees; ///< trees of the random projection forest neighbor search
+    unsigned int m_neighborSearchBudget;  ///< candidates per approximate neighbor search, 0 for the default
+    double       m_neighborDescentThreshold; ///< fraction of new neighbors per iteration that ends NN-Descent
+    std::string  m_neighborIndexFile;  ///< file the neighbor search index is loaded from and saved to
+    std::string  m_similarityCacheFile; ///< file the input similarities are loaded from and saved to
     unsigned int m_iterations;         ///< defines how many iterations the algorithm does in run()
+    unsigned int m_reorderInterval;    ///< iterations between spatial reorderings of the points, 0 for none
 
     // dataset
     unsigned int m_outputDimensions;   ///< dimensionality of the result
     unsigned int m_inputDimensions;    ///< dimensionality of the input; set during load
     unsigned int m_dataSize;           ///< size of data; set during load
 	Vector2D<double> m_data;           ///< loaded data
+    Vector2D<unsigned int> m_neighborIndices;  ///< precomputed neighbors of every point; set during load
+    Vector2D<double> m_neighborDistances;      ///< distances to the precomputed neighbors; set during load
+    SparseMatrix m_inputSimilarities;  ///< precomputed input similarities; set during load
     unsigned long m_seed;              ///< seed for random number generator
     std::mt19937 m_gen;                ///< random number generator
 
@@ -442,10 +907,17 @@ protected:
     std::string  m_outputFile;         ///< path and basename used to create output files
 	Vector2D<double> m_result;         ///< computation results
 
+    // statistics
+    std::chrono::duration<double> m_treeBuildTime; ///< time building trees since the last report
+    std::chrono::duration<double> m_forceTime;     ///< time computing forces since the last report
+
     //helper
     static Vector2D<double> computeSquaredEuclideanDistance(const Vector2D<double> & points);
+    static void computeSquaredEuclideanDistance(const Vector2D<double> & points, Vector2D<double> & distances);
     void symmetrizeMatrix(SparseMatrix & similarities);
     static void zeroMean(Vector2D<double>& points);
+    static void permuteRows(Vector2D<double> & matrix, const std::vector<unsigned int> & permutation);
+    static void permuteSimilarities(SparseMatrix & similarities, const std::vector<unsigned int> & permutation);
     static void normalize(Vector2D<double>& vec);
     double gaussNumber();
 };
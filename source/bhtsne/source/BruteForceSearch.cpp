@@ -0,0 +1,182 @@
+#include "BruteForceSearch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "VantagePointTree.h"
+
+
+using namespace bhtsne;
+
+
+BruteForceSearch::BruteForceSearch(unsigned int neighbors, const Distance & distance)
+    : m_data(nullptr)
+    , m_dimensions(0)
+    , m_size(0)
+    , m_neighbors(neighbors)
+    , m_distance(distance)
+{
+}
+
+void BruteForceSearch::create(const Vector2D<double> & data)
+{
+    m_data = &data;
+    m_dimensions = static_cast<unsigned int>(data.width());
+    m_size = static_cast<unsigned int>(data.size() / data.width());
+    m_neighbors = std::min(m_neighbors, m_size > 0 ? m_size - 1 : 0);
+    m_indices.resize(static_cast<std::size_t>(m_size) * m_neighbors);
+    m_distances.resize(m_indices.size());
+
+    const auto cosine = m_distance.metric() == DistanceMetric::Cosine;
+    auto norms = std::vector<double>(usesDotProducts() ? m_size : 0);
+    #pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(norms.size()); ++i)
+    {
+        const auto squaredNorm = VantagePointTree::dotProduct(data[i], data[i], m_dimensions);
+        // points without direction get the cosine distance 1 to all others
+        norms[i] = !cosine ? squaredNorm : (squaredNorm > 0.0 ? 1.0 / std::sqrt(squaredNorm) : 0.0);
+    }
+
+    const auto blocks = static_cast<int>((m_size + s_queryBlock - 1) / s_queryBlock);
+    #pragma omp parallel for schedule(dynamic)
+    for (int block = 0; block < blocks; ++block)
+    {
+        const auto begin = block * s_queryBlock;
+        searchBlock(begin, std::min(begin + s_queryBlock, m_size), norms);
+    }
+}
+
+bool BruteForceSearch::usesDotProducts() const
+{
+    return m_distance.metric() == DistanceMetric::Euclidean || m_distance.metric() == DistanceMetric::Cosine
+        || m_distance.metric() == DistanceMetric::NormalizedInnerProduct;
+}
+
+void BruteForceSearch::searchBlock(unsigned int begin, unsigned int end, const std::vector<double> & norms)
+{
+    using Candidate = std::pair<double, unsigned int>;
+
+    // Max-heap of the nearest points found so far per query of the block
+    auto heaps = std::vector<std::vector<Candidate>>(end - begin);
+    for (auto & heap : heaps)
+    {
+        heap.reserve(m_neighbors);
+    }
+    const auto offer = [this](std::vector<Candidate> & heap, double distance, unsigned int index)
+    {
+        if (heap.size() < m_neighbors)
+        {
+            heap.emplace_back(distance, index);
+            std::push_heap(heap.begin(), heap.end());
+        }
+        else if (m_neighbors > 0 && distance < heap.front().first)
+        {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = Candidate(distance, index);
+            std::push_heap(heap.begin(), heap.end());
+        }
+    };
+
+    // Distances of the metrics that are defined by dot products
+    const auto metric = m_distance.metric();
+    const auto productDistance = [metric, &norms](unsigned int query, unsigned int other, double product)
+    {
+        switch (metric)
+        {
+        case DistanceMetric::Cosine:
+            return 1.0 - product * norms[query] * norms[other];
+        case DistanceMetric::NormalizedInnerProduct:
+            return 1.0 - product;
+        default:
+            return norms[query] + norms[other] - 2.0 * product;
+        }
+    };
+
+    // Compare the block to one tile of points after the other, 4 points at a time
+    const auto tileSize = std::max(4u, s_tileBytes / static_cast<unsigned int>(sizeof(double) * m_dimensions)) & ~3u;
+    const auto dotProducts = usesDotProducts();
+    for (auto tileBegin = 0u; tileBegin < m_size; tileBegin += tileSize)
+    {
+        const auto tileEnd = std::min(tileBegin + tileSize, m_size);
+        for (auto query = begin; query < end; ++query)
+        {
+            const auto point = (*m_data)[query];
+            auto & heap = heaps[query - begin];
+            auto other = tileBegin;
+            double products[4];
+            for (; dotProducts && other + 4 <= tileEnd; other += 4)
+            {
+                VantagePointTree::dotProducts4(point, (*m_data)[other], m_dimensions, products);
+                for (auto i = 0u; i < 4; ++i)
+                {
+                    if (other + i != query)
+                    {
+                        offer(heap, productDistance(query, other + i, products[i]), other + i);
+                    }
+                }
+            }
+            for (; other < tileEnd; ++other)
+            {
+                if (other != query)
+                {
+                    offer(heap, m_distance(point, (*m_data)[other], m_dimensions), other);
+                }
+            }
+        }
+    }
+
+    // The expanded distances cancel for close points, the distances of the neighbors are computed directly
+    for (auto query = begin; query < end; ++query)
+    {
+        auto & heap = heaps[query - begin];
+        for (auto & candidate : heap)
+        {
+            candidate.first = m_distance((*m_data)[query], (*m_data)[candidate.second], m_dimensions);
+        }
+        std::sort(heap.begin(), heap.end());
+        for (unsigned int n = 0; n < heap.size(); ++n)
+        {
+            m_indices[static_cast<std::size_t>(query) * m_neighbors + n] = heap[n].second;
+            m_distances[static_cast<std::size_t>(query) * m_neighbors + n] = heap[n].first;
+        }
+    }
+}
+
+unsigned int BruteForceSearch::search(const double * target, unsigned int k, unsigned int * indices,
+                                      double * distances) const
+{
+    auto candidates = std::vector<std::pair<double, unsigned int>>(m_size);
+    for (unsigned int i = 0; i < m_size; ++i)
+    {
+        candidates[i] = std::make_pair(m_distance((*m_data)[i], target, m_dimensions), i);
+    }
+
+    const auto found = std::min(k, m_size);
+    std::partial_sort(candidates.begin(), candidates.begin() + found, candidates.end());
+    for (unsigned int i = 0; i < found; ++i)
+    {
+        distances[i] = candidates[i].first;
+        indices[i] = candidates[i].second;
+    }
+    return found;
+}
+
+unsigned int BruteForceSearch::searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                             double * distances) const
+{
+    if (k == 0)
+    {
+        return 0;
+    }
+
+    // The point itself and its neighbors computed on creation
+    indices[0] = index;
+    distances[0] = 0.0;
+    const auto found = std::min(k, m_neighbors + 1);
+    std::copy(m_indices.begin() + static_cast<std::size_t>(index) * m_neighbors,
+              m_indices.begin() + static_cast<std::size_t>(index) * m_neighbors + found - 1, indices + 1);
+    std::copy(m_distances.begin() + static_cast<std::size_t>(index) * m_neighbors,
+              m_distances.begin() + static_cast<std::size_t>(index) * m_neighbors + found - 1, distances + 1);
+    return found;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+
+#include <bhtsne/Vector2D.h>
+
+#include "Distance.h"
+#include "NeighborSearch.h"
+
+
+namespace bhtsne {
+
+    // Exact nearest neighbor search comparing all pairs of points: the neighbors of all points are computed on
+    // creation from the distances ||x||^2 + ||y||^2 - 2 x.y, tile by tile with blocked dot products, which is faster
+    // than a tree on high-dimensional inputs that are not too large; the cosine distances are computed from the dot
+    // products as well, the other metrics directly
+    class BruteForceSearch : public NeighborSearch
+    {
+    public:
+        // neighbors is the number of neighbors per point computed on creation
+        BruteForceSearch(unsigned int neighbors, const Distance & distance);
+
+        void create(const Vector2D<double> & data) override;
+        unsigned int search(const double * target, unsigned int k, unsigned int * indices,
+                            double * distances) const override;
+        unsigned int searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                   double * distances) const override;
+
+    protected:
+        // Points per block of queries that share a tile of points, and bytes of the points in a tile that should
+        // stay in the cache while the block is compared to them
+        static constexpr unsigned int s_queryBlock = 64;
+        static constexpr unsigned int s_tileBytes = 1 << 17;
+
+        // norms are the squared norms of the points for the Euclidean distance and their inverse norms for the
+        // cosine distance
+        void searchBlock(unsigned int begin, unsigned int end, const std::vector<double> & norms);
+        bool usesDotProducts() const;
+
+        const Vector2D<double> * m_data;
+        unsigned int m_dimensions;
+        unsigned int m_size;
+        unsigned int m_neighbors;
+        Distance m_distance;
+        // m_neighbors per point, nearest first
+        std::vector<unsigned int> m_indices;
+        std::vector<double> m_distances;
+    };
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace bhtsne {
+
+    // FNV-1a over the given bytes, continuing from the checksum of the preceding bytes
+    inline std::uint64_t checksum(const void * data, std::size_t bytes, std::uint64_t value = 0xcbf29ce484222325ull)
+    {
+        const auto begin = static_cast<const unsigned char *>(data);
+        for (std::size_t i = 0; i < bytes; ++i)
+        {
+            value = (value ^ begin[i]) * 0x100000001b3ull;
+        }
+        return value;
+    }
+}
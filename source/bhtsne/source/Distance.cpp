@@ -0,0 +1,78 @@
+#include "Distance.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "SimdKernels.h"
+
+
+using namespace bhtsne;
+
+
+Distance::Distance(DistanceMetric metric)
+    : m_metric(metric)
+{
+    const auto & kernels = bhtsne::kernels().distances;
+    switch (metric)
+    {
+    case DistanceMetric::Cosine:
+        m_function = kernels.cosineDistance;
+        break;
+    case DistanceMetric::NormalizedInnerProduct:
+        m_function = kernels.innerProductDistance;
+        break;
+    case DistanceMetric::Manhattan:
+        m_function = kernels.manhattanDistance;
+        break;
+    case DistanceMetric::Hamming:
+        m_function = kernels.hammingDistance;
+        break;
+    default:
+        m_function = kernels.squaredEuclideanDistance;
+        break;
+    }
+}
+
+DistanceMetric Distance::metric() const
+{
+    return m_metric;
+}
+
+double Distance::metricDistance(double distance) const
+{
+    switch (m_metric)
+    {
+    case DistanceMetric::Euclidean:
+    case DistanceMetric::Cosine:
+    case DistanceMetric::NormalizedInnerProduct:
+        // rounding may make distances of (almost) equal rows negative
+        return distance > 0.0 ? std::sqrt(distance) : 0.0;
+    default:
+        return distance;
+    }
+}
+
+Vector2D<double> Distance::packBits(const Vector2D<double> & data)
+{
+    const auto height = data.height();
+    const auto width = data.width();
+    const auto words = (width + 63) / 64;
+    auto packed = Vector2D<double>(height, words, 0.0);
+    for (size_t i = 0; i < height; ++i)
+    {
+        for (size_t word = 0; word < words; ++word)
+        {
+            std::uint64_t bits = 0;
+            for (size_t bit = 0; bit < 64 && word * 64 + bit < width; ++bit)
+            {
+                if (data[i][word * 64 + bit] != 0.0)
+                {
+                    bits |= std::uint64_t(1) << bit;
+                }
+            }
+            std::memcpy(packed[i] + word, &bits, sizeof(bits));
+        }
+    }
+    return packed;
+}
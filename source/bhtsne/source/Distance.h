@@ -0,0 +1,36 @@
+#pragma once
+
+#include <bhtsne/TSNE.h>
+#include <bhtsne/Vector2D.h>
+
+
+namespace bhtsne {
+
+    // Distance between rows of the input data according to a DistanceMetric, computed by the kernels of the
+    // instruction set selected at runtime; Euclidean distances are squared like in the similarities
+    class Distance
+    {
+    public:
+        explicit Distance(DistanceMetric metric = DistanceMetric::Euclidean);
+
+        DistanceMetric metric() const;
+
+        double operator()(const double * a, const double * b, unsigned int dimensions) const
+        {
+            return m_function(a, b, dimensions);
+        }
+
+        // Monotone transformation of a distance into one that satisfies the triangle inequality, which trees use to
+        // prune their search: the square root of squared Euclidean and of cosine distances (which is proportional
+        // to the Euclidean distance of the normalized rows), the distance itself for the other metrics
+        double metricDistance(double distance) const;
+
+        // Rows of binary data packed into 64 bit words (stored as doubles) for the Hamming distance, every non-zero
+        // value is a set bit
+        static Vector2D<double> packBits(const Vector2D<double> & data);
+
+    protected:
+        DistanceMetric m_metric;
+        double (*m_function)(const double * a, const double * b, unsigned int dimensions);
+    };
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <complex>
+#include <vector>
+
+#include <bhtsne/Vector2D.h>
+
+
+namespace bhtsne {
+
+    // Approximation of the repulsive t-SNE forces of all points at once (FIt-SNE): the kernel is interpolated
+    // on an equispaced grid, whose charges are convolved with the kernel by FFT
+    template<unsigned int D>
+    class FFTInterpolation
+    {
+    public:
+        FFTInterpolation();
+        FFTInterpolation(const FFTInterpolation & other) = delete;
+        FFTInterpolation(FFTInterpolation && other) = default;
+
+        // Add the non-edge forces of all points (forces holds D values per point) and their normalization term
+        void computeNonEdgeForces(const Vector2D<double> & data, double * forces, double & forceSum);
+
+    protected:
+        // Interpolation nodes per box and dimension (Lagrange polynomials of degree s_nodesPerBox - 1)
+        static constexpr unsigned int s_nodesPerBox = 3;
+        // Boxes per dimension, at least s_minimumBoxes and at least one per unit of the embedding, but limited so that
+        // the FFT grid has at most 2048 values per dimension
+        static constexpr unsigned int s_minimumBoxes = 40;
+        static constexpr unsigned int s_maximumBoxes = 1024 / s_nodesPerBox;
+        // Charges per point: 1, every coordinate, and the squared norm
+        static constexpr unsigned int s_terms = D + 2;
+
+        void setupGrid(const Vector2D<double> & data);
+        void computeKernel();
+        void computeWeights(const Vector2D<double> & data);
+        void spreadCharges(const Vector2D<double> & data, unsigned int term);
+        void gatherPotentials(unsigned int term);
+        void fft(bool inverse, bool padded);
+        void fftLine(std::complex<double> * values, bool inverse) const;
+
+        unsigned int m_numberOfPoints;
+        // Grid of m_gridSize interpolation nodes per dimension, padded to m_fftSize for a non-circular convolution
+        unsigned int m_boxes;
+        unsigned int m_gridSize;
+        unsigned int m_fftSize;
+        std::size_t m_fftLength;
+        double m_lower;
+        double m_boxWidth;
+        std::array<std::size_t, D> m_strides;
+
+        // Charges (as real and imaginary part, so two terms are convolved at once) and the transformed kernel,
+        // which is real as the kernel is symmetric
+        std::vector<std::complex<double>> m_grid;
+        std::vector<double> m_kernel;
+        std::vector<std::complex<double>> m_twiddles;
+        // First interpolation node and node weights per point and dimension, potentials per point and term
+        std::vector<unsigned int> m_firstNodes;
+        std::vector<double> m_weights;
+        std::vector<double> m_potentials;
+    };
+}
+
+#include "FFTInterpolation.inl"
@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+#include "FFTInterpolation.h"
+
+
+namespace bhtsne {
+
+
+template<unsigned int D>
+FFTInterpolation<D>::FFTInterpolation()
+    : m_numberOfPoints(0)
+    , m_boxes(0)
+    , m_gridSize(0)
+    , m_fftSize(0)
+    , m_fftLength(0)
+    , m_lower(0.0)
+    , m_boxWidth(0.0)
+    , m_strides()
+{
+}
+
+template<unsigned int D>
+void FFTInterpolation<D>::computeNonEdgeForces(const Vector2D<double> & data, double * forces, double & forceSum)
+{
+    assert(data.width() == D);
+    setupGrid(data);
+    computeKernel();
+    computeWeights(data);
+
+    // potentials of every term at the interpolation nodes, interpolated at the points
+    m_potentials.resize(m_numberOfPoints * s_terms);
+    for (unsigned int term = 0; term < s_terms; term += 2)
+    {
+        spreadCharges(data, term);
+        fft(false, true);
+        const auto length = static_cast<int>(m_fftLength);
+        #pragma omp parallel for
+        for (int i = 0; i < length; ++i)
+        {
+            m_grid[i] *= m_kernel[i];
+        }
+        fft(true, true);
+        gatherPotentials(term);
+    }
+
+    // with the squared kernel K(y_i, y_j) = (1 + |y_i - y_j|^2)^-2 the repulsive force is
+    // sum_j K * (y_i - y_j) = y_i * sum_j K - sum_j K * y_j and the normalization term is
+    // sum_j K * (1 + |y_i|^2 - 2 y_i * y_j + |y_j|^2), which includes the self-interaction of 1
+    double sumQ = 0.0;
+    const auto numberOfPoints = static_cast<int>(m_numberOfPoints);
+    #pragma omp parallel for reduction(+:sumQ)
+    for (int i = 0; i < numberOfPoints; ++i)
+    {
+        const auto point = data[i];
+        const auto potentials = m_potentials.data() + i * s_terms;
+        double squaredNorm = 0.0;
+        double mixed = 0.0;
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            forces[i * D + d] += point[d] * potentials[0] - potentials[1 + d];
+            squaredNorm += point[d] * point[d];
+            mixed += point[d] * potentials[1 + d];
+        }
+        sumQ += (1.0 + squaredNorm) * potentials[0] - 2.0 * mixed + potentials[D + 1];
+    }
+    forceSum += sumQ - m_numberOfPoints;
+}
+
+// Fit a grid of equally sized boxes around the data (the same extent in all dimensions)
+template<unsigned int D>
+void FFTInterpolation<D>::setupGrid(const Vector2D<double> & data)
+{
+    m_numberOfPoints = static_cast<unsigned int>(data.height());
+    auto lower = std::numeric_limits<double>::max();
+    auto upper = std::numeric_limits<double>::lowest();
+    const auto values = data[0];
+    for (std::size_t i = 0; i < data.size(); ++i)
+    {
+        lower = std::min(lower, values[i]);
+        upper = std::max(upper, values[i]);
+    }
+
+    // boxes should be at most one unit wide; as the radix 2 FFT needs a power of two of at least twice the number of
+    // interpolation nodes anyway, the boxes are refined to fill it
+    auto range = std::max(upper - lower, static_cast<double>(std::numeric_limits<float>::epsilon()));
+    auto boxes = std::min(std::max(static_cast<unsigned int>(std::ceil(range)), s_minimumBoxes), s_maximumBoxes);
+    auto fftSize = 1u;
+    while (fftSize < 2 * s_nodesPerBox * boxes)
+    {
+        fftSize *= 2;
+    }
+    m_boxes = fftSize / (2 * s_nodesPerBox);
+    m_boxWidth = range / m_boxes;
+    m_lower = lower;
+    m_gridSize = m_boxes * s_nodesPerBox;
+
+    if (fftSize != m_fftSize)
+    {
+        m_fftSize = fftSize;
+        const auto pi = std::acos(-1.0);
+        m_twiddles.resize(m_fftSize / 2);
+        for (unsigned int k = 0; k < m_fftSize / 2; ++k)
+        {
+            m_twiddles[k] = std::polar(1.0, -2.0 * pi * k / m_fftSize);
+        }
+    }
+
+    m_fftLength = 1;
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        m_strides[d] = m_fftLength;
+        m_fftLength *= m_fftSize;
+    }
+    m_grid.resize(m_fftLength);
+    m_kernel.resize(m_fftLength);
+}
+
+// Transform the squared kernel between all pairs of interpolation nodes, stored with negative offsets wrapped around
+template<unsigned int D>
+void FFTInterpolation<D>::computeKernel()
+{
+    const auto spacing = m_boxWidth / s_nodesPerBox;
+    const auto gridSize = static_cast<int>(m_gridSize);
+    const auto fftSize = static_cast<int>(m_fftSize);
+    const auto length = static_cast<int>(m_fftLength);
+
+    #pragma omp parallel for
+    for (int i = 0; i < length; ++i)
+    {
+        auto rest = i;
+        auto squaredDistance = 0.0;
+        auto inside = true;
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            auto index = rest % fftSize;
+            rest /= fftSize;
+            auto offset = index < gridSize ? index : index - fftSize;
+            inside = inside && (index < gridSize || index > fftSize - gridSize);
+            squaredDistance += offset * spacing * offset * spacing;
+        }
+        auto kernel = 1.0 / (1.0 + squaredDistance);
+        m_grid[i] = inside ? kernel * kernel : 0.0;
+    }
+
+    // the normalization of the inverse transform is applied to the kernel
+    fft(false, false);
+    #pragma omp parallel for
+    for (int i = 0; i < length; ++i)
+    {
+        m_kernel[i] = m_grid[i].real() / m_fftLength;
+    }
+}
+
+// Compute the Lagrange polynomials of the nodes of the box of every point at its position
+template<unsigned int D>
+void FFTInterpolation<D>::computeWeights(const Vector2D<double> & data)
+{
+    m_firstNodes.resize(m_numberOfPoints * D);
+    m_weights.resize(m_numberOfPoints * D * s_nodesPerBox);
+
+    // the nodes are placed at the centers of s_nodesPerBox equally sized parts of every box
+    auto nodes = std::array<double, s_nodesPerBox>();
+    for (unsigned int j = 0; j < s_nodesPerBox; ++j)
+    {
+        nodes[j] = (j + 0.5) / s_nodesPerBox;
+    }
+
+    const auto numberOfPoints = static_cast<int>(m_numberOfPoints);
+    #pragma omp parallel for
+    for (int i = 0; i < numberOfPoints; ++i)
+    {
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            auto position = (data[i][d] - m_lower) / m_boxWidth;
+            auto box = std::min(static_cast<unsigned int>(position), m_boxes - 1);
+            auto relative = position - box;
+            m_firstNodes[i * D + d] = box * s_nodesPerBox;
+
+            auto weights = m_weights.data() + (i * D + d) * s_nodesPerBox;
+            for (unsigned int j = 0; j < s_nodesPerBox; ++j)
+            {
+                weights[j] = 1.0;
+                for (unsigned int k = 0; k < s_nodesPerBox; ++k)
+                {
+                    if (k != j)
+                    {
+                        weights[j] *= (relative - nodes[k]) / (nodes[j] - nodes[k]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Distribute the charges of term and term + 1 of all points to the interpolation nodes of their boxes
+template<unsigned int D>
+void FFTInterpolation<D>::spreadCharges(const Vector2D<double> & data, unsigned int term)
+{
+    auto nodeCombinations = 1u;
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        nodeCombinations *= s_nodesPerBox;
+    }
+
+    auto chargeOf = [](const double * point, unsigned int term)
+    {
+        if (term == 0)
+        {
+            return 1.0;
+        }
+        if (term <= D)
+        {
+            return point[term - 1];
+        }
+        auto squaredNorm = 0.0;
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            squaredNorm += point[d] * point[d];
+        }
+        return squaredNorm;
+    };
+
+    // points of different threads would share nodes, so the charges are spread serially
+    std::fill(m_grid.begin(), m_grid.end(), 0.0);
+    for (unsigned int i = 0; i < m_numberOfPoints; ++i)
+    {
+        const auto point = data[i];
+        auto charge = std::complex<double>(chargeOf(point, term), term + 1 < s_terms ? chargeOf(point, term + 1) : 0.0);
+        for (unsigned int combination = 0; combination < nodeCombinations; ++combination)
+        {
+            auto rest = combination;
+            auto index = std::size_t(0);
+            auto weight = 1.0;
+            for (unsigned int d = 0; d < D; ++d)
+            {
+                auto j = rest % s_nodesPerBox;
+                rest /= s_nodesPerBox;
+                index += (m_firstNodes[i * D + d] + j) * m_strides[d];
+                weight *= m_weights[(i * D + d) * s_nodesPerBox + j];
+            }
+            m_grid[index] += weight * charge;
+        }
+    }
+}
+
+// Interpolate the potentials of term and term + 1 at the interpolation nodes at every point
+template<unsigned int D>
+void FFTInterpolation<D>::gatherPotentials(unsigned int term)
+{
+    auto nodeCombinations = 1u;
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        nodeCombinations *= s_nodesPerBox;
+    }
+
+    const auto numberOfPoints = static_cast<int>(m_numberOfPoints);
+    #pragma omp parallel for
+    for (int i = 0; i < numberOfPoints; ++i)
+    {
+        auto potential = std::complex<double>(0.0, 0.0);
+        for (unsigned int combination = 0; combination < nodeCombinations; ++combination)
+        {
+            auto rest = combination;
+            auto index = std::size_t(0);
+            auto weight = 1.0;
+            for (unsigned int d = 0; d < D; ++d)
+            {
+                auto j = rest % s_nodesPerBox;
+                rest /= s_nodesPerBox;
+                index += (m_firstNodes[i * D + d] + j) * m_strides[d];
+                weight *= m_weights[(i * D + d) * s_nodesPerBox + j];
+            }
+            potential += weight * m_grid[index];
+        }
+
+        m_potentials[i * s_terms + term] = potential.real();
+        if (term + 1 < s_terms)
+        {
+            m_potentials[i * s_terms + term + 1] = potential.imag();
+        }
+    }
+}
+
+// Transform the grid along every dimension (the inverse transform is not normalized). For padded grids, values
+// beyond the interpolation nodes are zero before the forward transform and not needed after the inverse transform,
+// so lines consisting of those values only are skipped.
+template<unsigned int D>
+void FFTInterpolation<D>::fft(bool inverse, bool padded)
+{
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        // lines along d are enumerated by their positions in the other dimensions; all dimensions before d are
+        // transformed already, all after d are not transformed yet
+        auto extents = std::array<unsigned int, D>();
+        auto lines = 1;
+        for (unsigned int other = 0; other < D; ++other)
+        {
+            auto skipped = padded && (inverse ? other < d : other > d);
+            extents[other] = other == d ? 1 : (skipped ? m_gridSize : m_fftSize);
+            lines *= extents[other];
+        }
+
+        const auto stride = m_strides[d];
+        if (stride == 1)
+        {
+            #pragma omp parallel for
+            for (int l = 0; l < lines; ++l)
+            {
+                auto rest = static_cast<unsigned int>(l);
+                auto first = std::size_t(0);
+                for (unsigned int other = 1; other < D; ++other)
+                {
+                    first += (rest % extents[other]) * m_strides[other];
+                    rest /= extents[other];
+                }
+                fftLine(m_grid.data() + first, inverse);
+            }
+            continue;
+        }
+
+        // strided lines are copied in batches of lines that are adjacent in the first dimension to use cache lines
+        const auto batchSize = 8u;
+        const auto batchesPerRow = static_cast<int>((extents[0] + batchSize - 1) / batchSize);
+        const auto batches = lines / static_cast<int>(extents[0]) * batchesPerRow;
+        #pragma omp parallel
+        {
+            auto batch = std::vector<std::complex<double>>(batchSize * m_fftSize);
+            #pragma omp for
+            for (int b = 0; b < batches; ++b)
+            {
+                auto begin = (b % batchesPerRow) * batchSize;
+                auto count = std::min(batchSize, extents[0] - begin);
+                auto rest = static_cast<unsigned int>(b / batchesPerRow);
+                auto first = std::size_t(begin);
+                for (unsigned int other = 1; other < D; ++other)
+                {
+                    first += (rest % extents[other]) * m_strides[other];
+                    rest /= extents[other];
+                }
+
+                for (unsigned int k = 0; k < m_fftSize; ++k)
+                {
+                    for (unsigned int i = 0; i < count; ++i)
+                    {
+                        batch[i * m_fftSize + k] = m_grid[first + k * stride + i];
+                    }
+                }
+                for (unsigned int i = 0; i < count; ++i)
+                {
+                    fftLine(batch.data() + i * m_fftSize, inverse);
+                }
+                for (unsigned int k = 0; k < m_fftSize; ++k)
+                {
+                    for (unsigned int i = 0; i < count; ++i)
+                    {
+                        m_grid[first + k * stride + i] = batch[i * m_fftSize + k];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Iterative radix 2 Cooley-Tukey FFT of m_fftSize values
+template<unsigned int D>
+void FFTInterpolation<D>::fftLine(std::complex<double> * values, bool inverse) const
+{
+    // bit reversal permutation
+    for (unsigned int i = 1, j = 0; i < m_fftSize; ++i)
+    {
+        auto bit = m_fftSize >> 1;
+        for (; j & bit; bit >>= 1)
+        {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j)
+        {
+            std::swap(values[i], values[j]);
+        }
+    }
+
+    for (unsigned int length = 2; length <= m_fftSize; length *= 2)
+    {
+        const auto half = length / 2;
+        const auto step = m_fftSize / length;
+        for (unsigned int i = 0; i < m_fftSize; i += length)
+        {
+            for (unsigned int j = 0; j < half; ++j)
+            {
+                auto twiddle = inverse ? std::conj(m_twiddles[j * step]) : m_twiddles[j * step];
+                auto even = values[i + j];
+                auto odd = values[i + j + half] * twiddle;
+                values[i + j] = even + odd;
+                values[i + j + half] = even - odd;
+            }
+        }
+    }
+}
+
+
+} // namespace bhtsne
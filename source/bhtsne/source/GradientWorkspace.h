@@ -0,0 +1,48 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#include <bhtsne/Vector2D.h>
+
+
+namespace bhtsne {
+
+    // Buffers of the gradient computation that are allocated once per run and reused in every iteration
+    struct GradientWorkspace
+    {
+        // Resize the buffers of the approximated gradient if necessary and clear the accumulated forces
+        void prepare(unsigned int size, unsigned int dimensions)
+        {
+            prepareBuffer(negativeForces, size, dimensions);
+            prepareBuffer(gradients, size, dimensions);
+        }
+
+        // Resize the buffers of the exact gradient if necessary and clear the accumulated gradients
+        void prepareExact(unsigned int size, unsigned int dimensions)
+        {
+            prepareBuffer(gradients, size, dimensions);
+            if (distances.size() != std::size_t(size) * size)
+            {
+                distances.initialize(size, size);
+                Q.initialize(size, size);
+            }
+        }
+
+        static void prepareBuffer(Vector2D<double> & buffer, unsigned int height, unsigned int width)
+        {
+            if (buffer.size() != std::size_t(height) * width || buffer.width() != width)
+            {
+                buffer.initialize(height, width);
+            }
+            std::fill(buffer.begin(), buffer.end(), 0.0);
+        }
+
+        // Repulsive forces of the approximated gradient, the attractive forces are accumulated in the gradients
+        Vector2D<double> negativeForces;
+        Vector2D<double> gradients;
+        // Pairwise squared distances and output similarities of the exact gradient (N x N)
+        Vector2D<double> distances;
+        Vector2D<double> Q;
+    };
+}
@@ -0,0 +1,506 @@
+#include "HierarchicalNavigableSmallWorld.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <queue>
+
+#include "Checksum.h"
+
+
+using namespace bhtsne;
+
+
+namespace {
+
+    // Header of saved graphs
+    const char s_fileMagic[4] = { 'H', 'N', 'S', 'W' };
+    const std::uint32_t s_fileVersion = 2;
+
+    // Points visited by a search of the current thread, marked with the generation of the search
+    struct VisitedPoints
+    {
+        std::vector<std::uint32_t> generations;
+        std::uint32_t generation = 0;
+
+        void reset(unsigned int size)
+        {
+            ++generation;
+            if (generations.size() < size || generation == 0)
+            {
+                generations.assign(std::max<std::size_t>(size, generations.size()), 0);
+                generation = 1;
+            }
+        }
+
+        bool visit(unsigned int index)
+        {
+            if (generations[index] == generation)
+            {
+                return false;
+            }
+            generations[index] = generation;
+            return true;
+        }
+    };
+}
+
+
+HierarchicalNavigableSmallWorld::HierarchicalNavigableSmallWorld(unsigned long randomSeed, unsigned int searchBudget,
+                                                                 const Distance & distance)
+    : m_data(nullptr)
+    , m_dimensions(0)
+    , m_size(0)
+    , m_seed(randomSeed)
+    , m_searchBudget(searchBudget)
+    , m_distance(distance)
+    , m_entryPoint(0)
+    , m_maxLevel(0)
+{
+}
+
+HierarchicalNavigableSmallWorld::~HierarchicalNavigableSmallWorld()
+{
+#ifdef _OPENMP
+    for (auto & lock : m_locks)
+    {
+        omp_destroy_lock(&lock);
+    }
+#endif
+}
+
+void HierarchicalNavigableSmallWorld::create(const Vector2D<double> & data)
+{
+    m_data = &data;
+    m_dimensions = static_cast<unsigned int>(data.width());
+    m_size = static_cast<unsigned int>(data.size() / data.width());
+
+    // The levels are exponentially distributed, drawn from a hash of the seed and the point
+    const auto seed = hash(m_seed);
+    const auto levelFactor = 1.0 / std::log(static_cast<double>(s_connections));
+    m_levels.resize(m_size);
+    m_links.resize(m_size);
+    for (unsigned int i = 0; i < m_size; ++i)
+    {
+        const auto uniform = static_cast<double>((hash(seed ^ i) >> 11) + 1) / 9007199254740992.0;
+        m_levels[i] = static_cast<unsigned int>(-std::log(uniform) * levelFactor);
+        m_links[i].assign(linksOffset(m_levels[i] + 1), 0);
+    }
+#ifdef _OPENMP
+    while (m_locks.size() < m_size)
+    {
+        m_locks.emplace_back();
+        omp_init_lock(&m_locks.back());
+    }
+#endif
+
+    if (m_size == 0)
+    {
+        return;
+    }
+    m_entryPoint = 0;
+    m_maxLevel = m_levels[0];
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 1; i < static_cast<int>(m_size); ++i)
+    {
+        insert(i);
+    }
+}
+
+void HierarchicalNavigableSmallWorld::insert(unsigned int index)
+{
+    auto entryPoint = 0u;
+    auto maxLevel = 0u;
+    #pragma omp critical(hierarchicalNavigableSmallWorldEntryPoint)
+    {
+        entryPoint = m_entryPoint;
+        maxLevel = m_maxLevel;
+    }
+
+    // Descend to the level of the point, then link it on every level below with the nearest points found there
+    const auto target = (*m_data)[index];
+    const auto level = m_levels[index];
+    entryPoint = greedySearch(target, entryPoint, maxLevel, level, true);
+    auto entryPoints = std::vector<Candidate>{ Candidate(distance(index, entryPoint), entryPoint) };
+    for (auto l = std::min(level, maxLevel) + 1; l-- > 0;)
+    {
+        auto candidates = searchLevel(target, entryPoints, s_constructionWidth, l, true);
+        connect(index, selectNeighbors(candidates, s_connections), l);
+        entryPoints = std::move(candidates);
+    }
+
+    if (level > maxLevel)
+    {
+        #pragma omp critical(hierarchicalNavigableSmallWorldEntryPoint)
+        {
+            if (level > m_maxLevel)
+            {
+                m_entryPoint = index;
+                m_maxLevel = level;
+            }
+        }
+    }
+}
+
+void HierarchicalNavigableSmallWorld::connect(unsigned int index, const std::vector<Candidate> & neighbors,
+                                              unsigned int level)
+{
+    const auto maxLinks = level == 0 ? s_baseConnections : s_connections;
+    const auto offset = linksOffset(level);
+
+#ifdef _OPENMP
+    omp_set_lock(&m_locks[index]);
+#endif
+    // Another point may have linked back to this one already, its link is kept along with the neighbors; if there
+    // are too many, they are selected like the links of a neighbor below
+    auto & ownLinks = m_links[index];
+    auto candidates = std::vector<Candidate>();
+    for (const auto & neighbor : neighbors)
+    {
+        if (neighbor.second != index)
+        {
+            candidates.push_back(neighbor);
+        }
+    }
+    for (auto link = offset + 1; link < offset + 1 + ownLinks[offset]; ++link)
+    {
+        const auto known = std::any_of(candidates.begin(), candidates.end(), [&ownLinks, link](const Candidate & other){
+            return other.second == ownLinks[link]; });
+        if (!known)
+        {
+            candidates.emplace_back(distance(index, ownLinks[link]), ownLinks[link]);
+        }
+    }
+    if (candidates.size() > maxLinks)
+    {
+        std::sort(candidates.begin(), candidates.end());
+        candidates = selectNeighbors(candidates, maxLinks);
+    }
+    ownLinks[offset] = static_cast<unsigned int>(candidates.size());
+    for (unsigned int c = 0; c < candidates.size(); ++c)
+    {
+        ownLinks[offset + 1 + c] = candidates[c].second;
+    }
+#ifdef _OPENMP
+    omp_unset_lock(&m_locks[index]);
+#endif
+
+    // Link back, a neighbor with all links taken keeps the ones selected from its links and the point
+    for (const auto & neighbor : neighbors)
+    {
+        if (neighbor.second == index)
+        {
+            continue;
+        }
+#ifdef _OPENMP
+        omp_set_lock(&m_locks[neighbor.second]);
+#endif
+        auto & links = m_links[neighbor.second];
+        if (links[offset] < maxLinks)
+        {
+            links[offset + 1 + links[offset]++] = index;
+        }
+        else
+        {
+            auto candidates = std::vector<Candidate>{ Candidate(neighbor.first, index) };
+            for (auto link = offset + 1; link < offset + 1 + maxLinks; ++link)
+            {
+                candidates.emplace_back(distance(neighbor.second, links[link]), links[link]);
+            }
+            std::sort(candidates.begin(), candidates.end());
+
+            const auto selected = selectNeighbors(candidates, maxLinks);
+            links[offset] = static_cast<unsigned int>(selected.size());
+            for (unsigned int s = 0; s < selected.size(); ++s)
+            {
+                links[offset + 1 + s] = selected[s].second;
+            }
+        }
+#ifdef _OPENMP
+        omp_unset_lock(&m_locks[neighbor.second]);
+#endif
+    }
+}
+
+unsigned int HierarchicalNavigableSmallWorld::greedySearch(const double * target, unsigned int entryPoint,
+                                                           unsigned int fromLevel, unsigned int toLevel,
+                                                           bool locked) const
+{
+    // Move to the nearest linked point as long as there is one closer to target, on every level above toLevel
+    auto current = entryPoint;
+    auto currentDistance = m_distance((*m_data)[current], target, m_dimensions);
+    auto neighbors = std::vector<unsigned int>();
+    for (auto level = fromLevel; level > toLevel; --level)
+    {
+        for (auto changed = true; changed;)
+        {
+            changed = false;
+            links(current, level, neighbors, locked);
+            for (const auto neighbor : neighbors)
+            {
+                const auto neighborDistance = m_distance((*m_data)[neighbor], target, m_dimensions);
+                if (neighborDistance < currentDistance)
+                {
+                    current = neighbor;
+                    currentDistance = neighborDistance;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return current;
+}
+
+std::vector<HierarchicalNavigableSmallWorld::Candidate> HierarchicalNavigableSmallWorld::searchLevel(
+    const double * target, const std::vector<Candidate> & entryPoints, unsigned int width, unsigned int level,
+    bool locked) const
+{
+    thread_local auto visited = VisitedPoints();
+    visited.reset(m_size);
+
+    auto nearest = std::priority_queue<Candidate>();
+    auto candidates = std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>>();
+    for (const auto & entryPoint : entryPoints)
+    {
+        if (visited.visit(entryPoint.second))
+        {
+            candidates.push(entryPoint);
+            nearest.push(entryPoint);
+        }
+    }
+    while (nearest.size() > width)
+    {
+        nearest.pop();
+    }
+
+    auto neighbors = std::vector<unsigned int>();
+    while (!candidates.empty())
+    {
+        const auto candidate = candidates.top();
+        candidates.pop();
+        if (nearest.size() >= width && candidate.first > nearest.top().first)
+        {
+            break;
+        }
+
+        links(candidate.second, level, neighbors, locked);
+        for (const auto neighbor : neighbors)
+        {
+            if (!visited.visit(neighbor))
+            {
+                continue;
+            }
+            const auto neighborDistance = m_distance((*m_data)[neighbor], target, m_dimensions);
+            if (nearest.size() < width || neighborDistance < nearest.top().first)
+            {
+                candidates.emplace(neighborDistance, neighbor);
+                nearest.emplace(neighborDistance, neighbor);
+                if (nearest.size() > width)
+                {
+                    nearest.pop();
+                }
+            }
+        }
+    }
+
+    auto result = std::vector<Candidate>(nearest.size());
+    for (auto position = result.size(); position > 0; --position)
+    {
+        result[position - 1] = nearest.top();
+        nearest.pop();
+    }
+    return result;
+}
+
+std::vector<HierarchicalNavigableSmallWorld::Candidate> HierarchicalNavigableSmallWorld::selectNeighbors(
+    const std::vector<Candidate> & candidates, unsigned int maximum) const
+{
+    // Skipping candidates that are closer to a selected neighbor than to target spreads the links in all directions
+    auto selected = std::vector<Candidate>();
+    for (const auto & candidate : candidates)
+    {
+        if (selected.size() >= maximum)
+        {
+            break;
+        }
+        const auto covered = std::any_of(selected.begin(), selected.end(), [this, &candidate](const Candidate & other){
+            return distance(candidate.second, other.second) < candidate.first; });
+        if (!covered)
+        {
+            selected.push_back(candidate);
+        }
+    }
+    return selected;
+}
+
+void HierarchicalNavigableSmallWorld::links(unsigned int index, unsigned int level, std::vector<unsigned int> & result,
+                                            bool locked) const
+{
+    const auto offset = linksOffset(level);
+#ifdef _OPENMP
+    if (locked)
+    {
+        omp_set_lock(&m_locks[index]);
+    }
+#endif
+    const auto & links = m_links[index];
+    result.assign(links.begin() + offset + 1, links.begin() + offset + 1 + links[offset]);
+#ifdef _OPENMP
+    if (locked)
+    {
+        omp_unset_lock(&m_locks[index]);
+    }
+#else
+    (void)locked;
+#endif
+}
+
+std::size_t HierarchicalNavigableSmallWorld::linksOffset(unsigned int level) const
+{
+    return level == 0 ? 0 : (1 + s_baseConnections) + std::size_t(level - 1) * (1 + s_connections);
+}
+
+unsigned int HierarchicalNavigableSmallWorld::search(const double * target, unsigned int k, unsigned int * indices,
+                                                     double * distances) const
+{
+    if (m_size == 0 || k == 0)
+    {
+        return 0;
+    }
+
+    const auto width = std::max(k, m_searchBudget > 0 ? m_searchBudget : 2 * k);
+    const auto entryPoint = greedySearch(target, m_entryPoint, m_maxLevel, 0, false);
+    const auto entryDistance = m_distance((*m_data)[entryPoint], target, m_dimensions);
+    const auto nearest = searchLevel(target, { Candidate(entryDistance, entryPoint) }, width, 0, false);
+
+    const auto found = std::min(k, static_cast<unsigned int>(nearest.size()));
+    for (unsigned int i = 0; i < found; ++i)
+    {
+        distances[i] = nearest[i].first;
+        indices[i] = nearest[i].second;
+    }
+    return found;
+}
+
+unsigned int HierarchicalNavigableSmallWorld::searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                                            double * distances) const
+{
+    return search((*m_data)[index], k, indices, distances);
+}
+
+bool HierarchicalNavigableSmallWorld::save(std::ostream & stream) const
+{
+    const auto write = [&stream](const void * value, std::size_t bytes) {
+        stream.write(static_cast<const char *>(value), bytes); };
+
+    const auto connections = s_connections;
+    const auto metric = static_cast<std::uint32_t>(m_distance.metric());
+    const auto dataChecksum = checksum(*m_data);
+    write(s_fileMagic, sizeof(s_fileMagic));
+    write(&s_fileVersion, sizeof(s_fileVersion));
+    write(&metric, sizeof(metric));
+    write(&m_size, sizeof(m_size));
+    write(&m_dimensions, sizeof(m_dimensions));
+    write(&connections, sizeof(connections));
+    write(&dataChecksum, sizeof(dataChecksum));
+    write(&m_entryPoint, sizeof(m_entryPoint));
+    write(&m_maxLevel, sizeof(m_maxLevel));
+    write(m_levels.data(), m_levels.size() * sizeof(unsigned int));
+    for (const auto & links : m_links)
+    {
+        write(links.data(), links.size() * sizeof(unsigned int));
+    }
+    return stream.good();
+}
+
+bool HierarchicalNavigableSmallWorld::load(std::istream & stream, const Vector2D<double> & data)
+{
+    const auto read = [&stream](void * value, std::size_t bytes) {
+        return static_cast<bool>(stream.read(static_cast<char *>(value), bytes)); };
+
+    // The header has to match the data and the parameters of this graph
+    char magic[sizeof(s_fileMagic)];
+    auto version = std::uint32_t(0);
+    auto metric = std::uint32_t(0);
+    auto size = 0u;
+    auto dimensions = 0u;
+    auto connections = 0u;
+    auto dataChecksum = std::uint64_t(0);
+    auto entryPoint = 0u;
+    auto maxLevel = 0u;
+    if (!read(magic, sizeof(magic)) || std::memcmp(magic, s_fileMagic, sizeof(magic)) != 0
+        || !read(&version, sizeof(version)) || version != s_fileVersion
+        || !read(&metric, sizeof(metric)) || metric != static_cast<std::uint32_t>(m_distance.metric())
+        || !read(&size, sizeof(size)) || size != data.size() / data.width()
+        || !read(&dimensions, sizeof(dimensions)) || dimensions != data.width()
+        || !read(&connections, sizeof(connections)) || connections != s_connections
+        || !read(&dataChecksum, sizeof(dataChecksum)) || dataChecksum != checksum(data)
+        || !read(&entryPoint, sizeof(entryPoint)) || (size > 0 && entryPoint >= size)
+        || !read(&maxLevel, sizeof(maxLevel)))
+    {
+        return false;
+    }
+
+    // The graph has to be consistent, the checksum only covers the data: the entry point is on the top level and
+    // every link on a level leads to a node that is on that level as well
+    auto levels = std::vector<unsigned int>(size);
+    if (!read(levels.data(), levels.size() * sizeof(unsigned int))
+        || std::any_of(levels.begin(), levels.end(), [maxLevel](unsigned int level){ return level > maxLevel; })
+        || (size > 0 && levels[entryPoint] != maxLevel))
+    {
+        return false;
+    }
+    auto links = std::vector<std::vector<unsigned int>>(size);
+    for (unsigned int i = 0; i < size; ++i)
+    {
+        links[i].resize(linksOffset(levels[i] + 1));
+        if (!read(links[i].data(), links[i].size() * sizeof(unsigned int)))
+        {
+            return false;
+        }
+        for (unsigned int level = 0; level <= levels[i]; ++level)
+        {
+            const auto offset = linksOffset(level);
+            const auto count = links[i][offset];
+            if (count > (level == 0 ? s_baseConnections : s_connections)
+                || std::any_of(links[i].begin() + offset + 1, links[i].begin() + offset + 1 + count,
+                               [size, level, &levels](unsigned int link){
+                                   return link >= size || levels[link] < level; }))
+            {
+                return false;
+            }
+        }
+    }
+
+    m_data = &data;
+    m_dimensions = dimensions;
+    m_size = size;
+    m_entryPoint = entryPoint;
+    m_maxLevel = maxLevel;
+    m_levels = std::move(levels);
+    m_links = std::move(links);
+    return true;
+}
+
+double HierarchicalNavigableSmallWorld::distance(unsigned int first, unsigned int second) const
+{
+    return m_distance((*m_data)[first], (*m_data)[second], m_dimensions);
+}
+
+std::uint64_t HierarchicalNavigableSmallWorld::checksum(const Vector2D<double> & data)
+{
+    return data.size() == 0 ? bhtsne::checksum(nullptr, 0) : bhtsne::checksum(data[0], data.size() * sizeof(double));
+}
+
+std::uint64_t HierarchicalNavigableSmallWorld::hash(std::uint64_t value)
+{
+    // SplitMix64 finalizer
+    value += 0x9e3779b97f4a7c15ull;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <bhtsne/Vector2D.h>
+
+#include "Distance.h"
+#include "NeighborSearch.h"
+
+
+namespace bhtsne {
+
+    // Approximate nearest neighbor search on a hierarchical navigable small world graph (Malkov and Yashunin 2016,
+    // like hnswlib): every point is linked to close points on level 0 and on a random number of sparser levels above,
+    // a query descends greedily through the levels and searches best-first on level 0; the graph can be saved
+    class HierarchicalNavigableSmallWorld : public NeighborSearch
+    {
+    public:
+        // searchBudget is the number of candidates a query keeps at least, 0 for twice the neighbors
+        HierarchicalNavigableSmallWorld(unsigned long randomSeed, unsigned int searchBudget,
+                                        const Distance & distance);
+        ~HierarchicalNavigableSmallWorld() override;
+
+        // The points are inserted in parallel, so the graph depends on the number of threads
+        void create(const Vector2D<double> & data) override;
+        unsigned int search(const double * target, unsigned int k, unsigned int * indices,
+                            double * distances) const override;
+        unsigned int searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                   double * distances) const override;
+
+        // The saved graph contains a checksum of the data, an index of other data is not loaded
+        bool save(std::ostream & stream) const override;
+        bool load(std::istream & stream, const Vector2D<double> & data) override;
+
+    protected:
+        // squared distance and index of a point
+        using Candidate = std::pair<double, unsigned int>;
+
+        // Links per point on the levels above 0 and on level 0
+        static constexpr unsigned int s_connections = 16;
+        static constexpr unsigned int s_baseConnections = 2 * s_connections;
+        // Candidates kept while searching the links of an inserted point
+        static constexpr unsigned int s_constructionWidth = 200;
+
+        void insert(unsigned int index);
+        // Link index to the given neighbors on a level and the neighbors back to index
+        void connect(unsigned int index, const std::vector<Candidate> & neighbors, unsigned int level);
+        unsigned int greedySearch(const double * target, unsigned int entryPoint, unsigned int fromLevel,
+                                  unsigned int toLevel, bool locked) const;
+        // Nearest points to target on a level found best-first from the entry points, nearest first
+        std::vector<Candidate> searchLevel(const double * target, const std::vector<Candidate> & entryPoints,
+                                           unsigned int width, unsigned int level, bool locked) const;
+        // Up to maximum of the candidates (nearest first) that are closer to target than to the ones already selected
+        std::vector<Candidate> selectNeighbors(const std::vector<Candidate> & candidates, unsigned int maximum) const;
+        // Copy of the links of a point on a level
+        void links(unsigned int index, unsigned int level, std::vector<unsigned int> & result, bool locked) const;
+        std::size_t linksOffset(unsigned int level) const;
+        double distance(unsigned int first, unsigned int second) const;
+        static std::uint64_t checksum(const Vector2D<double> & data);
+        static std::uint64_t hash(std::uint64_t value);
+
+        const Vector2D<double> * m_data;
+        unsigned int m_dimensions;
+        unsigned int m_size;
+        unsigned long m_seed;
+        unsigned int m_searchBudget;
+        Distance m_distance;
+
+        unsigned int m_entryPoint;
+        unsigned int m_maxLevel;
+        // highest level of every point and its links: on every level from 0 the number of links followed by
+        // s_baseConnections (level 0) or s_connections links
+        std::vector<unsigned int> m_levels;
+        std::vector<std::vector<unsigned int>> m_links;
+#ifdef _OPENMP
+        // one lock per point guards its links while the points are inserted in parallel
+        mutable std::vector<omp_lock_t> m_locks;
+#endif
+    };
+}
@@ -0,0 +1,420 @@
+#include "NearestNeighborDescent.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <tuple>
+#include <utility>
+
+#include "RandomProjectionForest.h"
+
+
+using namespace bhtsne;
+
+
+NearestNeighborDescent::NearestNeighborDescent(unsigned long randomSeed, unsigned int neighbors, double threshold,
+                                               const Distance & distance)
+    : m_data(nullptr)
+    , m_dimensions(0)
+    , m_size(0)
+    , m_seed(randomSeed)
+    , m_neighbors(neighbors)
+    , m_threshold(threshold)
+    , m_distance(distance)
+{
+}
+
+NearestNeighborDescent::~NearestNeighborDescent()
+{
+#ifdef _OPENMP
+    for (auto & lock : m_locks)
+    {
+        omp_destroy_lock(&lock);
+    }
+#endif
+}
+
+void NearestNeighborDescent::create(const Vector2D<double> & data)
+{
+    m_data = &data;
+    m_dimensions = static_cast<unsigned int>(data.width());
+    m_size = static_cast<unsigned int>(data.size() / data.width());
+    m_neighbors = std::min(m_neighbors, m_size - 1);
+
+    m_graphIndices.resize(static_cast<std::size_t>(m_size) * m_neighbors);
+    m_graphDistances.resize(m_graphIndices.size());
+    m_graphIsNew.resize(m_graphIndices.size());
+    m_farthest.resize(m_size);
+    m_newCandidates.resize(static_cast<std::size_t>(m_size) * 2 * s_maxCandidates);
+    m_oldCandidates.resize(m_newCandidates.size());
+    m_newCounts.resize(m_size);
+    m_oldCounts.resize(m_size);
+#ifdef _OPENMP
+    while (m_locks.size() < m_size)
+    {
+        m_locks.emplace_back();
+        omp_init_lock(&m_locks.back());
+    }
+#endif
+
+    initializeGraph();
+    joinLeaves();
+
+    // Join the neighbors of every point with each other until only few new neighbors are found; the graph holds
+    // the nearest of all neighbors inserted, whatever the order they are inserted in, and the candidates are
+    // sampled from it by a hash, not by the order of its heaps, so it does not depend on the number of threads
+    for (unsigned int iteration = 0; iteration < s_maxIterations && m_neighbors > 0; ++iteration)
+    {
+        sampleCandidates(iteration);
+
+        auto updates = 0ul;
+        #pragma omp parallel for schedule(dynamic, 64) reduction(+:updates)
+        for (int i = 0; i < static_cast<int>(m_size); ++i)
+        {
+            updates += joinCandidates(i);
+        }
+        if (updates < m_threshold * m_size * m_neighbors)
+        {
+            break;
+        }
+    }
+}
+
+void NearestNeighborDescent::initializeGraph()
+{
+    // Random distinct neighbors per point, drawn from a hash of the seed, the point and the attempt
+    const auto seed = hash(m_seed);
+
+    #pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(m_size); ++i)
+    {
+        const auto begin = static_cast<std::size_t>(i) * m_neighbors;
+        const auto indices = m_graphIndices.begin() + begin;
+        auto filled = 0u;
+        for (std::uint64_t attempt = 0; filled < m_neighbors; ++attempt)
+        {
+            const auto index = static_cast<unsigned int>(hash(seed ^ (static_cast<std::uint64_t>(i) << 32 | attempt))
+                                                         % m_size);
+            if (index != static_cast<unsigned int>(i) && std::find(indices, indices + filled, index) == indices + filled)
+            {
+                indices[filled++] = index;
+            }
+        }
+
+        // Sorted by descending distance, which is a valid max-heap
+        auto neighbors = std::vector<std::pair<double, unsigned int>>(m_neighbors);
+        for (unsigned int n = 0; n < m_neighbors; ++n)
+        {
+            neighbors[n] = std::make_pair(distance(i, indices[n]), indices[n]);
+        }
+        std::sort(neighbors.rbegin(), neighbors.rend());
+        for (unsigned int n = 0; n < m_neighbors; ++n)
+        {
+            m_graphDistances[begin + n] = neighbors[n].first;
+            indices[n] = neighbors[n].second;
+            m_graphIsNew[begin + n] = 1;
+        }
+    }
+}
+
+void NearestNeighborDescent::joinLeaves()
+{
+    // Points in the same leaf of a random projection tree are likely neighbors, which saves most of the iterations
+    auto forest = RandomProjectionForest(m_seed, s_initialTrees, 0, m_distance);
+    forest.create(*m_data);
+    const auto leaves = forest.leaves();
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int l = 0; l < static_cast<int>(leaves.size()); ++l)
+    {
+        for (auto first = leaves[l].first; first != leaves[l].second; ++first)
+        {
+            for (auto second = first + 1; second != leaves[l].second; ++second)
+            {
+                const auto pairDistance = distance(*first, *second);
+                insert(*first, *second, pairDistance);
+                insert(*second, *first, pairDistance);
+            }
+        }
+    }
+}
+
+void NearestNeighborDescent::sampleCandidates(unsigned int iteration)
+{
+    const auto capacity = 2 * s_maxCandidates;
+    const auto seed = hash(hash(m_seed) ^ iteration);
+
+    // Forward candidates: the new neighbors (which are old after this iteration) and the old ones, up to
+    // s_maxCandidates of each with the smallest hashes of the seed, the iteration, the point and the neighbor
+    #pragma omp parallel
+    {
+        // hash, neighbor and position in the heap
+        using Sample = std::tuple<std::uint64_t, unsigned int, std::size_t>;
+        auto newSamples = std::vector<Sample>();
+        auto oldSamples = std::vector<Sample>();
+
+        #pragma omp for
+        for (int i = 0; i < static_cast<int>(m_size); ++i)
+        {
+            newSamples.clear();
+            oldSamples.clear();
+            const auto begin = static_cast<std::size_t>(i) * m_neighbors;
+            for (auto n = begin; n < begin + m_neighbors; ++n)
+            {
+                const auto key = hash(seed ^ (static_cast<std::uint64_t>(i) << 32 | m_graphIndices[n]));
+                (m_graphIsNew[n] ? newSamples : oldSamples).emplace_back(key, m_graphIndices[n], n);
+            }
+
+            const auto newCount = std::min(s_maxCandidates, static_cast<unsigned int>(newSamples.size()));
+            const auto oldCount = std::min(s_maxCandidates, static_cast<unsigned int>(oldSamples.size()));
+            std::partial_sort(newSamples.begin(), newSamples.begin() + newCount, newSamples.end());
+            std::partial_sort(oldSamples.begin(), oldSamples.begin() + oldCount, oldSamples.end());
+            for (unsigned int c = 0; c < newCount; ++c)
+            {
+                m_newCandidates[std::size_t(i) * capacity + c] = std::get<1>(newSamples[c]);
+                m_graphIsNew[std::get<2>(newSamples[c])] = 0;
+            }
+            for (unsigned int c = 0; c < oldCount; ++c)
+            {
+                m_oldCandidates[std::size_t(i) * capacity + c] = std::get<1>(oldSamples[c]);
+            }
+            m_newCounts[i] = newCount;
+            m_oldCounts[i] = oldCount;
+            m_farthest[i] = m_graphDistances[begin];
+        }
+    }
+
+    // Reverse candidates: every point is a candidate of its candidates (serially, in order of the points)
+    const auto forwardNewCounts = m_newCounts;
+    const auto forwardOldCounts = m_oldCounts;
+    const auto addReverse = [capacity](std::vector<unsigned int> & candidates, std::vector<unsigned int> & counts,
+                                       unsigned int index, unsigned int candidate)
+    {
+        const auto begin = candidates.begin() + std::size_t(index) * capacity;
+        if (counts[index] < capacity && std::find(begin, begin + counts[index], candidate) == begin + counts[index])
+        {
+            candidates[std::size_t(index) * capacity + counts[index]++] = candidate;
+        }
+    };
+    for (unsigned int i = 0; i < m_size; ++i)
+    {
+        for (unsigned int c = 0; c < forwardNewCounts[i]; ++c)
+        {
+            addReverse(m_newCandidates, m_newCounts, m_newCandidates[std::size_t(i) * capacity + c], i);
+        }
+        for (unsigned int c = 0; c < forwardOldCounts[i]; ++c)
+        {
+            addReverse(m_oldCandidates, m_oldCounts, m_oldCandidates[std::size_t(i) * capacity + c], i);
+        }
+    }
+}
+
+unsigned int NearestNeighborDescent::joinCandidates(unsigned int index)
+{
+    // Compare all pairs of new candidates and all new with all old candidates, and count the neighbors replaced
+    auto updates = 0u;
+    const auto capacity = 2 * s_maxCandidates;
+    const auto newCandidates = m_newCandidates.data() + std::size_t(index) * capacity;
+    const auto oldCandidates = m_oldCandidates.data() + std::size_t(index) * capacity;
+    for (unsigned int a = 0; a < m_newCounts[index]; ++a)
+    {
+        const auto first = newCandidates[a];
+        for (unsigned int b = a + 1; b < m_newCounts[index]; ++b)
+        {
+            const auto second = newCandidates[b];
+            updates += tryInsert(first, second, distance(first, second));
+        }
+        for (unsigned int b = 0; b < m_oldCounts[index]; ++b)
+        {
+            const auto second = oldCandidates[b];
+            if (first == second)
+            {
+                continue;
+            }
+            updates += tryInsert(first, second, distance(first, second));
+        }
+    }
+    return updates;
+}
+
+unsigned int NearestNeighborDescent::tryInsert(unsigned int first, unsigned int second, double distance)
+{
+    // The farthest neighbors only get closer during an iteration, so candidates beyond them are skipped unlocked
+    auto updates = 0u;
+    if (distance <= m_farthest[first])
+    {
+        updates += insert(first, second, distance);
+    }
+    if (distance <= m_farthest[second])
+    {
+        updates += insert(second, first, distance);
+    }
+    return updates;
+}
+
+bool NearestNeighborDescent::insert(unsigned int index, unsigned int neighbor, double distance)
+{
+    const auto begin = static_cast<std::size_t>(index) * m_neighbors;
+    auto replaced = false;
+
+#ifdef _OPENMP
+    omp_set_lock(&m_locks[index]);
+#endif
+    // Replace the farthest neighbor, unless the candidate is farther or already known; the indices are scanned
+    // without early exit, which the compiler vectorizes
+    if (distance < m_graphDistances[begin] || (distance == m_graphDistances[begin] && neighbor < m_graphIndices[begin]))
+    {
+        const auto indices = m_graphIndices.data() + begin;
+        auto known = 0u;
+        for (unsigned int n = 0; n < m_neighbors; ++n)
+        {
+            known |= indices[n] == neighbor;
+        }
+        if (!known)
+        {
+            replaceFarthest(begin, neighbor, distance);
+            replaced = true;
+        }
+    }
+#ifdef _OPENMP
+    omp_unset_lock(&m_locks[index]);
+#endif
+    return replaced;
+}
+
+void NearestNeighborDescent::replaceFarthest(std::size_t begin, unsigned int neighbor, double distance)
+{
+    // Sift the new entry down from the root of the heap
+    m_graphIndices[begin] = neighbor;
+    m_graphDistances[begin] = distance;
+    m_graphIsNew[begin] = 1;
+
+    auto position = std::size_t(0);
+    while (true)
+    {
+        auto largest = position;
+        for (auto child = 2 * position + 1; child <= 2 * position + 2 && child < m_neighbors; ++child)
+        {
+            if (isFarther(begin + child, begin + largest))
+            {
+                largest = child;
+            }
+        }
+        if (largest == position)
+        {
+            return;
+        }
+        std::swap(m_graphIndices[begin + position], m_graphIndices[begin + largest]);
+        std::swap(m_graphDistances[begin + position], m_graphDistances[begin + largest]);
+        std::swap(m_graphIsNew[begin + position], m_graphIsNew[begin + largest]);
+        position = largest;
+    }
+}
+
+bool NearestNeighborDescent::isFarther(std::size_t first, std::size_t second) const
+{
+    return m_graphDistances[first] > m_graphDistances[second]
+        || (m_graphDistances[first] == m_graphDistances[second] && m_graphIndices[first] > m_graphIndices[second]);
+}
+
+unsigned int NearestNeighborDescent::search(const double * target, unsigned int k, unsigned int * indices,
+                                            double * distances) const
+{
+    // Best-first search on the graph from some spread entry points, keeping the s_searchWidth * k nearest points
+    using Candidate = std::pair<double, unsigned int>;
+    const auto width = std::max(1u, s_searchWidth * k);
+    auto visited = std::vector<bool>(m_size, false);
+    auto nearest = std::priority_queue<Candidate>();
+    auto candidates = std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>>();
+
+    const auto visit = [&](unsigned int index)
+    {
+        if (visited[index])
+        {
+            return;
+        }
+        visited[index] = true;
+        const auto candidateDistance = m_distance((*m_data)[index], target, m_dimensions);
+        if (nearest.size() < width || candidateDistance < nearest.top().first)
+        {
+            candidates.emplace(candidateDistance, index);
+            nearest.emplace(candidateDistance, index);
+            if (nearest.size() > width)
+            {
+                nearest.pop();
+            }
+        }
+    };
+
+    for (unsigned int e = 0; e < s_entryPoints && e < m_size; ++e)
+    {
+        visit(static_cast<unsigned int>(static_cast<std::uint64_t>(e) * m_size / s_entryPoints));
+    }
+    while (!candidates.empty())
+    {
+        const auto candidate = candidates.top();
+        candidates.pop();
+        if (nearest.size() >= width && candidate.first > nearest.top().first)
+        {
+            break;
+        }
+        const auto neighbors = m_graphIndices.begin() + static_cast<std::size_t>(candidate.second) * m_neighbors;
+        std::for_each(neighbors, neighbors + m_neighbors, visit);
+    }
+
+    // Keep the k nearest, the queue yields the farthest first
+    while (nearest.size() > k)
+    {
+        nearest.pop();
+    }
+    const auto found = static_cast<unsigned int>(nearest.size());
+    for (auto position = found; position > 0; --position)
+    {
+        indices[position - 1] = nearest.top().second;
+        distances[position - 1] = nearest.top().first;
+        nearest.pop();
+    }
+    return found;
+}
+
+unsigned int NearestNeighborDescent::searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                                   double * distances) const
+{
+    if (k == 0)
+    {
+        return 0;
+    }
+
+    // The point itself and its neighbors in the graph
+    const auto begin = static_cast<std::size_t>(index) * m_neighbors;
+    auto sorted = std::vector<std::pair<double, unsigned int>>(m_neighbors);
+    for (unsigned int n = 0; n < m_neighbors; ++n)
+    {
+        sorted[n] = std::make_pair(m_graphDistances[begin + n], m_graphIndices[begin + n]);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    indices[0] = index;
+    distances[0] = 0.0;
+    const auto found = std::min(k, m_neighbors + 1);
+    for (unsigned int i = 1; i < found; ++i)
+    {
+        indices[i] = sorted[i - 1].second;
+        distances[i] = sorted[i - 1].first;
+    }
+    return found;
+}
+
+double NearestNeighborDescent::distance(unsigned int first, unsigned int second) const
+{
+    return m_distance((*m_data)[first], (*m_data)[second], m_dimensions);
+}
+
+std::uint64_t NearestNeighborDescent::hash(std::uint64_t value)
+{
+    // SplitMix64 finalizer
+    value += 0x9e3779b97f4a7c15ull;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
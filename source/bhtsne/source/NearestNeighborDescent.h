@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <bhtsne/Vector2D.h>
+
+#include "Distance.h"
+#include "NeighborSearch.h"
+
+
+namespace bhtsne {
+
+    // Approximate k-nearest neighbor graph built by NN-Descent (Dong et al. 2011): starting from random neighbors,
+    // the neighbors of the neighbors of every point are compared iteratively until the graph barely changes;
+    // queries for other points are answered by a greedy search on the graph
+    class NearestNeighborDescent : public NeighborSearch
+    {
+    public:
+        // neighbors is the number of neighbors per point in the graph, the descent stops when fewer than
+        // threshold * neighbors new neighbors per point were found in an iteration
+        NearestNeighborDescent(unsigned long randomSeed, unsigned int neighbors, double threshold,
+                               const Distance & distance);
+        ~NearestNeighborDescent() override;
+
+        void create(const Vector2D<double> & data) override;
+        unsigned int search(const double * target, unsigned int k, unsigned int * indices,
+                            double * distances) const override;
+        unsigned int searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                   double * distances) const override;
+
+    protected:
+        // Maximum number of new and of old neighbors per point that are joined in an iteration, the same number
+        // of reverse neighbors is added to both
+        static constexpr unsigned int s_maxCandidates = 20;
+        static constexpr unsigned int s_maxIterations = 30;
+        // Random projection trees whose leaves initialize the graph
+        static constexpr unsigned int s_initialTrees = 4;
+        // Points a search on the graph starts from and the number of candidates it keeps per neighbor searched
+        static constexpr unsigned int s_entryPoints = 8;
+        static constexpr unsigned int s_searchWidth = 2;
+
+        void initializeGraph();
+        void joinLeaves();
+        void sampleCandidates(unsigned int iteration);
+        unsigned int joinCandidates(unsigned int index);
+        unsigned int tryInsert(unsigned int first, unsigned int second, double distance);
+        // Insert a neighbor of a point unless it is farther than all or known, returns whether it was inserted
+        bool insert(unsigned int index, unsigned int neighbor, double distance);
+        // Replace the farthest neighbor of a point and restore its heap
+        void replaceFarthest(std::size_t begin, unsigned int neighbor, double distance);
+        bool isFarther(std::size_t first, std::size_t second) const;
+        double distance(unsigned int first, unsigned int second) const;
+        static std::uint64_t hash(std::uint64_t value);
+
+        const Vector2D<double> * m_data;
+        unsigned int m_dimensions;
+        unsigned int m_size;
+        unsigned long m_seed;
+        unsigned int m_neighbors;
+        double m_threshold;
+        Distance m_distance;
+
+        // m_neighbors entries per point as max-heap on the distance (ties broken by index), whether they are not
+        // joined with the other neighbors yet, and the distance to the farthest of them at the start of the
+        // iteration, which is read while joining the candidates in parallel to skip candidates that are too far
+        std::vector<unsigned int> m_graphIndices;
+        std::vector<double> m_graphDistances;
+        std::vector<unsigned char> m_graphIsNew;
+        std::vector<double> m_farthest;
+        // new and old candidates of every point in an iteration, 2 * s_maxCandidates per point
+        std::vector<unsigned int> m_newCandidates;
+        std::vector<unsigned int> m_oldCandidates;
+        std::vector<unsigned int> m_newCounts;
+        std::vector<unsigned int> m_oldCounts;
+#ifdef _OPENMP
+        // one lock per point guards its neighbors while the candidates are joined in parallel
+        std::vector<omp_lock_t> m_locks;
+#endif
+    };
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <iosfwd>
+
+#include <bhtsne/Vector2D.h>
+
+
+namespace bhtsne {
+
+    // Index over the rows of a dataset that finds the nearest neighbors of query points
+    class NeighborSearch
+    {
+    public:
+        virtual ~NeighborSearch() = default;
+
+        // Build the index on the rows of data, which are referenced and not copied (data must outlive the index)
+        virtual void create(const Vector2D<double> & data) = 0;
+
+        // Find the k nearest neighbors of target; writes their indices and squared distances, nearest first, to the
+        // caller-provided buffers of k values each and returns the number found; can be called concurrently
+        virtual unsigned int search(const double * target, unsigned int k, unsigned int * indices,
+                                    double * distances) const = 0;
+
+        // Find the k nearest neighbors of the indexed point with the given index like search(), the point itself is
+        // its nearest neighbor
+        virtual unsigned int searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                           double * distances) const = 0;
+
+        // Write the index to a binary stream; returns false if the index cannot be saved
+        virtual bool save(std::ostream & /*stream*/) const
+        {
+            return false;
+        }
+
+        // Read an index saved by save() instead of creating it, data is referenced as in create(); returns false
+        // if the stream holds no index of data (then the index has to be created)
+        virtual bool load(std::istream & /*stream*/, const Vector2D<double> & /*data*/)
+        {
+            return false;
+        }
+    };
+}
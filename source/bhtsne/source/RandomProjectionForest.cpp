@@ -0,0 +1,265 @@
+#include "RandomProjectionForest.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <queue>
+
+
+
+using namespace bhtsne;
+
+
+RandomProjectionForest::RandomProjectionForest(unsigned long randomSeed, unsigned int trees, unsigned int searchBudget,
+                                               const Distance & distance)
+    : m_data(nullptr)
+    , m_dimensions(0)
+    , m_seed(randomSeed)
+    , m_searchBudget(searchBudget)
+    , m_distance(distance)
+    , m_trees(std::max(trees, 1u))
+{
+}
+
+void RandomProjectionForest::create(const Vector2D<double> & data)
+{
+    m_data = &data;
+    m_dimensions = static_cast<unsigned int>(data.width());
+    const auto size = static_cast<unsigned int>(data.size() / data.width());
+
+    // Every tree is built from its own generator, so the forest does not depend on the number of threads
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < static_cast<int>(m_trees.size()); ++t)
+    {
+        auto & tree = m_trees[t];
+        auto generator = std::mt19937(static_cast<std::mt19937::result_type>(m_seed + t));
+        tree.nodes.clear();
+        tree.normals.clear();
+        tree.indices.resize(size);
+        std::iota(tree.indices.begin(), tree.indices.end(), 0u);
+        buildNode(tree, 0, size, generator);
+    }
+}
+
+unsigned int RandomProjectionForest::buildNode(Tree & tree, unsigned int begin, unsigned int end,
+                                               std::mt19937 & generator) const
+{
+    const auto nodeIndex = static_cast<unsigned int>(tree.nodes.size());
+    tree.nodes.push_back(Node{ 0, 0.0, { { 0, 0 } }, begin, end });
+    if (end - begin <= s_leafSize)
+    {
+        return nodeIndex;
+    }
+
+    // Split by the hyperplane between two random points
+    auto distribution = std::uniform_int_distribution<unsigned int>(begin, end - 1);
+    for (unsigned int attempt = 0; attempt < s_splitAttempts; ++attempt)
+    {
+        const auto first = (*m_data)[tree.indices[distribution(generator)]];
+        const auto second = (*m_data)[tree.indices[distribution(generator)]];
+        const auto normalIndex = static_cast<unsigned int>(tree.normals.size());
+        auto node = Node{ normalIndex, 0.0, { { 0, 0 } }, begin, end };
+        if (!addHyperplane(tree, node, first, second, generator))
+        {
+            continue;
+        }
+
+        const auto middle = std::partition(tree.indices.begin() + begin, tree.indices.begin() + end,
+                                           [this, &tree, &node](unsigned int index){
+                                               return margin(tree, node, (*m_data)[index]) <= 0.0; });
+        const auto split = static_cast<unsigned int>(middle - tree.indices.begin());
+        if (split == begin || split == end)
+        {
+            tree.normals.resize(normalIndex);
+            continue;
+        }
+
+        // The children are built after the normal is stored, the node is accessed by position as nodes may grow
+        const auto below = buildNode(tree, begin, split, generator);
+        const auto above = buildNode(tree, split, end, generator);
+        node.children = { { below, above } };
+        tree.nodes[nodeIndex] = node;
+        break;
+    }
+
+    return nodeIndex;
+}
+
+bool RandomProjectionForest::addHyperplane(Tree & tree, Node & node, const double * first, const double * second,
+                                           std::mt19937 & generator) const
+{
+    if (m_distance.metric() == DistanceMetric::Hamming)
+    {
+        // a random one of the bits in which the points differ
+        const auto differences = static_cast<unsigned int>(m_distance(first, second, m_dimensions));
+        if (differences == 0)
+        {
+            return false;
+        }
+        auto remaining = std::uniform_int_distribution<unsigned int>(0, differences - 1)(generator);
+        for (unsigned int word = 0; word < m_dimensions; ++word)
+        {
+            std::uint64_t firstBits;
+            std::uint64_t secondBits;
+            std::memcpy(&firstBits, first + word, sizeof(firstBits));
+            std::memcpy(&secondBits, second + word, sizeof(secondBits));
+            const auto bits = firstBits ^ secondBits;
+            for (unsigned int position = 0; position < 64; ++position)
+            {
+                if (((bits >> position) & 1u) && remaining-- == 0)
+                {
+                    node.normal = word * 64 + position;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // the cosine distance compares the directions of the points, otherwise the hyperplane is halfway between them
+    const auto cosine = m_distance.metric() == DistanceMetric::Cosine;
+    const auto firstScale = cosine ? 1.0 / std::sqrt(dot(first, first)) : 1.0;
+    const auto secondScale = cosine ? 1.0 / std::sqrt(dot(second, second)) : 1.0;
+    if (!std::isfinite(firstScale) || !std::isfinite(secondScale))
+    {
+        return false;
+    }
+
+    auto normal = std::vector<double>(m_dimensions);
+    auto norm = 0.0;
+    for (unsigned int d = 0; d < m_dimensions; ++d)
+    {
+        normal[d] = first[d] * firstScale - second[d] * secondScale;
+        norm += normal[d] * normal[d];
+    }
+    if (norm == 0.0)
+    {
+        return false;
+    }
+    norm = std::sqrt(norm);
+    node.offset = 0.0;
+    for (unsigned int d = 0; d < m_dimensions; ++d)
+    {
+        normal[d] /= norm;
+        if (!cosine)
+        {
+            node.offset += normal[d] * (first[d] + second[d]) / 2.0;
+        }
+    }
+    tree.normals.insert(tree.normals.end(), normal.begin(), normal.end());
+    return true;
+}
+
+unsigned int RandomProjectionForest::search(const double * target, unsigned int k, unsigned int * indices,
+                                            double * distances) const
+{
+    const auto budget = m_searchBudget > 0 ? std::max(m_searchBudget, k)
+                                           : static_cast<unsigned int>(m_trees.size()) * std::max(k, s_leafSize);
+
+    // Collect the points of the leaves in order of the margin of the query to the hyperplanes on their path
+    auto queue = std::priority_queue<QueueItem>();
+    for (unsigned int t = 0; t < m_trees.size(); ++t)
+    {
+        queue.push(QueueItem{ std::numeric_limits<double>::max(), t, 0 });
+    }
+
+    auto candidates = std::vector<unsigned int>();
+    candidates.reserve(budget + s_leafSize);
+    while (!queue.empty() && candidates.size() < budget)
+    {
+        const auto item = queue.top();
+        queue.pop();
+        const auto & tree = m_trees[item.tree];
+        const auto & node = tree.nodes[item.node];
+        if (node.children[0] == 0)
+        {
+            // The points are found once per tree, the budget counts distinct candidates
+            candidates.insert(candidates.end(), tree.indices.begin() + node.begin, tree.indices.begin() + node.end);
+            if (candidates.size() >= budget)
+            {
+                std::sort(candidates.begin(), candidates.end());
+                candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+            }
+            continue;
+        }
+
+        const auto targetMargin = margin(tree, node, target);
+        queue.push(QueueItem{ std::min(item.priority, targetMargin), item.tree, node.children[1] });
+        queue.push(QueueItem{ std::min(item.priority, -targetMargin), item.tree, node.children[0] });
+    }
+
+    // Return the nearest of the distinct candidates
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    auto neighbors = std::vector<std::pair<double, unsigned int>>(candidates.size());
+    for (unsigned int i = 0; i < candidates.size(); ++i)
+    {
+        neighbors[i] = std::make_pair(m_distance((*m_data)[candidates[i]], target, m_dimensions), candidates[i]);
+    }
+
+    const auto found = std::min(k, static_cast<unsigned int>(neighbors.size()));
+    std::partial_sort(neighbors.begin(), neighbors.begin() + found, neighbors.end());
+    for (unsigned int i = 0; i < found; ++i)
+    {
+        distances[i] = neighbors[i].first;
+        indices[i] = neighbors[i].second;
+    }
+    return found;
+}
+
+unsigned int RandomProjectionForest::searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                                   double * distances) const
+{
+    return search((*m_data)[index], k, indices, distances);
+}
+
+std::vector<std::pair<const unsigned int *, const unsigned int *>> RandomProjectionForest::leaves() const
+{
+    auto leaves = std::vector<std::pair<const unsigned int *, const unsigned int *>>();
+    for (const auto & tree : m_trees)
+    {
+        for (const auto & node : tree.nodes)
+        {
+            if (node.children[0] == 0)
+            {
+                leaves.emplace_back(tree.indices.data() + node.begin, tree.indices.data() + node.end);
+            }
+        }
+    }
+    return leaves;
+}
+
+double RandomProjectionForest::margin(const Tree & tree, const Node & node, const double * point) const
+{
+    if (m_distance.metric() == DistanceMetric::Hamming)
+    {
+        return bit(point, node.normal) ? 0.5 : -0.5;
+    }
+    return dot(tree.normals.data() + node.normal, point) - node.offset;
+}
+
+bool RandomProjectionForest::bit(const double * point, unsigned int bit)
+{
+    std::uint64_t word;
+    std::memcpy(&word, point + bit / 64, sizeof(word));
+    return ((word >> (bit % 64)) & 1u) != 0;
+}
+
+double RandomProjectionForest::dot(const double * normal, const double * point) const
+{
+    auto product = 0.0;
+    for (unsigned int d = 0; d < m_dimensions; ++d)
+    {
+        product += normal[d] * point[d];
+    }
+    return product;
+}
+
+bool RandomProjectionForest::QueueItem::operator<(const QueueItem & other) const
+{
+    return priority < other.priority;
+}
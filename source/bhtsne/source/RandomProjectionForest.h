@@ -0,0 +1,92 @@
+#pragma once
+
+#include <array>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <bhtsne/Vector2D.h>
+
+#include "Distance.h"
+#include "NeighborSearch.h"
+
+
+namespace bhtsne {
+
+    // Approximate nearest neighbor search on a forest of random projection trees (like Annoy): every tree splits the
+    // points recursively by the hyperplane between two random points, a query collects the points of the leaves
+    // closest to it in all trees and returns the nearest of these candidates. Like in Annoy, the hyperplanes of the
+    // cosine distance pass through the origin between the directions of the points, and the Hamming distance splits
+    // by a random bit in which the points differ
+    class RandomProjectionForest : public NeighborSearch
+    {
+    public:
+        // searchBudget is the number of candidates a query collects at least, 0 for trees times the neighbors (at
+        // least times the leaf size)
+        RandomProjectionForest(unsigned long randomSeed, unsigned int trees, unsigned int searchBudget,
+                               const Distance & distance);
+
+        void create(const Vector2D<double> & data) override;
+        unsigned int search(const double * target, unsigned int k, unsigned int * indices,
+                            double * distances) const override;
+        unsigned int searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                   double * distances) const override;
+
+        // Points of every leaf of every tree as range of indices, valid until the forest is created again
+        std::vector<std::pair<const unsigned int *, const unsigned int *>> leaves() const;
+
+    protected:
+        // Split node or leaf of a tree; children are referenced by their position in the nodes of the tree,
+        // 0 for leaves (the root is never a child)
+        struct Node
+        {
+            // hyperplane of split nodes as the position of its unit normal in the normals of the tree and the offset
+            // (the bit for the Hamming distance)
+            unsigned int normal;
+            double offset;
+            // children below and above the hyperplane
+            std::array<unsigned int, 2> children;
+            // points of leaves as range in the indices of the tree
+            unsigned int begin;
+            unsigned int end;
+        };
+
+        struct Tree
+        {
+            std::vector<Node> nodes;
+            std::vector<double> normals;
+            std::vector<unsigned int> indices;
+        };
+
+        // A node on the search queue, nodes closer to the hyperplanes on the path to the query are visited first
+        struct QueueItem
+        {
+            double priority;
+            unsigned int tree;
+            unsigned int node;
+
+            bool operator<(const QueueItem & other) const;
+        };
+
+        // Maximum number of points in a leaf, larger leaves are only created for duplicate points
+        static constexpr unsigned int s_leafSize = 64;
+        // Random hyperplanes tried before a node that cannot be split becomes a leaf
+        static constexpr unsigned int s_splitAttempts = 3;
+
+        unsigned int buildNode(Tree & tree, unsigned int begin, unsigned int end, std::mt19937 & generator) const;
+        // Set the hyperplane of node between two points, false if they cannot be separated
+        bool addHyperplane(Tree & tree, Node & node, const double * first, const double * second,
+                           std::mt19937 & generator) const;
+        // Signed distance of point to the hyperplane of a split node (or its side of the bit), at most 0 below
+        double margin(const Tree & tree, const Node & node, const double * point) const;
+        double dot(const double * normal, const double * point) const;
+        static bool bit(const double * point, unsigned int bit);
+
+        const Vector2D<double> * m_data;
+        unsigned int m_dimensions;
+        unsigned long m_seed;
+        unsigned int m_searchBudget;
+        Distance m_distance;
+        std::vector<Tree> m_trees;
+    };
+}
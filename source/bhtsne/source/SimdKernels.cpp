@@ -0,0 +1,134 @@
+#include "SimdKernels.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+
+namespace {
+
+    bhtsne::InstructionSet detectInstructionSet()
+    {
+        using bhtsne::InstructionSet;
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        int info[4];
+        __cpuid(info, 0);
+        const auto maxLeaf = info[0];
+        __cpuid(info, 1);
+        const auto sse2 = (info[3] & (1 << 26)) != 0;
+        const auto avx = (info[2] & (1 << 28)) != 0;
+        // the operating system has to save the vector registers (XMM, YMM and the AVX-512 state) on context switches
+        const auto xcr0 = (info[2] & (1 << 27)) != 0 ? _xgetbv(0) : 0;
+        auto avx2 = false;
+        auto avx512 = false;
+        if (maxLeaf >= 7)
+        {
+            __cpuidex(info, 7, 0);
+            avx2 = avx && (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+            avx512 = (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+        }
+        if (avx512)
+        {
+            return InstructionSet::AVX512;
+        }
+        if (avx2)
+        {
+            return InstructionSet::AVX2;
+        }
+        if (sse2)
+        {
+            return InstructionSet::SSE2;
+        }
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        // also checks the support of the operating system
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            return InstructionSet::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return InstructionSet::AVX2;
+        }
+        if (__builtin_cpu_supports("sse2"))
+        {
+            return InstructionSet::SSE2;
+        }
+#endif
+        return InstructionSet::Generic;
+    }
+
+    bhtsne::InstructionSet maximumInstructionSet()
+    {
+        using bhtsne::InstructionSet;
+
+        const auto detected = detectInstructionSet();
+        const auto limit = std::getenv("BHTSNE_INSTRUCTION_SET");
+        if (limit == nullptr)
+        {
+            return detected;
+        }
+
+        auto requested = detected;
+        if (std::strcmp(limit, "generic") == 0)
+        {
+            requested = InstructionSet::Generic;
+        }
+        else if (std::strcmp(limit, "sse2") == 0)
+        {
+            requested = InstructionSet::SSE2;
+        }
+        else if (std::strcmp(limit, "avx2") == 0)
+        {
+            requested = InstructionSet::AVX2;
+        }
+        else if (std::strcmp(limit, "avx512") == 0)
+        {
+            requested = InstructionSet::AVX512;
+        }
+        return requested < detected ? requested : detected;
+    }
+
+    const bhtsne::Kernels & selectKernels()
+    {
+        using bhtsne::InstructionSet;
+
+        // The best instruction set that is supported by the CPU and the compiler
+        const auto maximum = maximumInstructionSet();
+        const bhtsne::Kernels * selected = nullptr;
+        if (maximum >= InstructionSet::AVX512)
+        {
+            selected = bhtsne::avx512Kernels();
+        }
+        if (selected == nullptr && maximum >= InstructionSet::AVX2)
+        {
+            selected = bhtsne::avx2Kernels();
+        }
+        if (selected == nullptr && maximum >= InstructionSet::SSE2)
+        {
+            selected = bhtsne::sse2Kernels();
+        }
+        return selected != nullptr ? *selected : bhtsne::genericKernels();
+    }
+}
+
+
+namespace bhtsne {
+
+const Kernels & kernels()
+{
+    static const auto & selected = selectKernels();
+    return selected;
+}
+
+const Kernels & genericKernels()
+{
+    static const auto generic = simd::makeKernels<simd::Generic>(InstructionSet::Generic);
+    return generic;
+}
+
+} // namespace bhtsne
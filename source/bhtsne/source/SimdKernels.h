@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+
+#include <bhtsne/bhtsne_api.h>
+
+
+namespace bhtsne {
+
+    // Instruction sets the kernels are compiled for, in order of preference
+    enum class InstructionSet
+    {
+        Generic,
+        SSE2,
+        AVX2,
+        AVX512
+    };
+
+    // Distances between rows of the input data
+    struct DistanceKernels
+    {
+        double (*squaredEuclideanDistance)(const double * a, const double * b, unsigned int dimensions);
+        double (*dotProduct)(const double * a, const double * b, unsigned int dimensions);
+        // 1 - a.b / (|a| |b|), 1 if a or b is 0
+        double (*cosineDistance)(const double * a, const double * b, unsigned int dimensions);
+        // 1 - a.b, the cosine distance of normalized rows without computing their norms
+        double (*innerProductDistance)(const double * a, const double * b, unsigned int dimensions);
+        double (*manhattanDistance)(const double * a, const double * b, unsigned int dimensions);
+        // Number of different bits of rows packed into 64 bit words, dimensions is the number of words
+        double (*hammingDistance)(const double * a, const double * b, unsigned int dimensions);
+        // Dot products of a with the 4 consecutive rows starting at rows, register-blocked to load a once for all
+        void (*dotProducts4)(const double * a, const double * rows, unsigned int dimensions, double * products);
+    };
+
+    // Similarities of the input points
+    struct SimilarityKernels
+    {
+        // Gaussian kernel exp(-beta * distance) of count distances, written to similarities; adds the sum of the
+        // similarities to sum, their sum weighted by the distances to weightedSum and weighted by the squared
+        // distances to squaredWeightedSum in the same pass
+        void (*gaussianKernel)(const double * distances, unsigned int count, double beta, double * similarities,
+                               double & sum, double & weightedSum, double & squaredWeightedSum);
+    };
+
+    // Repulsive forces of the space partitioning tree for embeddings of D dimensions
+    template<unsigned int D>
+    struct ForceKernels
+    {
+        // Points handled together by summarizeGroup, their coordinates and forces are stored per dimension
+        static constexpr unsigned int s_groupSize = 16;
+
+        // Add the interactions of the given lanes of a point group with a node that can be used as their summary
+        // (always for a node of a single point); coordinates, forces (both D x s_groupSize) and forceSums have to
+        // be aligned to 64 bytes; returns the summarized lanes
+        unsigned int (*summarizeGroup)(const double * coordinates, const double * centerOfMass, double squaredRadius,
+                                       double cumulativeSize, double squaredTheta, unsigned int lanes, bool singlePoint,
+                                       double * forces, double * forceSums);
+
+        // Add the exact interactions of point with the points in [begin, end) of the buckets (stored per dimension
+        // for all numberOfPoints), except the one of pointIndex
+        void (*bucketForces)(const double * point, const double * bucketCoordinates, std::size_t numberOfPoints,
+                             const unsigned int * bucketIndices, unsigned int begin, unsigned int end,
+                             unsigned int pointIndex, double * forces, double & forceSum);
+    };
+
+    // All kernels compiled for one instruction set
+    struct Kernels
+    {
+        InstructionSet instructionSet;
+        DistanceKernels distances;
+        SimilarityKernels similarities;
+        ForceKernels<0> forces0;
+        ForceKernels<1> forces1;
+        ForceKernels<2> forces2;
+        ForceKernels<3> forces3;
+    };
+
+    // Kernels for the best instruction set supported by the CPU (detected once via CPUID); the environment variable
+    // BHTSNE_INSTRUCTION_SET (generic, sse2, avx2 or avx512) limits the instruction set. Exported for the trees,
+    // which are instantiated outside of the library as well, and for the tests
+    BHTSNE_API const Kernels & kernels();
+
+    // Force kernels of kernels(), generic ones for embeddings of more than 3 dimensions
+    template<unsigned int D>
+    const ForceKernels<D> & forceKernels();
+
+    // Kernels of every instruction set, nullptr if the compiler does not support it (separate translation units);
+    // they may only be called if the CPU supports the instruction set
+    BHTSNE_API const Kernels & genericKernels();
+    BHTSNE_API const Kernels * sse2Kernels();
+    BHTSNE_API const Kernels * avx2Kernels();
+    BHTSNE_API const Kernels * avx512Kernels();
+
+
+    template<>
+    inline const ForceKernels<0> & forceKernels<0>()
+    {
+        return kernels().forces0;
+    }
+
+    template<>
+    inline const ForceKernels<1> & forceKernels<1>()
+    {
+        return kernels().forces1;
+    }
+
+    template<>
+    inline const ForceKernels<2> & forceKernels<2>()
+    {
+        return kernels().forces2;
+    }
+
+    template<>
+    inline const ForceKernels<3> & forceKernels<3>()
+    {
+        return kernels().forces3;
+    }
+}
+
+#include "SimdKernels.inl"
@@ -0,0 +1,449 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "SimdKernels.h"
+
+
+// Kernels written once against a vector type Simd, which provides
+// - Vector and lanes, the number of doubles in a Vector
+// - zero(), set(value), load(aligned pointer), loadu(pointer), store(aligned pointer, vector), storeu(pointer, vector)
+// - add, sub, mul, div and max of two vectors, abs of a vector
+// - pow2(exponents), 2 to the power of integral exponents in the range of normal doubles
+// - lessThan(a, b), one bit per lane, and maskZero(bits, vector), which zeroes the lanes whose bit is not set
+// - sum(vector) of all lanes
+// - squareRoot(value) and popcount(bits) of scalars
+// Every other instruction set defines its Simd type in an anonymous namespace of its own translation unit; the
+// kernels only call the functions of Simd, so no code compiled for one instruction set leaks into another.
+namespace bhtsne {
+namespace simd {
+
+// Scalar fallback, a vector of one lane
+struct Generic
+{
+    using Vector = double;
+    static constexpr unsigned int lanes = 1;
+
+    static Vector zero() { return 0.0; }
+    static Vector set(double value) { return value; }
+    static Vector load(const double * values) { return *values; }
+    static Vector loadu(const double * values) { return *values; }
+    static void store(double * values, Vector vector) { *values = vector; }
+    static void storeu(double * values, Vector vector) { *values = vector; }
+    static Vector add(Vector a, Vector b) { return a + b; }
+    static Vector sub(Vector a, Vector b) { return a - b; }
+    static Vector mul(Vector a, Vector b) { return a * b; }
+    static Vector div(Vector a, Vector b) { return a / b; }
+    static Vector abs(Vector vector) { return vector < 0.0 ? -vector : vector; }
+    static Vector max(Vector a, Vector b) { return a > b ? a : b; }
+    static unsigned int lessThan(Vector a, Vector b) { return a < b ? 1u : 0u; }
+    static Vector maskZero(unsigned int bits, Vector vector) { return (bits & 1u) ? vector : 0.0; }
+    static double sum(Vector vector) { return vector; }
+    static double squareRoot(double value) { return std::sqrt(value); }
+
+    static Vector pow2(Vector exponents)
+    {
+        // 2^52 moves the exponent biased by 1023 into the low bits of the mantissa, which are shifted into the
+        // exponent bits
+        const auto biased = exponents + 4503599627371519.0;
+        std::uint64_t bits;
+        std::memcpy(&bits, &biased, sizeof(bits));
+        bits <<= 52;
+        double result;
+        std::memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    static unsigned int popcount(std::uint64_t bits)
+    {
+        bits = bits - ((bits >> 1) & 0x5555555555555555ull);
+        bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+        bits = (bits + (bits >> 4)) & 0x0f0f0f0f0f0f0f0full;
+        return static_cast<unsigned int>((bits * 0x0101010101010101ull) >> 56);
+    }
+};
+
+
+template<typename Simd>
+double squaredEuclideanDistance(const double * a, const double * b, unsigned int dimensions)
+{
+    auto accum = Simd::zero();
+    unsigned int i = 0;
+    for (; i + Simd::lanes <= dimensions; i += Simd::lanes)
+    {
+        const auto difference = Simd::sub(Simd::loadu(a + i), Simd::loadu(b + i));
+        accum = Simd::add(accum, Simd::mul(difference, difference));
+    }
+
+    auto squaredDistance = Simd::sum(accum);
+    for (; i < dimensions; ++i)
+    {
+        const auto difference = a[i] - b[i];
+        squaredDistance += difference * difference;
+    }
+    return squaredDistance;
+}
+
+template<typename Simd>
+double dotProduct(const double * a, const double * b, unsigned int dimensions)
+{
+    auto accum = Simd::zero();
+    unsigned int i = 0;
+    for (; i + Simd::lanes <= dimensions; i += Simd::lanes)
+    {
+        accum = Simd::add(accum, Simd::mul(Simd::loadu(a + i), Simd::loadu(b + i)));
+    }
+
+    auto product = Simd::sum(accum);
+    for (; i < dimensions; ++i)
+    {
+        product += a[i] * b[i];
+    }
+    return product;
+}
+
+template<typename Simd>
+double cosineDistance(const double * a, const double * b, unsigned int dimensions)
+{
+    // the norms are accumulated with the product, so the rows are read once
+    auto productAccum = Simd::zero();
+    auto squaredNormAccumA = Simd::zero();
+    auto squaredNormAccumB = Simd::zero();
+    unsigned int i = 0;
+    for (; i + Simd::lanes <= dimensions; i += Simd::lanes)
+    {
+        const auto valuesA = Simd::loadu(a + i);
+        const auto valuesB = Simd::loadu(b + i);
+        productAccum = Simd::add(productAccum, Simd::mul(valuesA, valuesB));
+        squaredNormAccumA = Simd::add(squaredNormAccumA, Simd::mul(valuesA, valuesA));
+        squaredNormAccumB = Simd::add(squaredNormAccumB, Simd::mul(valuesB, valuesB));
+    }
+
+    auto product = Simd::sum(productAccum);
+    auto squaredNormA = Simd::sum(squaredNormAccumA);
+    auto squaredNormB = Simd::sum(squaredNormAccumB);
+    for (; i < dimensions; ++i)
+    {
+        product += a[i] * b[i];
+        squaredNormA += a[i] * a[i];
+        squaredNormB += b[i] * b[i];
+    }
+
+    const auto squaredNorms = squaredNormA * squaredNormB;
+    return squaredNorms > 0.0 ? 1.0 - product / Simd::squareRoot(squaredNorms) : 1.0;
+}
+
+template<typename Simd>
+double innerProductDistance(const double * a, const double * b, unsigned int dimensions)
+{
+    return 1.0 - dotProduct<Simd>(a, b, dimensions);
+}
+
+template<typename Simd>
+double manhattanDistance(const double * a, const double * b, unsigned int dimensions)
+{
+    auto accum = Simd::zero();
+    unsigned int i = 0;
+    for (; i + Simd::lanes <= dimensions; i += Simd::lanes)
+    {
+        accum = Simd::add(accum, Simd::abs(Simd::sub(Simd::loadu(a + i), Simd::loadu(b + i))));
+    }
+
+    auto distance = Simd::sum(accum);
+    for (; i < dimensions; ++i)
+    {
+        const auto difference = a[i] - b[i];
+        distance += difference < 0.0 ? -difference : difference;
+    }
+    return distance;
+}
+
+template<typename Simd>
+double hammingDistance(const double * a, const double * b, unsigned int dimensions)
+{
+    // the words are copied to integers, they are only stored as doubles
+    auto distance = 0u;
+    for (unsigned int i = 0; i < dimensions; ++i)
+    {
+        std::uint64_t wordA;
+        std::uint64_t wordB;
+        std::memcpy(&wordA, a + i, sizeof(wordA));
+        std::memcpy(&wordB, b + i, sizeof(wordB));
+        distance += Simd::popcount(wordA ^ wordB);
+    }
+    return static_cast<double>(distance);
+}
+
+template<typename Simd>
+void dotProducts4(const double * a, const double * rows, unsigned int dimensions, double * products)
+{
+    const auto b0 = rows;
+    const auto b1 = rows + dimensions;
+    const auto b2 = rows + 2 * dimensions;
+    const auto b3 = rows + 3 * dimensions;
+    auto accum0 = Simd::zero();
+    auto accum1 = Simd::zero();
+    auto accum2 = Simd::zero();
+    auto accum3 = Simd::zero();
+    unsigned int i = 0;
+    for (; i + Simd::lanes <= dimensions; i += Simd::lanes)
+    {
+        const auto values = Simd::loadu(a + i);
+        accum0 = Simd::add(accum0, Simd::mul(values, Simd::loadu(b0 + i)));
+        accum1 = Simd::add(accum1, Simd::mul(values, Simd::loadu(b1 + i)));
+        accum2 = Simd::add(accum2, Simd::mul(values, Simd::loadu(b2 + i)));
+        accum3 = Simd::add(accum3, Simd::mul(values, Simd::loadu(b3 + i)));
+    }
+
+    products[0] = Simd::sum(accum0);
+    products[1] = Simd::sum(accum1);
+    products[2] = Simd::sum(accum2);
+    products[3] = Simd::sum(accum3);
+    for (; i < dimensions; ++i)
+    {
+        products[0] += a[i] * b0[i];
+        products[1] += a[i] * b1[i];
+        products[2] += a[i] * b2[i];
+        products[3] += a[i] * b3[i];
+    }
+}
+
+// exp of every lane for arguments up to 709: x = k ln(2) + r with |r| <= ln(2) / 2, exp(r) by its Taylor polynomial
+// of degree 13 (within a few ulp) and 2^k from the exponent bits; lanes below the normal range of doubles are 0
+template<typename Simd>
+typename Simd::Vector exponential(typename Simd::Vector x)
+{
+    const auto laneMask = (1u << Simd::lanes) - 1;
+    const auto minimum = Simd::set(-708.3964185322641);
+    // adding 1.5 * 2^52 rounds to an integer
+    const auto shifter = Simd::set(6755399441055744.0);
+    const auto underflow = Simd::lessThan(x, minimum);
+    x = Simd::max(x, minimum);
+
+    // ln(2) is split in a part whose product with k is exact and the rest
+    const auto k = Simd::sub(Simd::add(Simd::mul(x, Simd::set(1.4426950408889634)), shifter), shifter);
+    auto r = Simd::sub(x, Simd::mul(k, Simd::set(0.693145751953125)));
+    r = Simd::sub(r, Simd::mul(k, Simd::set(1.42860682030941723212e-6)));
+
+    const double coefficients[] = { 1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0,
+                                    1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0,
+                                    1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0 };
+    auto polynomial = Simd::set(coefficients[0]);
+    for (unsigned int i = 1; i < sizeof(coefficients) / sizeof(coefficients[0]); ++i)
+    {
+        polynomial = Simd::add(Simd::mul(polynomial, r), Simd::set(coefficients[i]));
+    }
+
+    return Simd::maskZero(~underflow & laneMask, Simd::mul(polynomial, Simd::pow2(k)));
+}
+
+// Scalar exp of the library is faster than the polynomial without vectors
+template<>
+inline Generic::Vector exponential<Generic>(Generic::Vector x)
+{
+    return x < -708.3964185322641 ? 0.0 : std::exp(x);
+}
+
+template<typename Simd>
+void gaussianKernel(const double * distances, unsigned int count, double beta, double * similarities, double & sum,
+                    double & weightedSum, double & squaredWeightedSum)
+{
+    const auto negativeBeta = Simd::set(-beta);
+    auto sumAccum = Simd::zero();
+    auto weightedAccum = Simd::zero();
+    auto squaredAccum = Simd::zero();
+    unsigned int i = 0;
+    for (; i + Simd::lanes <= count; i += Simd::lanes)
+    {
+        const auto values = Simd::loadu(distances + i);
+        const auto kernel = exponential<Simd>(Simd::mul(negativeBeta, values));
+        Simd::storeu(similarities + i, kernel);
+        const auto weighted = Simd::mul(values, kernel);
+        sumAccum = Simd::add(sumAccum, kernel);
+        weightedAccum = Simd::add(weightedAccum, weighted);
+        squaredAccum = Simd::add(squaredAccum, Simd::mul(values, weighted));
+    }
+
+    // the remaining distances are padded to a vector, so all of them use the same exponential
+    if (i < count)
+    {
+        double tail[Simd::lanes] = {};
+        std::memcpy(tail, distances + i, (count - i) * sizeof(double));
+        const auto values = Simd::loadu(tail);
+        const auto kernel = Simd::maskZero((1u << (count - i)) - 1, exponential<Simd>(Simd::mul(negativeBeta, values)));
+        Simd::storeu(tail, kernel);
+        std::memcpy(similarities + i, tail, (count - i) * sizeof(double));
+        const auto weighted = Simd::mul(values, kernel);
+        sumAccum = Simd::add(sumAccum, kernel);
+        weightedAccum = Simd::add(weightedAccum, weighted);
+        squaredAccum = Simd::add(squaredAccum, Simd::mul(values, weighted));
+    }
+
+    sum += Simd::sum(sumAccum);
+    weightedSum += Simd::sum(weightedAccum);
+    squaredWeightedSum += Simd::sum(squaredAccum);
+}
+
+template<typename Simd, unsigned int D>
+unsigned int summarizeGroup(const double * coordinates, const double * centerOfMass, double squaredRadius,
+                            double cumulativeSize, double squaredTheta, unsigned int lanes, bool singlePoint,
+                            double * forces, double * forceSums)
+{
+    const auto groupSize = ForceKernels<D>::s_groupSize;
+    const auto laneMask = (1u << Simd::lanes) - 1;
+    const auto one = Simd::set(1.0);
+    const auto radius = Simd::set(squaredRadius);
+    const auto theta = Simd::set(squaredTheta);
+    const auto size = Simd::set(cumulativeSize);
+    typename Simd::Vector distances[D > 0 ? D : 1];
+
+    auto summarized = 0u;
+    for (unsigned int offset = 0; offset < groupSize; offset += Simd::lanes)
+    {
+        auto sumOfSquaredDistances = Simd::zero();
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            distances[d] = Simd::sub(Simd::load(coordinates + d * groupSize + offset), Simd::set(centerOfMass[d]));
+            sumOfSquaredDistances = Simd::add(sumOfSquaredDistances, Simd::mul(distances[d], distances[d]));
+        }
+
+        // Check whether we can use this node as a "summary"
+        const auto criterion = Simd::lessThan(radius, Simd::mul(theta, sumOfSquaredDistances));
+        const auto bits = (singlePoint ? laneMask : criterion) & (lanes >> offset) & laneMask;
+        if (bits == 0)
+        {
+            continue;
+        }
+        summarized |= bits << offset;
+
+        // Compute and add t-SNE force between the points and current node
+        const auto inverseDistSum = Simd::div(one, Simd::add(one, sumOfSquaredDistances));
+        auto force = Simd::maskZero(bits, Simd::mul(size, inverseDistSum));
+        Simd::store(forceSums + offset, Simd::add(Simd::load(forceSums + offset), force));
+        force = Simd::mul(force, inverseDistSum);
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            const auto laneForces = forces + d * groupSize + offset;
+            Simd::store(laneForces, Simd::add(Simd::load(laneForces), Simd::mul(force, distances[d])));
+        }
+    }
+    return summarized;
+}
+
+template<typename Simd, unsigned int D>
+void bucketForces(const double * point, const double * bucketCoordinates, std::size_t numberOfPoints,
+                  const unsigned int * bucketIndices, unsigned int begin, unsigned int end, unsigned int pointIndex,
+                  double * forces, double & forceSum)
+{
+    // Simd::lanes points at once; arrays need at least one element for D = 0
+    const auto laneMask = (1u << Simd::lanes) - 1;
+    const auto one = Simd::set(1.0);
+    typename Simd::Vector pointCoordinates[D > 0 ? D : 1];
+    typename Simd::Vector forceAccum[D > 0 ? D : 1];
+    typename Simd::Vector differences[D > 0 ? D : 1];
+    auto sumAccum = Simd::zero();
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        pointCoordinates[d] = Simd::set(point[d]);
+        forceAccum[d] = Simd::zero();
+    }
+
+    auto i = begin;
+    for (; i + Simd::lanes <= end; i += Simd::lanes)
+    {
+        auto denominator = one;
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            differences[d] = Simd::sub(pointCoordinates[d], Simd::loadu(bucketCoordinates + d * numberOfPoints + i));
+            denominator = Simd::add(denominator, Simd::mul(differences[d], differences[d]));
+        }
+
+        // mask out the self-interaction
+        auto others = laneMask;
+        for (unsigned int lane = 0; lane < Simd::lanes; ++lane)
+        {
+            if (bucketIndices[i + lane] == pointIndex)
+            {
+                others &= ~(1u << lane);
+            }
+        }
+        const auto q = Simd::maskZero(others, Simd::div(one, denominator));
+        sumAccum = Simd::add(sumAccum, q);
+        const auto squaredQ = Simd::mul(q, q);
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            forceAccum[d] = Simd::add(forceAccum[d], Simd::mul(squaredQ, differences[d]));
+        }
+    }
+
+    forceSum += Simd::sum(sumAccum);
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        forces[d] += Simd::sum(forceAccum[d]);
+    }
+
+    for (; i < end; ++i)
+    {
+        if (bucketIndices[i] == pointIndex)
+        {
+            continue;
+        }
+
+        double denominator = 1.0;
+        double pointDifferences[D > 0 ? D : 1];
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            pointDifferences[d] = point[d] - bucketCoordinates[d * numberOfPoints + i];
+            denominator += pointDifferences[d] * pointDifferences[d];
+        }
+        const auto q = 1.0 / denominator;
+        forceSum += q;
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            forces[d] += q * q * pointDifferences[d];
+        }
+    }
+}
+
+template<typename Simd, unsigned int D>
+ForceKernels<D> makeForceKernels()
+{
+    auto result = ForceKernels<D>();
+    result.summarizeGroup = &summarizeGroup<Simd, D>;
+    result.bucketForces = &bucketForces<Simd, D>;
+    return result;
+}
+
+template<typename Simd>
+Kernels makeKernels(InstructionSet instructionSet)
+{
+    auto result = Kernels();
+    result.instructionSet = instructionSet;
+    result.distances.squaredEuclideanDistance = &squaredEuclideanDistance<Simd>;
+    result.distances.dotProduct = &dotProduct<Simd>;
+    result.distances.dotProducts4 = &dotProducts4<Simd>;
+    result.distances.cosineDistance = &cosineDistance<Simd>;
+    result.distances.innerProductDistance = &innerProductDistance<Simd>;
+    result.distances.manhattanDistance = &manhattanDistance<Simd>;
+    result.distances.hammingDistance = &hammingDistance<Simd>;
+    result.similarities.gaussianKernel = &gaussianKernel<Simd>;
+    result.forces0 = makeForceKernels<Simd, 0>();
+    result.forces1 = makeForceKernels<Simd, 1>();
+    result.forces2 = makeForceKernels<Simd, 2>();
+    result.forces3 = makeForceKernels<Simd, 3>();
+    return result;
+}
+
+} // namespace simd
+
+
+template<unsigned int D>
+const ForceKernels<D> & forceKernels()
+{
+    static const auto generic = simd::makeForceKernels<simd::Generic, D>();
+    return generic;
+}
+
+} // namespace bhtsne
@@ -0,0 +1,85 @@
+#include "SimdKernels.h"
+
+// Compiled for AVX2 if the compiler supports it (the flags are set for this file only)
+#ifdef __AVX2__
+#define BHTSNE_AVX2_KERNELS
+#include <immintrin.h>
+
+
+namespace {
+
+    struct Avx2
+    {
+        using Vector = __m256d;
+        static constexpr unsigned int lanes = 4;
+
+        static Vector zero() { return _mm256_setzero_pd(); }
+        static Vector set(double value) { return _mm256_set1_pd(value); }
+        static Vector load(const double * values) { return _mm256_load_pd(values); }
+        // rows of the data are not aligned to the vector width
+        static Vector loadu(const double * values) { return _mm256_loadu_pd(values); }
+        static void store(double * values, Vector vector) { _mm256_store_pd(values, vector); }
+        static void storeu(double * values, Vector vector) { _mm256_storeu_pd(values, vector); }
+        static Vector add(Vector a, Vector b) { return _mm256_add_pd(a, b); }
+        static Vector sub(Vector a, Vector b) { return _mm256_sub_pd(a, b); }
+        static Vector mul(Vector a, Vector b) { return _mm256_mul_pd(a, b); }
+        static Vector div(Vector a, Vector b) { return _mm256_div_pd(a, b); }
+        static Vector abs(Vector vector) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), vector); }
+        static Vector max(Vector a, Vector b) { return _mm256_max_pd(a, b); }
+
+        static Vector pow2(Vector exponents)
+        {
+            const auto biased = _mm256_add_pd(exponents, _mm256_set1_pd(4503599627371519.0));
+            return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(biased), 52));
+        }
+
+        static unsigned int lessThan(Vector a, Vector b)
+        {
+            return static_cast<unsigned int>(_mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)));
+        }
+
+        static Vector maskZero(unsigned int bits, Vector vector)
+        {
+            const auto laneBits = _mm256_set_epi64x(8, 4, 2, 1);
+            const auto mask = _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(bits), laneBits), laneBits);
+            return _mm256_and_pd(_mm256_castsi256_pd(mask), vector);
+        }
+
+        static double sum(Vector vector)
+        {
+            const auto halves = _mm_add_pd(_mm256_castpd256_pd128(vector), _mm256_extractf128_pd(vector, 1));
+            return _mm_cvtsd_f64(_mm_add_sd(halves, _mm_unpackhi_pd(halves, halves)));
+        }
+
+        static double squareRoot(double value)
+        {
+            return _mm_cvtsd_f64(_mm_sqrt_sd(_mm_setzero_pd(), _mm_set_sd(value)));
+        }
+
+        static unsigned int popcount(std::uint64_t bits)
+        {
+#if defined(__x86_64__) || defined(_M_X64)
+            return static_cast<unsigned int>(_mm_popcnt_u64(bits));
+#else
+            return static_cast<unsigned int>(_mm_popcnt_u32(static_cast<unsigned int>(bits)) +
+                                             _mm_popcnt_u32(static_cast<unsigned int>(bits >> 32)));
+#endif
+        }
+    };
+}
+#endif
+
+
+namespace bhtsne {
+
+const Kernels * avx2Kernels()
+{
+#ifdef BHTSNE_AVX2_KERNELS
+    static const auto avx2 = simd::makeKernels<Avx2>(InstructionSet::AVX2);
+    return &avx2;
+#else
+    return nullptr;
+#endif
+}
+
+} // namespace bhtsne
@@ -0,0 +1,88 @@
+#include "SimdKernels.h"
+
+// Compiled for AVX-512 if the compiler supports it (the flags are set for this file only)
+#ifdef __AVX512F__
+#define BHTSNE_AVX512_KERNELS
+#include <immintrin.h>
+
+
+namespace {
+
+    struct Avx512
+    {
+        using Vector = __m512d;
+        static constexpr unsigned int lanes = 8;
+
+        static Vector zero() { return _mm512_setzero_pd(); }
+        static Vector set(double value) { return _mm512_set1_pd(value); }
+        static Vector load(const double * values) { return _mm512_load_pd(values); }
+        // rows of the data are not aligned to the vector width
+        static Vector loadu(const double * values) { return _mm512_loadu_pd(values); }
+        static void store(double * values, Vector vector) { _mm512_store_pd(values, vector); }
+        static void storeu(double * values, Vector vector) { _mm512_storeu_pd(values, vector); }
+        static Vector add(Vector a, Vector b) { return _mm512_add_pd(a, b); }
+        static Vector sub(Vector a, Vector b) { return _mm512_sub_pd(a, b); }
+        static Vector mul(Vector a, Vector b) { return _mm512_mul_pd(a, b); }
+        static Vector div(Vector a, Vector b) { return _mm512_div_pd(a, b); }
+        static Vector abs(Vector vector) { return _mm512_abs_pd(vector); }
+        // all lanes masked, the unmasked forms read an undefined source operand that GCC 12 warns about
+        static Vector max(Vector a, Vector b) { return _mm512_maskz_max_pd(0xff, a, b); }
+
+        static Vector pow2(Vector exponents)
+        {
+            const auto biased = _mm512_add_pd(exponents, _mm512_set1_pd(4503599627371519.0));
+            return _mm512_castsi512_pd(_mm512_maskz_slli_epi64(0xff, _mm512_castpd_si512(biased), 52));
+        }
+
+        static unsigned int lessThan(Vector a, Vector b)
+        {
+            return static_cast<unsigned int>(_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ));
+        }
+
+        static Vector maskZero(unsigned int bits, Vector vector)
+        {
+            return _mm512_maskz_mov_pd(static_cast<__mmask8>(bits), vector);
+        }
+
+        static double sum(Vector vector)
+        {
+            // reduced by hand with zero-masked extracts, the unmasked ones (and _mm512_reduce_add_pd) read an
+            // undefined source operand that GCC 12 warns about as uninitialized
+            const auto halves = _mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xf, vector, 0),
+                                              _mm512_maskz_extractf64x4_pd(0xf, vector, 1));
+            const auto quarters = _mm_add_pd(_mm256_castpd256_pd128(halves), _mm256_extractf128_pd(halves, 1));
+            return _mm_cvtsd_f64(_mm_add_sd(quarters, _mm_unpackhi_pd(quarters, quarters)));
+        }
+
+        static double squareRoot(double value)
+        {
+            return _mm_cvtsd_f64(_mm_sqrt_sd(_mm_setzero_pd(), _mm_set_sd(value)));
+        }
+
+        static unsigned int popcount(std::uint64_t bits)
+        {
+#if defined(__x86_64__) || defined(_M_X64)
+            return static_cast<unsigned int>(_mm_popcnt_u64(bits));
+#else
+            return static_cast<unsigned int>(_mm_popcnt_u32(static_cast<unsigned int>(bits)) +
+                                             _mm_popcnt_u32(static_cast<unsigned int>(bits >> 32)));
+#endif
+        }
+    };
+}
+#endif
+
+
+namespace bhtsne {
+
+const Kernels * avx512Kernels()
+{
+#ifdef BHTSNE_AVX512_KERNELS
+    static const auto avx512 = simd::makeKernels<Avx512>(InstructionSet::AVX512);
+    return &avx512;
+#else
+    return nullptr;
+#endif
+}
+
+} // namespace bhtsne
@@ -0,0 +1,79 @@
+#include "SimdKernels.h"
+
+// Compiled for SSE2, which all x86-64 compilers enable by default
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BHTSNE_SSE2_KERNELS
+#include <emmintrin.h>
+
+
+namespace {
+
+    struct Sse2
+    {
+        using Vector = __m128d;
+        static constexpr unsigned int lanes = 2;
+
+        static Vector zero() { return _mm_setzero_pd(); }
+        static Vector set(double value) { return _mm_set1_pd(value); }
+        static Vector load(const double * values) { return _mm_load_pd(values); }
+        static Vector loadu(const double * values) { return _mm_loadu_pd(values); }
+        static void store(double * values, Vector vector) { _mm_store_pd(values, vector); }
+        static void storeu(double * values, Vector vector) { _mm_storeu_pd(values, vector); }
+        static Vector add(Vector a, Vector b) { return _mm_add_pd(a, b); }
+        static Vector sub(Vector a, Vector b) { return _mm_sub_pd(a, b); }
+        static Vector mul(Vector a, Vector b) { return _mm_mul_pd(a, b); }
+        static Vector div(Vector a, Vector b) { return _mm_div_pd(a, b); }
+        static Vector abs(Vector vector) { return _mm_andnot_pd(_mm_set1_pd(-0.0), vector); }
+        static Vector max(Vector a, Vector b) { return _mm_max_pd(a, b); }
+
+        static Vector pow2(Vector exponents)
+        {
+            const auto biased = _mm_add_pd(exponents, _mm_set1_pd(4503599627371519.0));
+            return _mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(biased), 52));
+        }
+
+        static unsigned int lessThan(Vector a, Vector b)
+        {
+            return static_cast<unsigned int>(_mm_movemask_pd(_mm_cmplt_pd(a, b)));
+        }
+
+        static Vector maskZero(unsigned int bits, Vector vector)
+        {
+            const auto mask = _mm_castsi128_pd(_mm_set_epi32(bits & 2u ? -1 : 0, bits & 2u ? -1 : 0,
+                                                             bits & 1u ? -1 : 0, bits & 1u ? -1 : 0));
+            return _mm_and_pd(mask, vector);
+        }
+
+        static double sum(Vector vector)
+        {
+            return _mm_cvtsd_f64(_mm_add_sd(vector, _mm_unpackhi_pd(vector, vector)));
+        }
+
+        static double squareRoot(double value)
+        {
+            return _mm_cvtsd_f64(_mm_sqrt_sd(_mm_setzero_pd(), _mm_set_sd(value)));
+        }
+
+        // POPCNT came after SSE2
+        static unsigned int popcount(std::uint64_t bits)
+        {
+            return bhtsne::simd::Generic::popcount(bits);
+        }
+    };
+}
+#endif
+
+
+namespace bhtsne {
+
+const Kernels * sse2Kernels()
+{
+#ifdef BHTSNE_SSE2_KERNELS
+    static const auto sse2 = simd::makeKernels<Sse2>(InstructionSet::SSE2);
+    return &sse2;
+#else
+    return nullptr;
+#endif
+}
+
+} // namespace bhtsne
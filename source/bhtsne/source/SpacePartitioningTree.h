@@ -1,46 +1,163 @@
-
 #pragma once
 
 #include <array>
-#include <memory>
+#include <cstdint>
+#include <vector>
 
 #include <bhtsne/Vector2D.h>
 #include <bhtsne/SparseMatrix.h>
 
+#include "SimdKernels.h"
+
 
 namespace bhtsne {
 
     template<unsigned int D>
     class SpacePartitioningTree
     {
-        // Axis-aligned bounding box stored as a center with half-dimensions to represent the boundaries of this quad tree
-        std::array<double, D> m_centers;
-        std::array<double, D> m_radii;
-        std::array<double, D> m_centerOfMass;
-        // Children
-        std::array<std::unique_ptr<SpacePartitioningTree>, 1u << D> m_children;
-
-        // Indices in this space-partitioning tree node, corresponding center-of-mass, and list of all children
-        const Vector2D<double> & m_data;
-        unsigned int m_pointIndex;
-        unsigned int m_cumulativeSize;
-        // Properties of this node in the tree
-        bool m_isLeaf;
-
-
     public:
+        SpacePartitioningTree();
         explicit SpacePartitioningTree(const Vector2D<double> & data);
-        SpacePartitioningTree(const Vector2D<double> & data, const std::array<double, D> & centers,
-                              const std::array<double, D> & radii, unsigned int new_index);
         SpacePartitioningTree(const SpacePartitioningTree & other) = delete;
         SpacePartitioningTree(SpacePartitioningTree && other) = default;
 
-        void insert(unsigned int new_index);
-        void insertIntoChild(unsigned int new_index);
-        unsigned int childIndexForPoint(const double * point);
+        // Build the tree on data by inserting point after point, reusing the node storage of previous builds
+        void rebuild(const Vector2D<double> & data);
+        // Build the tree on data at once from the points sorted in Z-order (Morton order), reusing all storage
+        void rebuildBulk(const Vector2D<double> & data);
+
+        // Indices of the points in Morton order (the order of the leaves) of the last bulk build
+        const std::vector<unsigned int> & mortonOrder() const;
+
+        // Maximum number of points in a leaf of a bulk build; leaves with equal Morton codes may hold more
+        unsigned int leafCapacity() const;
+        void setLeafCapacity(unsigned int capacity);
 
         // TODO return forces instead of io param
         void computeNonEdgeForces(unsigned int pointIndex, double squaredTheta, double * forces, double & forceSum) const;
+        // Compute the non-edge forces of all points (forces holds D values per point) like the above, but traverse the
+        // tree iteratively once for every small group of points that are adjacent in Morton order; requires a bulk build
+        void computeNonEdgeForcesGrouped(double squaredTheta, double * forces, double & forceSum) const;
+        // Compute the non-edge forces of all points by interacting cells with cells and pushing the results down to the
+        // points; requires a bulk build
+        void computeNonEdgeForcesDualTree(double squaredTheta, double * forces, double & forceSum);
+
+    protected:
+        // Single node of the tree; children are referenced by their position in m_nodes
+        struct Node
+        {
+            // Axis-aligned bounding box stored as a center with half-dimensions
+            std::array<double, D> centers;
+            std::array<double, D> radii;
+            std::array<double, D> centerOfMass;
+            // Positions of the children in m_nodes, 0 for no child (the root is never a child)
+            std::array<unsigned int, 1u << D> children;
+
+            double maxRadius;
+            unsigned int pointIndex;
+            unsigned int cumulativeSize;
+            // Range of the points of a leaf bucket in m_bucketCoordinates, empty for leaves of a single point
+            unsigned int bucketBegin;
+            unsigned int bucketSize;
+            bool isLeaf;
+        };
+
+        // A point index and the Morton code of its position
+        struct MortonEntry
+        {
+            std::uint64_t code;
+            unsigned int index;
+        };
+
+        // A subtree of a bulk build that is built independently and spliced into m_nodes afterwards
+        struct Subtree
+        {
+            unsigned int begin;
+            unsigned int end;
+            unsigned int level;
+            std::array<double, D> centers;
+            std::array<double, D> radii;
+            // position of the parent in m_nodes and index of the subtree in its children
+            unsigned int parent;
+            unsigned int childIndex;
+            // position of the subtree root in m_nodes after splicing
+            unsigned int nodeOffset;
+        };
+
+        // Points traversing the tree together, their coordinates and results are stored per dimension for SIMD
+        static constexpr unsigned int s_groupSize = ForceKernels<D>::s_groupSize;
+        struct PointGroup
+        {
+            alignas(64) std::array<std::array<double, s_groupSize>, D> coordinates;
+            alignas(64) std::array<std::array<double, s_groupSize>, D> forces;
+            alignas(64) std::array<double, s_groupSize> forceSums;
+            std::array<unsigned int, s_groupSize> indices;
+        };
+
+        // Number of bits per dimension that fit into a 64 bit Morton code (i.e. the maximum depth of a bulk build)
+        static constexpr unsigned int s_mortonBits = D == 0 ? 0 : (64 / D < 32 ? 64 / D : 32);
+        // Number of points per chunk of parallel passes over the data and maximum size of a parallel built subtree;
+        // both do not depend on the number of threads, so the built tree does not either
+        static constexpr unsigned int s_chunkSize = 1u << 14;
+        static constexpr unsigned int s_subtreeSize = 1u << 12;
+        static constexpr unsigned int s_defaultLeafCapacity = 32;
+
+        void computeBounds(std::array<double, D> & centers, std::array<double, D> & radii) const;
+        Node leafNode(const std::array<double, D> & centers, const std::array<double, D> & radii,
+                      unsigned int pointIndex) const;
+        unsigned int createNode(const std::array<double, D> & centers, const std::array<double, D> & radii,
+                                unsigned int pointIndex);
+        void createChild(unsigned int nodeIndex, unsigned int childIndex, unsigned int pointIndex);
+        void insert(unsigned int new_index);
+        unsigned int childIndexForPoint(const Node & node, const double * point) const;
+
+        void computeMortonCodes(const std::array<double, D> & centers, const std::array<double, D> & radii);
+        void fillBuckets();
+        static void radixSort(std::vector<MortonEntry> & entries, std::vector<MortonEntry> & buffer);
+        bool isMortonLeaf(unsigned int begin, unsigned int end, unsigned int level) const;
+        void summarizeMortonLeaf(Node & node, unsigned int begin, unsigned int end) const;
+        template<typename Function>
+        void forEachMortonChild(unsigned int begin, unsigned int end, unsigned int level,
+                                const std::array<double, D> & centers, const std::array<double, D> & radii,
+                                Function function) const;
+        void buildTopLevels(unsigned int begin, unsigned int end, unsigned int level,
+                            const std::array<double, D> & centers, const std::array<double, D> & radii);
+        unsigned int buildFromMortonCodes(std::vector<Node> & nodes, unsigned int begin, unsigned int end,
+                                          unsigned int level, const std::array<double, D> & centers,
+                                          const std::array<double, D> & radii) const;
+        void spliceSubtrees();
+
+        void computeNonEdgeForces(unsigned int nodeIndex, unsigned int pointIndex, double squaredTheta,
+                                  double * forces, double & forceSum) const;
+        void computeBucketForces(const Node & node, unsigned int pointIndex, double * forces, double & forceSum) const;
+        unsigned int summarizeForGroup(const Node & node, PointGroup & group, unsigned int lanes,
+                                       double squaredTheta) const;
+
+        void collectTargetSubtrees(unsigned int nodeIndex);
+        void computeCellInteractions(unsigned int targetIndex, unsigned int sourceIndex, double squaredTheta,
+                                     double * forces, double & forceSum);
+        void pushDownCellForces(unsigned int nodeIndex, std::array<double, D> cellForces, double cellForceSum,
+                                double * forces, double & forceSum) const;
+
+        const Vector2D<double> * m_data;
+        unsigned int m_leafCapacity;
+        // All nodes of the tree, the root is stored at position 0
+        std::vector<Node> m_nodes;
+        // Points sorted by Morton code and scratch space for sorting, both kept for the next bulk build
+        std::vector<MortonEntry> m_mortonOrder;
+        std::vector<MortonEntry> m_mortonBuffer;
+        // Subtrees of the last bulk build and their nodes, kept for the next bulk build
+        std::vector<Subtree> m_subtrees;
+        std::vector<std::vector<Node>> m_subtreeNodes;
+        // Points of a bulk build in Morton order as structure of arrays (all first coordinates, then all second ...)
+        // and their indices, so that the points of every leaf bucket are stored contiguously
+        std::vector<double> m_bucketCoordinates;
+        std::vector<unsigned int> m_bucketIndices;
+        // Roots of the subtrees whose points are processed in parallel by the cell-cell traversal and, per node,
+        // the forces and normalization terms of the cell interactions that apply to each of its points
+        std::vector<unsigned int> m_targetSubtrees;
+        std::vector<double> m_cellForces;
+        std::vector<double> m_cellForceSums;
     };
 }
 
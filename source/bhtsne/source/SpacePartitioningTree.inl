@@ -1,7 +1,9 @@
 
 #include <algorithm>
+#include <cassert>
 #include <cmath>
-#include <emmintrin.h>
+#include <limits>
+#include <utility>
 
 #include "SpacePartitioningTree.h"
 
@@ -9,32 +11,152 @@
 namespace bhtsne {
 
 
-// Default constructor for SpacePartitioningTree -- build tree, too!
+// Default constructor for SpacePartitioningTree -- creates an empty tree, call rebuild() to fill it
+template<unsigned int D>
+SpacePartitioningTree<D>::SpacePartitioningTree()
+    : m_data(nullptr)
+    , m_leafCapacity(s_defaultLeafCapacity)
+{
+}
+
+// Constructor for SpacePartitioningTree -- build tree, too!
 template<unsigned int D>
 SpacePartitioningTree<D>::SpacePartitioningTree(const Vector2D<double> & data)
-    : m_data(data)
-    , m_pointIndex(0)
-    , m_isLeaf(true)
-    , m_cumulativeSize(1)
+    : m_data(nullptr)
+    , m_leafCapacity(s_defaultLeafCapacity)
+{
+    rebuild(data);
+}
+
+template<unsigned int D>
+void SpacePartitioningTree<D>::rebuild(const Vector2D<double> & data)
+{
+    m_data = &data;
+    // keeps the capacity, so repeated builds on data of the same size do not allocate
+    m_nodes.clear();
+
+    auto numberOfPoints = static_cast<unsigned int>(data.height());
+    auto centers = std::array<double, D>();
+    auto radii = std::array<double, D>();
+    computeBounds(centers, radii);
+
+    // take first point for the root
+    createNode(centers, radii, 0);
+    // insert the rest
+    for (auto i = 1u; i < numberOfPoints; ++i)
+    {
+        insert(i);
+    }
+}
+
+template<unsigned int D>
+void SpacePartitioningTree<D>::rebuildBulk(const Vector2D<double> & data)
+{
+    m_data = &data;
+    m_nodes.clear();
+    m_subtrees.clear();
+
+    auto numberOfPoints = static_cast<unsigned int>(data.height());
+    auto centers = std::array<double, D>();
+    auto radii = std::array<double, D>();
+    computeBounds(centers, radii);
+
+    // sort the points along the Z-order curve through the bounding box, so that every subtree is a contiguous range
+    computeMortonCodes(centers, radii);
+    radixSort(m_mortonOrder, m_mortonBuffer);
+    fillBuckets();
+
+    if (numberOfPoints <= s_subtreeSize)
+    {
+        buildFromMortonCodes(m_nodes, 0, numberOfPoints, 0, centers, radii);
+        return;
+    }
+
+    // build the upper levels serially, then the small subtrees below them in parallel
+    buildTopLevels(0, numberOfPoints, 0, centers, radii);
+    if (m_subtreeNodes.size() < m_subtrees.size())
+    {
+        m_subtreeNodes.resize(m_subtrees.size());
+    }
+
+    const auto numberOfSubtrees = static_cast<int>(m_subtrees.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < numberOfSubtrees; ++i)
+    {
+        const auto & subtree = m_subtrees[i];
+        auto & nodes = m_subtreeNodes[i];
+        nodes.clear();
+        buildFromMortonCodes(nodes, subtree.begin, subtree.end, subtree.level, subtree.centers, subtree.radii);
+    }
+
+    spliceSubtrees();
+}
+
+template<unsigned int D>
+const std::vector<unsigned int> & SpacePartitioningTree<D>::mortonOrder() const
+{
+    return m_bucketIndices;
+}
+
+template<unsigned int D>
+unsigned int SpacePartitioningTree<D>::leafCapacity() const
+{
+    return m_leafCapacity;
+}
+
+template<unsigned int D>
+void SpacePartitioningTree<D>::setLeafCapacity(unsigned int capacity)
+{
+    m_leafCapacity = std::max(1u, capacity);
+}
+
+// Compute mean, width, and height of current map (boundaries of SpacePartitioningTree)
+template<unsigned int D>
+void SpacePartitioningTree<D>::computeBounds(std::array<double, D> & centers, std::array<double, D> & radii) const
 {
+    const auto & data = *m_data;
     auto numberOfPoints = static_cast<unsigned int>(data.height());
     assert(numberOfPoints > 0);
-    // Compute mean, width, and height of current map (boundaries of SpacePartitioningTree)
-    auto meanY = std::array<double, D>();
-    auto minY = std::array<double, D>();
-    auto maxY = std::array<double, D>();
-    meanY.fill(0);
-    minY.fill(std::numeric_limits<double>::max());
-    maxY.fill(std::numeric_limits<double>::min());
 
-    for(unsigned int n = 0; n < numberOfPoints; ++n)
+    // partial results per chunk of points, combined in order afterwards
+    const auto numberOfChunks = static_cast<int>((numberOfPoints + s_chunkSize - 1) / s_chunkSize);
+    auto chunkSums = std::vector<std::array<double, D>>(numberOfChunks);
+    auto chunkMins = std::vector<std::array<double, D>>(numberOfChunks);
+    auto chunkMaxs = std::vector<std::array<double, D>>(numberOfChunks);
+
+    #pragma omp parallel for
+    for (int chunk = 0; chunk < numberOfChunks; ++chunk)
+    {
+        auto & sumY = chunkSums[chunk];
+        auto & minY = chunkMins[chunk];
+        auto & maxY = chunkMaxs[chunk];
+        sumY.fill(0);
+        minY.fill(std::numeric_limits<double>::max());
+        maxY.fill(std::numeric_limits<double>::min());
+
+        auto end = std::min(numberOfPoints, (chunk + 1) * s_chunkSize);
+        for (auto n = chunk * s_chunkSize; n < end; ++n)
+        {
+            for (unsigned int d = 0; d < D; ++d)
+            {
+                auto value = data[n][d];
+                sumY[d] += value;
+                minY[d] = std::min(minY[d], value);
+                maxY[d] = std::max(maxY[d], value);
+            }
+        }
+    }
+
+    auto meanY = chunkSums[0];
+    auto minY = chunkMins[0];
+    auto maxY = chunkMaxs[0];
+    for (auto chunk = 1; chunk < numberOfChunks; ++chunk)
     {
-        for(unsigned int d = 0; d < D; ++d)
+        for (unsigned int d = 0; d < D; ++d)
         {
-            auto value = data[n][d];
-            meanY[d] += value;
-            minY[d] = std::min(minY[d], value);
-            maxY[d] = std::max(maxY[d], value);
+            meanY[d] += chunkSums[chunk][d];
+            minY[d] = std::min(minY[d], chunkMins[chunk][d]);
+            maxY[d] = std::max(maxY[d], chunkMaxs[chunk][d]);
         }
     }
 
@@ -44,122 +166,482 @@ SpacePartitioningTree<D>::SpacePartitioningTree(const Vector2D<double> & data)
     }
 
     // set boundary
-    m_centers = meanY;
+    centers = meanY;
     auto delta = 1e-5;
     for (unsigned int d = 0; d < D; ++d)
     {
-        m_radii[d] = std::max(maxY[d] - meanY[d], meanY[d] - minY[d]) + delta;
+        radii[d] = std::max(maxY[d] - meanY[d], meanY[d] - minY[d]) + delta;
     }
+}
 
-    // take first point for myself
+// Create a leaf holding a single point
+template<unsigned int D>
+auto SpacePartitioningTree<D>::leafNode(const std::array<double, D> & centers, const std::array<double, D> & radii,
+                                        unsigned int pointIndex) const -> Node
+{
+    auto node = Node();
+    node.centers = centers;
+    node.radii = radii;
+    node.children.fill(0);
+    node.maxRadius = 0.0;
+    node.pointIndex = pointIndex;
+    node.cumulativeSize = 1;
+    node.bucketBegin = 0;
+    node.bucketSize = 0;
+    node.isLeaf = true;
+
+    auto point = (*m_data)[pointIndex];
     for (unsigned int d = 0; d < D; ++d)
     {
-        m_centerOfMass[d] = data[0][d];
+        node.centerOfMass[d] = point[d];
+        node.maxRadius = std::max(radii[d], node.maxRadius);
     }
-    // insert the rest
-    for (auto i = 1u; i < numberOfPoints; ++i)
+    return node;
+}
+
+// Append a leaf holding a single point to the node storage and return its position
+template<unsigned int D>
+unsigned int SpacePartitioningTree<D>::createNode(const std::array<double, D> & centers,
+                                                  const std::array<double, D> & radii, unsigned int pointIndex)
+{
+    m_nodes.push_back(leafNode(centers, radii, pointIndex));
+    return static_cast<unsigned int>(m_nodes.size() - 1);
+}
+
+// Insert a point into the SpacePartitioningTree
+template<unsigned int D>
+void SpacePartitioningTree<D>::insert(unsigned int new_index)
+{
+    auto new_point = (*m_data)[new_index];
+
+    // descend from the root; m_nodes may grow in here, so nodes are only referenced by position
+    auto nodeIndex = 0u;
+    while (true)
     {
-        insert(i);
+        {
+            auto & node = m_nodes[nodeIndex];
+
+            // Online update of cumulative size and center-of-mass
+            node.cumulativeSize++;
+            auto avgAdjustment = (node.cumulativeSize - 1.0) / node.cumulativeSize;
+            for (unsigned int d = 0; d < D; ++d)
+            {
+                node.centerOfMass[d] *= avgAdjustment;
+                node.centerOfMass[d] += new_point[d] / node.cumulativeSize;
+            }
+
+            // leafs must be subdivided
+            if (node.isLeaf)
+            {
+                // Don't add duplicates for now (this is not very nice)
+                bool duplicate = true;
+                for (unsigned int d = 0; d < D; d++)
+                {
+                    if (new_point[d] != (*m_data)[node.pointIndex][d])
+                    {
+                        duplicate = false;
+                        break;
+                    }
+                }
+                if (duplicate)
+                {
+                    return;
+                }
+            }
+        }
+
+        // move the point of a leaf to a new child
+        if (m_nodes[nodeIndex].isLeaf)
+        {
+            auto pointIndex = m_nodes[nodeIndex].pointIndex;
+            createChild(nodeIndex, childIndexForPoint(m_nodes[nodeIndex], (*m_data)[pointIndex]), pointIndex);
+            m_nodes[nodeIndex].isLeaf = false;
+        }
+
+        // insert new point into correct child
+        auto childIndex = childIndexForPoint(m_nodes[nodeIndex], new_point);
+        auto child = m_nodes[nodeIndex].children[childIndex];
+        if (child == 0)
+        {
+            createChild(nodeIndex, childIndex, new_index);
+            return;
+        }
+
+        nodeIndex = child;
     }
 }
 
-
-// Constructor for SpacePartitioningTree with particular size (do not fill the tree)
+// Create the leaf child at childIndex of the node at nodeIndex holding the given point
 template<unsigned int D>
-SpacePartitioningTree<D>::SpacePartitioningTree(const Vector2D<double> & data, const std::array<double, D> & centers,
-                                                const std::array<double, D> & radii, unsigned int new_index)
-    : m_centers(centers)
-    , m_radii(radii)
-    , m_data(data)
-    , m_pointIndex(new_index)
-    , m_isLeaf(true)
-    , m_cumulativeSize(1)
+void SpacePartitioningTree<D>::createChild(unsigned int nodeIndex, unsigned int childIndex, unsigned int pointIndex)
 {
-    auto new_point = m_data[new_index];
+    auto child_center = std::array<double, D>{};
+    auto halved_radius = std::array<double, D>{};
     for (unsigned int d = 0; d < D; ++d)
     {
-        m_centerOfMass[d] = new_point[d];
+        halved_radius[d] = m_nodes[nodeIndex].radii[d] / 2.0;
+        // if the d-th bit is set in the index, the child is below the center in the dimension d
+        child_center[d] = (childIndex & (1 << d)) ? m_nodes[nodeIndex].centers[d] - halved_radius[d]
+                                                  : m_nodes[nodeIndex].centers[d] + halved_radius[d];
     }
+    // createNode may reallocate m_nodes, so the parent is accessed by position afterwards
+    auto child = createNode(child_center, halved_radius, pointIndex);
+    m_nodes[nodeIndex].children[childIndex] = child;
 }
 
+template<unsigned int D>
+unsigned int SpacePartitioningTree<D>::childIndexForPoint(const Node & node, const double * point) const
+{
+    // if the child is below the center in the dimension d, the d-th bit is set in the index
+    unsigned int childIndex = 0;
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        if (point[d] < node.centers[d])
+        {
+            childIndex |= (1 << d);
+        }
+    }
+    return childIndex;
+}
 
-// Insert a point into the SpacePartitioningTree
+// Quantize every point to s_mortonBits per dimension within the bounding box and interleave the bits
 template<unsigned int D>
-void SpacePartitioningTree<D>::insert(unsigned int new_index)
+void SpacePartitioningTree<D>::computeMortonCodes(const std::array<double, D> & centers,
+                                                  const std::array<double, D> & radii)
 {
-    auto new_point = m_data[new_index];
+    const auto & data = *m_data;
+    auto numberOfPoints = static_cast<int>(data.height());
+    m_mortonOrder.resize(numberOfPoints);
 
-    // Online update of cumulative size and center-of-mass
-    m_cumulativeSize++;
-    auto avgAdjustment = (m_cumulativeSize - 1.0) / m_cumulativeSize;
+    auto lower = std::array<double, D>();
+    auto scale = std::array<double, D>();
+    const auto cells = static_cast<double>(std::uint64_t(1) << s_mortonBits);
+    const auto maxCell = (std::uint64_t(1) << s_mortonBits) - 1;
     for (unsigned int d = 0; d < D; ++d)
     {
-        m_centerOfMass[d] *= avgAdjustment;
-        m_centerOfMass[d] += new_point[d] / m_cumulativeSize;
+        lower[d] = centers[d] - radii[d];
+        scale[d] = cells / (2.0 * radii[d]);
     }
 
-    // leafs must be subdivided
-    if (m_isLeaf)
+    #pragma omp parallel for
+    for (int n = 0; n < numberOfPoints; ++n)
     {
-        // Don't add duplicates for now (this is not very nice)
-        bool duplicate = true;
-        for (unsigned int d = 0; d < D; d++)
+        auto point = data[n];
+        std::uint64_t code = 0;
+        for (unsigned int d = 0; d < D; ++d)
         {
-            if (new_point[d] != m_data[m_pointIndex][d])
+            auto cell = std::max(0.0, (point[d] - lower[d]) * scale[d]);
+            auto quantized = std::min(static_cast<std::uint64_t>(cell), maxCell);
+            // bit b of dimension d becomes bit b * D + d of the code, so the top level is stored in the highest bits
+            for (unsigned int b = 0; b < s_mortonBits; ++b)
             {
-                duplicate = false;
-                break;
+                code |= ((quantized >> b) & 1u) << (b * D + d);
             }
         }
-        if (duplicate)
+        m_mortonOrder[n] = MortonEntry{ code, static_cast<unsigned int>(n) };
+    }
+}
+
+// Copy the points in Morton order into the structure of arrays used by the leaf buckets
+template<unsigned int D>
+void SpacePartitioningTree<D>::fillBuckets()
+{
+    const auto & data = *m_data;
+    const auto numberOfPoints = static_cast<int>(m_mortonOrder.size());
+    m_bucketCoordinates.resize(D * m_mortonOrder.size());
+    m_bucketIndices.resize(m_mortonOrder.size());
+
+    #pragma omp parallel for
+    for (int i = 0; i < numberOfPoints; ++i)
+    {
+        auto index = m_mortonOrder[i].index;
+        m_bucketIndices[i] = index;
+        for (unsigned int d = 0; d < D; ++d)
         {
-            return;
+            m_bucketCoordinates[d * numberOfPoints + i] = data[index][d];
+        }
+    }
+}
+
+// Stable least significant digit radix sort of the entries by their Morton code
+template<unsigned int D>
+void SpacePartitioningTree<D>::radixSort(std::vector<MortonEntry> & entries, std::vector<MortonEntry> & buffer)
+{
+    const auto radixBits = 8u;
+    const auto buckets = 1u << radixBits;
+    const auto size = entries.size();
+    buffer.resize(size);
+
+    // every chunk of entries is counted and scattered on its own, the target positions are ordered by bucket first
+    const auto numberOfChunks = static_cast<int>((size + s_chunkSize - 1) / s_chunkSize);
+    auto offsets = std::vector<std::size_t>(numberOfChunks * buckets);
+    auto chunkRange = [size](int chunk)
+    {
+        return std::make_pair(chunk * std::size_t(s_chunkSize), std::min(size, (chunk + 1) * std::size_t(s_chunkSize)));
+    };
+
+    for (unsigned int shift = 0; shift < 64; shift += radixBits)
+    {
+        #pragma omp parallel for
+        for (int chunk = 0; chunk < numberOfChunks; ++chunk)
+        {
+            auto counts = offsets.begin() + chunk * buckets;
+            std::fill(counts, counts + buckets, 0);
+            auto range = chunkRange(chunk);
+            for (auto i = range.first; i < range.second; ++i)
+            {
+                ++counts[(entries[i].code >> shift) & (buckets - 1)];
+            }
         }
 
-        // move my own point to child
-        insertIntoChild(m_pointIndex);
-        m_isLeaf = false;
+        // skip digits that are equal for all entries, e.g. the unused high bits for D = 3
+        auto sum = std::size_t(0);
+        auto uniform = false;
+        for (unsigned int bucket = 0; bucket < buckets && !uniform; ++bucket)
+        {
+            auto total = std::size_t(0);
+            for (auto chunk = 0; chunk < numberOfChunks; ++chunk)
+            {
+                total += offsets[chunk * buckets + bucket];
+            }
+            uniform = total == size;
+        }
+        if (uniform)
+        {
+            continue;
+        }
+
+        for (unsigned int bucket = 0; bucket < buckets; ++bucket)
+        {
+            for (auto chunk = 0; chunk < numberOfChunks; ++chunk)
+            {
+                auto count = offsets[chunk * buckets + bucket];
+                offsets[chunk * buckets + bucket] = sum;
+                sum += count;
+            }
+        }
+
+        #pragma omp parallel for
+        for (int chunk = 0; chunk < numberOfChunks; ++chunk)
+        {
+            auto targets = offsets.begin() + chunk * buckets;
+            auto range = chunkRange(chunk);
+            for (auto i = range.first; i < range.second; ++i)
+            {
+                buffer[targets[(entries[i].code >> shift) & (buckets - 1)]++] = entries[i];
+            }
+        }
+        entries.swap(buffer);
     }
+}
 
-    // insert new point into correct child
-    insertIntoChild(new_index);
+// Ranges that fit into a bucket and points with equal codes, which cannot be separated any further, become leaves
+template<unsigned int D>
+bool SpacePartitioningTree<D>::isMortonLeaf(unsigned int begin, unsigned int end, unsigned int level) const
+{
+    return end - begin <= m_leafCapacity || level == s_mortonBits
+        || m_mortonOrder[begin].code == m_mortonOrder[end - 1].code;
 }
 
 template<unsigned int D>
-void SpacePartitioningTree<D>::insertIntoChild(unsigned int new_index)
+void SpacePartitioningTree<D>::summarizeMortonLeaf(Node & node, unsigned int begin, unsigned int end) const
 {
-    auto childIndex = childIndexForPoint(m_data[new_index]);
-    if (!m_children[childIndex])
+    auto count = end - begin;
+    auto centerOfMass = std::array<double, D>();
+    centerOfMass.fill(0.0);
+    for (auto i = begin; i < end; ++i)
     {
+        auto point = (*m_data)[m_mortonOrder[i].index];
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            centerOfMass[d] += point[d];
+        }
+    }
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        node.centerOfMass[d] = centerOfMass[d] / count;
+    }
+    node.cumulativeSize = count;
+    if (count > 1)
+    {
+        node.bucketBegin = begin;
+        node.bucketSize = count;
+    }
+}
+
+// Call function(childBegin, childEnd, childIndex, centers, radii) for the non-empty children of [begin, end)
+template<unsigned int D>
+template<typename Function>
+void SpacePartitioningTree<D>::forEachMortonChild(unsigned int begin, unsigned int end, unsigned int level,
+                                                  const std::array<double, D> & centers,
+                                                  const std::array<double, D> & radii, Function function) const
+{
+    // the D bits of this level select the child; they are sorted within the range since all higher bits are equal
+    const auto shift = (s_mortonBits - 1 - level) * D;
+    const auto digitMask = (1u << D) - 1;
+    auto digitOf = [shift, digitMask](const MortonEntry & entry)
+    {
+        return static_cast<unsigned int>(entry.code >> shift) & digitMask;
+    };
+
+    auto childBegin = begin;
+    while (childBegin < end)
+    {
+        auto digit = digitOf(m_mortonOrder[childBegin]);
+        auto childEnd = static_cast<unsigned int>(std::partition_point(
+            m_mortonOrder.begin() + childBegin, m_mortonOrder.begin() + end,
+            [digit, &digitOf](const MortonEntry & entry) { return digitOf(entry) == digit; }) - m_mortonOrder.begin());
+
+        // a set bit in the code means the upper half, whereas a set bit in the child index means below the center
+        auto childIndex = ~digit & digitMask;
         auto child_center = std::array<double, D>{};
         auto halved_radius = std::array<double, D>{};
         for (unsigned int d = 0; d < D; ++d)
         {
-            halved_radius[d] = m_radii[d] / 2.0;
-            // if the d-th bit is set in the index, the child is below the center in the dimension d
-            child_center[d] = (childIndex & (1 << d)) ? m_centers[d] - halved_radius[d] : m_centers[d] + halved_radius[d];
+            halved_radius[d] = radii[d] / 2.0;
+            child_center[d] = (childIndex & (1 << d)) ? centers[d] - halved_radius[d] : centers[d] + halved_radius[d];
         }
-        m_children[childIndex] = std::make_unique<SpacePartitioningTree>(m_data, child_center, halved_radius, new_index);
+
+        function(childBegin, childEnd, childIndex, child_center, halved_radius);
+        childBegin = childEnd;
     }
-    else
+}
+
+// Build the nodes above subtrees of at most s_subtreeSize points into m_nodes and collect those subtrees
+template<unsigned int D>
+void SpacePartitioningTree<D>::buildTopLevels(unsigned int begin, unsigned int end, unsigned int level,
+                                              const std::array<double, D> & centers,
+                                              const std::array<double, D> & radii)
+{
+    auto nodeIndex = createNode(centers, radii, m_mortonOrder[begin].index);
+    if (isMortonLeaf(begin, end, level))
     {
-        m_children[childIndex]->insert(new_index);
+        summarizeMortonLeaf(m_nodes[nodeIndex], begin, end);
+        return;
     }
+
+    // the center of mass is aggregated in spliceSubtrees, once all children are built
+    m_nodes[nodeIndex].cumulativeSize = end - begin;
+    m_nodes[nodeIndex].isLeaf = false;
+    forEachMortonChild(begin, end, level, centers, radii,
+        [this, nodeIndex, level](unsigned int childBegin, unsigned int childEnd, unsigned int childIndex,
+                                 const std::array<double, D> & childCenters, const std::array<double, D> & childRadii)
+    {
+        if (childEnd - childBegin > s_subtreeSize)
+        {
+            // the child is created next, so its position is known before m_nodes grows
+            m_nodes[nodeIndex].children[childIndex] = static_cast<unsigned int>(m_nodes.size());
+            buildTopLevels(childBegin, childEnd, level + 1, childCenters, childRadii);
+        }
+        else
+        {
+            m_subtrees.push_back(Subtree{ childBegin, childEnd, level + 1, childCenters, childRadii,
+                                          nodeIndex, childIndex, 0 });
+        }
+    });
 }
 
+// Build the subtree for the Morton sorted points in [begin, end) whose codes share all bits above level into nodes
 template<unsigned int D>
-unsigned int SpacePartitioningTree<D>::childIndexForPoint(const double * point)
+unsigned int SpacePartitioningTree<D>::buildFromMortonCodes(std::vector<Node> & nodes, unsigned int begin,
+                                                            unsigned int end, unsigned int level,
+                                                            const std::array<double, D> & centers,
+                                                            const std::array<double, D> & radii) const
 {
-    // if the child is below the center in the dimension d, the d-th bit is set in the index
-    unsigned int childIndex = 0;
+    auto nodeIndex = static_cast<unsigned int>(nodes.size());
+    nodes.push_back(leafNode(centers, radii, m_mortonOrder[begin].index));
+    if (isMortonLeaf(begin, end, level))
+    {
+        summarizeMortonLeaf(nodes[nodeIndex], begin, end);
+        return nodeIndex;
+    }
+
+    auto centerOfMass = std::array<double, D>();
+    centerOfMass.fill(0.0);
+    forEachMortonChild(begin, end, level, centers, radii,
+        [this, &nodes, &centerOfMass, nodeIndex, level](unsigned int childBegin, unsigned int childEnd,
+                                                        unsigned int childIndex,
+                                                        const std::array<double, D> & childCenters,
+                                                        const std::array<double, D> & childRadii)
+    {
+        auto child = buildFromMortonCodes(nodes, childBegin, childEnd, level + 1, childCenters, childRadii);
+        nodes[nodeIndex].children[childIndex] = child;
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            centerOfMass[d] += nodes[child].centerOfMass[d] * nodes[child].cumulativeSize;
+        }
+    });
+
+    auto count = end - begin;
+    auto & node = nodes[nodeIndex];
     for (unsigned int d = 0; d < D; ++d)
     {
-        if (point[d] < m_centers[d])
+        node.centerOfMass[d] = centerOfMass[d] / count;
+    }
+    node.cumulativeSize = count;
+    node.isLeaf = false;
+    return nodeIndex;
+}
+
+// Append the subtrees built in parallel to m_nodes and complete the nodes above them
+template<unsigned int D>
+void SpacePartitioningTree<D>::spliceSubtrees()
+{
+    const auto numberOfTopNodes = static_cast<unsigned int>(m_nodes.size());
+    auto size = std::size_t(numberOfTopNodes);
+    for (std::size_t i = 0; i < m_subtrees.size(); ++i)
+    {
+        m_subtrees[i].nodeOffset = static_cast<unsigned int>(size);
+        size += m_subtreeNodes[i].size();
+    }
+    m_nodes.resize(size);
+
+    const auto numberOfSubtrees = static_cast<int>(m_subtrees.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < numberOfSubtrees; ++i)
+    {
+        const auto & subtree = m_subtrees[i];
+        auto target = m_nodes.begin() + subtree.nodeOffset;
+        for (const auto & node : m_subtreeNodes[i])
         {
-            childIndex |= (1 << d);
+            auto & spliced = *target++ = node;
+            for (auto & child : spliced.children)
+            {
+                child = child == 0 ? 0 : child + subtree.nodeOffset;
+            }
+        }
+        m_nodes[subtree.parent].children[subtree.childIndex] = subtree.nodeOffset;
+    }
+
+    // children of the top nodes are stored behind them, so their centers of mass are complete when walking backwards
+    for (auto nodeIndex = numberOfTopNodes; nodeIndex-- > 0;)
+    {
+        auto & node = m_nodes[nodeIndex];
+        if (node.isLeaf)
+        {
+            continue;
+        }
+
+        // aggregate in the order of buildFromMortonCodes (ascending digits, i.e. descending child indices)
+        auto centerOfMass = std::array<double, D>();
+        centerOfMass.fill(0.0);
+        for (auto childIndex = node.children.size(); childIndex-- > 0;)
+        {
+            auto child = node.children[childIndex];
+            if (child == 0)
+            {
+                continue;
+            }
+            for (unsigned int d = 0; d < D; ++d)
+            {
+                centerOfMass[d] += m_nodes[child].centerOfMass[d] * m_nodes[child].cumulativeSize;
+            }
+        }
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            node.centerOfMass[d] = centerOfMass[d] / node.cumulativeSize;
         }
     }
-    return childIndex;
 }
 
 // Compute non-edge forces using Barnes-Hut algorithm
@@ -167,30 +649,38 @@ template<unsigned int D>
 void SpacePartitioningTree<D>::computeNonEdgeForces(unsigned int pointIndex, double squaredTheta, double * forces,
                                                     double & forceSum) const
 {
+    assert(!m_nodes.empty());
+    computeNonEdgeForces(0, pointIndex, squaredTheta, forces, forceSum);
+}
+
+template<unsigned int D>
+void SpacePartitioningTree<D>::computeNonEdgeForces(unsigned int nodeIndex, unsigned int pointIndex,
+                                                    double squaredTheta, double * forces, double & forceSum) const
+{
+    const auto & node = m_nodes[nodeIndex];
+
     // Make sure that we spend no time on empty nodes or self-interactions
-    if (m_isLeaf && m_pointIndex == pointIndex)
+    if (node.isLeaf && node.bucketSize == 0 && node.pointIndex == pointIndex)
     {
         return;
     }
 
     auto distances = std::array<double, D>();
     double sumOfSquaredDistances = 0.0;
-    const auto & point = m_data[pointIndex];
-    double maxRadius = 0.0;
+    const auto & point = (*m_data)[pointIndex];
     for (unsigned int d = 0; d < D; ++d)
     {
         // Compute distance between point and center-of-mass
-        distances[d] = point[d] - m_centerOfMass[d];
+        distances[d] = point[d] - node.centerOfMass[d];
         sumOfSquaredDistances += distances[d] * distances[d];
-        maxRadius = std::max(m_radii[d], maxRadius);
     }
 
     // Check whether we can use this node as a "summary"
-    if(m_isLeaf || maxRadius * maxRadius < squaredTheta * sumOfSquaredDistances)
+    if((node.isLeaf && node.bucketSize == 0) || node.maxRadius * node.maxRadius < squaredTheta * sumOfSquaredDistances)
     {
         // Compute and add t-SNE force between point and current node
         auto inverseDistSum = 1.0 / (1.0 + sumOfSquaredDistances);
-        auto force = m_cumulativeSize * inverseDistSum;
+        auto force = node.cumulativeSize * inverseDistSum;
         forceSum += force;
         force *= inverseDistSum;
         // TODO vectorize
@@ -199,20 +689,310 @@ void SpacePartitioningTree<D>::computeNonEdgeForces(unsigned int pointIndex, dou
             forces[d] += force * distances[d];
         }
     }
+    else if (node.isLeaf)
+    {
+        computeBucketForces(node, pointIndex, forces, forceSum);
+    }
     else
     {
         // Recursively apply Barnes-Hut to children
-        for (auto & child : m_children)
+        for (auto child : node.children)
         {
-            // TODO: prevent invalid children in m_children
-            if(!child)
+            if (child == 0)
             {
                 continue;
             }
 
-            child->computeNonEdgeForces(pointIndex, squaredTheta, forces, forceSum);
+            computeNonEdgeForces(child, pointIndex, squaredTheta, forces, forceSum);
+        }
+    }
+}
+
+// Compute non-edge forces using the Barnes-Hut algorithm for groups of points
+template<unsigned int D>
+void SpacePartitioningTree<D>::computeNonEdgeForcesGrouped(double squaredTheta, double * forces,
+                                                           double & forceSum) const
+{
+    assert(!m_nodes.empty());
+    const auto numberOfPoints = static_cast<unsigned int>(m_bucketIndices.size());
+    const auto numberOfGroups = static_cast<int>((numberOfPoints + s_groupSize - 1) / s_groupSize);
+    double sum = 0.0;
+
+    #pragma omp parallel reduction(+:sum)
+    {
+        // nodes to visit and the lanes of the group that visit them
+        auto stack = std::vector<std::pair<unsigned int, unsigned int>>();
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int g = 0; g < numberOfGroups; ++g)
+        {
+            const auto first = g * s_groupSize;
+            const auto size = std::min(s_groupSize, numberOfPoints - first);
+            auto group = PointGroup();
+            for (unsigned int lane = 0; lane < s_groupSize; ++lane)
+            {
+                // unused lanes repeat the last point, but are never active
+                auto position = first + std::min(lane, size - 1);
+                group.indices[lane] = m_bucketIndices[position];
+                group.forceSums[lane] = 0.0;
+                for (unsigned int d = 0; d < D; ++d)
+                {
+                    group.coordinates[d][lane] = m_bucketCoordinates[d * numberOfPoints + position];
+                    group.forces[d][lane] = 0.0;
+                }
+            }
+
+            // visit the children in the order of the recursive traversal, so every point sums up in the same order
+            stack.emplace_back(0, (1u << size) - 1);
+            while (!stack.empty())
+            {
+                auto entry = stack.back();
+                stack.pop_back();
+                const auto & node = m_nodes[entry.first];
+                auto lanes = summarizeForGroup(node, group, entry.second, squaredTheta);
+                if (lanes == 0)
+                {
+                    continue;
+                }
+
+                if (node.isLeaf)
+                {
+                    for (unsigned int lane = 0; lane < size; ++lane)
+                    {
+                        if (!(lanes & (1u << lane)))
+                        {
+                            continue;
+                        }
+                        auto bucketForces = std::array<double, D>();
+                        bucketForces.fill(0.0);
+                        computeBucketForces(node, group.indices[lane], bucketForces.data(), group.forceSums[lane]);
+                        for (unsigned int d = 0; d < D; ++d)
+                        {
+                            group.forces[d][lane] += bucketForces[d];
+                        }
+                    }
+                    continue;
+                }
+
+                for (auto childIndex = node.children.size(); childIndex-- > 0;)
+                {
+                    if (node.children[childIndex] != 0)
+                    {
+                        stack.emplace_back(node.children[childIndex], lanes);
+                    }
+                }
+            }
+
+            for (unsigned int lane = 0; lane < size; ++lane)
+            {
+                for (unsigned int d = 0; d < D; ++d)
+                {
+                    forces[group.indices[lane] * D + d] += group.forces[d][lane];
+                }
+                sum += group.forceSums[lane];
+            }
+        }
+    }
+    forceSum += sum;
+}
+
+// Add the interactions of the given lanes of the group with the node where it can be used as a summary, return the
+// lanes that need to visit the children (or the points of a bucket) instead
+template<unsigned int D>
+unsigned int SpacePartitioningTree<D>::summarizeForGroup(const Node & node, PointGroup & group, unsigned int lanes,
+                                                         double squaredTheta) const
+{
+    // leaves of a single point are always used as a summary, except by the point itself
+    const auto singlePoint = node.isLeaf && node.bucketSize == 0;
+    if (singlePoint)
+    {
+        for (unsigned int lane = 0; lane < s_groupSize; ++lane)
+        {
+            if (group.indices[lane] == node.pointIndex)
+            {
+                lanes &= ~(1u << lane);
+            }
         }
     }
+
+    const auto summarized = forceKernels<D>().summarizeGroup(
+        reinterpret_cast<const double *>(group.coordinates.data()), node.centerOfMass.data(),
+        node.maxRadius * node.maxRadius, node.cumulativeSize, squaredTheta, lanes, singlePoint,
+        reinterpret_cast<double *>(group.forces.data()), group.forceSums.data());
+    return lanes & ~summarized;
+}
+
+// Compute non-edge forces using the dual-tree variant of the Barnes-Hut algorithm
+template<unsigned int D>
+void SpacePartitioningTree<D>::computeNonEdgeForcesDualTree(double squaredTheta, double * forces, double & forceSum)
+{
+    assert(!m_nodes.empty());
+    m_cellForces.assign(m_nodes.size() * D, 0.0);
+    m_cellForceSums.assign(m_nodes.size(), 0.0);
+
+    // every target subtree is traversed against the whole tree; the subtrees are disjoint, so are the written nodes
+    m_targetSubtrees.clear();
+    collectTargetSubtrees(0);
+    const auto numberOfTargets = static_cast<int>(m_targetSubtrees.size());
+    auto targetForceSums = std::vector<double>(numberOfTargets, 0.0);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < numberOfTargets; ++i)
+    {
+        auto target = m_targetSubtrees[i];
+        computeCellInteractions(target, 0, squaredTheta, forces, targetForceSums[i]);
+
+        auto cellForces = std::array<double, D>();
+        cellForces.fill(0.0);
+        pushDownCellForces(target, cellForces, 0.0, forces, targetForceSums[i]);
+    }
+
+    // sum in a fixed order, so the result does not depend on the number of threads
+    for (auto each : targetForceSums)
+    {
+        forceSum += each;
+    }
+}
+
+// Collect the largest subtrees of at most s_subtreeSize points (or leaves) as targets of the cell-cell traversal
+template<unsigned int D>
+void SpacePartitioningTree<D>::collectTargetSubtrees(unsigned int nodeIndex)
+{
+    const auto & node = m_nodes[nodeIndex];
+    if (node.isLeaf || node.cumulativeSize <= s_subtreeSize)
+    {
+        m_targetSubtrees.push_back(nodeIndex);
+        return;
+    }
+
+    for (auto child : node.children)
+    {
+        if (child != 0)
+        {
+            collectTargetSubtrees(child);
+        }
+    }
+}
+
+// Interact all points of the target cell with all points of the source cell
+template<unsigned int D>
+void SpacePartitioningTree<D>::computeCellInteractions(unsigned int targetIndex, unsigned int sourceIndex,
+                                                       double squaredTheta, double * forces, double & forceSum)
+{
+    const auto & target = m_nodes[targetIndex];
+    const auto & source = m_nodes[sourceIndex];
+
+    auto distances = std::array<double, D>();
+    double sumOfSquaredDistances = 0.0;
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        distances[d] = target.centerOfMass[d] - source.centerOfMass[d];
+        sumOfSquaredDistances += distances[d] * distances[d];
+    }
+
+    // Both cells are summarized by their centers of mass if they are small compared to their distance
+    auto radii = target.maxRadius + source.maxRadius;
+    if (targetIndex != sourceIndex && radii * radii < squaredTheta * sumOfSquaredDistances)
+    {
+        // the interaction applies to every point of the target, it is added to them in pushDownCellForces
+        auto inverseDistSum = 1.0 / (1.0 + sumOfSquaredDistances);
+        auto force = source.cumulativeSize * inverseDistSum;
+        m_cellForceSums[targetIndex] += force;
+        force *= inverseDistSum;
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            m_cellForces[targetIndex * D + d] += force * distances[d];
+        }
+    }
+    else if (target.isLeaf)
+    {
+        // leaves cannot be split any further, so their points traverse the source on their own
+        if (target.bucketSize == 0)
+        {
+            computeNonEdgeForces(sourceIndex, target.pointIndex, squaredTheta, forces + target.pointIndex * D,
+                                 forceSum);
+            return;
+        }
+        for (auto i = target.bucketBegin; i < target.bucketBegin + target.bucketSize; ++i)
+        {
+            auto pointIndex = m_bucketIndices[i];
+            computeNonEdgeForces(sourceIndex, pointIndex, squaredTheta, forces + pointIndex * D, forceSum);
+        }
+    }
+    else if (source.isLeaf || target.maxRadius >= source.maxRadius)
+    {
+        // split the larger cell
+        for (auto child : target.children)
+        {
+            if (child != 0)
+            {
+                computeCellInteractions(child, sourceIndex, squaredTheta, forces, forceSum);
+            }
+        }
+    }
+    else
+    {
+        for (auto child : source.children)
+        {
+            if (child != 0)
+            {
+                computeCellInteractions(targetIndex, child, squaredTheta, forces, forceSum);
+            }
+        }
+    }
+}
+
+// Add the cell interactions of the node and its ancestors (given in cellForces and cellForceSum) to its points
+template<unsigned int D>
+void SpacePartitioningTree<D>::pushDownCellForces(unsigned int nodeIndex, std::array<double, D> cellForces,
+                                                  double cellForceSum, double * forces, double & forceSum) const
+{
+    const auto & node = m_nodes[nodeIndex];
+    for (unsigned int d = 0; d < D; ++d)
+    {
+        cellForces[d] += m_cellForces[nodeIndex * D + d];
+    }
+    cellForceSum += m_cellForceSums[nodeIndex];
+
+    if (!node.isLeaf)
+    {
+        for (auto child : node.children)
+        {
+            if (child != 0)
+            {
+                pushDownCellForces(child, cellForces, cellForceSum, forces, forceSum);
+            }
+        }
+        return;
+    }
+
+    auto addToPoint = [&cellForces, forces](unsigned int pointIndex)
+    {
+        for (unsigned int d = 0; d < D; ++d)
+        {
+            forces[pointIndex * D + d] += cellForces[d];
+        }
+    };
+    if (node.bucketSize == 0)
+    {
+        addToPoint(node.pointIndex);
+    }
+    else
+    {
+        std::for_each(m_bucketIndices.begin() + node.bucketBegin,
+                      m_bucketIndices.begin() + node.bucketBegin + node.bucketSize, addToPoint);
+    }
+    forceSum += cellForceSum * node.cumulativeSize;
+}
+
+// Add the exact interactions with all points of a leaf bucket except pointIndex itself (but including its duplicates)
+template<unsigned int D>
+void SpacePartitioningTree<D>::computeBucketForces(const Node & node, unsigned int pointIndex, double * forces,
+                                                   double & forceSum) const
+{
+    forceKernels<D>().bucketForces((*m_data)[pointIndex], m_bucketCoordinates.data(), m_bucketIndices.size(),
+                                   m_bucketIndices.data(), node.bucketBegin, node.bucketBegin + node.bucketSize,
+                                   pointIndex, forces, forceSum);
 }
 
 
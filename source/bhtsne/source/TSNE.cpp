@@ -47,49 +47,88 @@
 #include <vector>
 #include <numeric>
 
+#include "FFTInterpolation.h"
+#include "BruteForceSearch.h"
+#include "Distance.h"
+#include "GradientWorkspace.h"
+#include "HierarchicalNavigableSmallWorld.h"
+#include "NearestNeighborDescent.h"
+#include "RandomProjectionForest.h"
+#include "SimdKernels.h"
 #include "SpacePartitioningTree.h"
 #include "VantagePointTree.h"
+#include "Checksum.h"
 
 
 using namespace bhtsne;
 
 
+namespace {
+
+    // Header of cached input similarities
+    const char s_cacheMagic[4] = { 'T', 'S', 'N', 'P' };
+    const std::uint32_t s_cacheVersion = 1;
+}
+
+
 TSNE::TSNE()
     : m_perplexity(50.0)
+    , m_perplexities()
+    , m_pointPerplexities()
     , m_gradientAccuracy(0.2)
+    , m_gradientMethod(GradientMethod::BarnesHut)
+    , m_neighborMethod(NeighborMethod::Automatic)
+    , m_distanceMetric(DistanceMetric::Euclidean)
+    , m_randomProjectionTrees(10)
+    , m_neighborSearchBudget(0)
+    , m_neighborDescentThreshold(0.001)
+    , m_neighborIndexFile()
+    , m_similarityCacheFile()
     , m_iterations(1000)
+    , m_reorderInterval(0)
     , m_outputDimensions(2)
     , m_inputDimensions(0)
     , m_dataSize(0)
     , m_seed(static_cast<unsigned long>(std::chrono::high_resolution_clock::now().time_since_epoch().count()))
     , m_outputFile("result")
+    , m_treeBuildTime(0.0)
+    , m_forceTime(0.0)
 {
 }
 
 // Compute gradient of the t-SNE cost function (using Barnes-Hut algorithm) (approximately)
 template<unsigned int D>
-Vector2D<double> TSNE::computeGradient(SparseMatrix & similarities)
+const Vector2D<double> & TSNE::computeGradient(SparseMatrix & similarities, SpacePartitioningTree<D> & tree,
+                                               FFTInterpolation<D> & interpolation, GradientWorkspace & workspace,
+                                               double & sumQ)
 {
-    // Construct space-partitioning tree on current map
-    auto tree = SpacePartitioningTree<D>(m_result);
-
-    // Loop over all edges in the graph
-    auto distances = std::array<double, D>();
+    // Construct space-partitioning tree on current map (reusing the storage of the last iteration),
+    // unless the repulsive forces are interpolated
+    const auto interpolate = m_gradientMethod == GradientMethod::Interpolation && (D == 1 || D == 2);
+    auto start = std::chrono::steady_clock::now();
+    if (!interpolate)
+    {
+        tree.rebuildBulk(m_result);
+    }
+    auto built = std::chrono::steady_clock::now();
+    m_treeBuildTime += built - start;
 
-    // Compute all terms required for t-SNE gradient
-    auto positiveForces = Vector2D<double>(m_dataSize, m_outputDimensions, 0.0);
-    auto negativeForces = Vector2D<double>(m_dataSize, m_outputDimensions, 0.0);
+    // Compute all terms required for t-SNE gradient, the positive forces are accumulated in the gradients
+    workspace.prepare(m_dataSize, m_outputDimensions);
+    auto & gradients = workspace.gradients;
+    auto & negativeForces = workspace.negativeForces;
     const auto squaredGradientAccuracy = m_gradientAccuracy * m_gradientAccuracy;
 
     auto & rows = similarities.rows;
     auto & columns = similarities.columns;
     auto & values = similarities.values;
 
-    double sumQ = 0.0;
     // omp version on windows (2.0) does only support signed loop variables, should be unsigned
-    #pragma omp parallel for reduction(+:sumQ)
+    #pragma omp parallel for
     for(int n = 0; n < m_dataSize; ++n)
     {
+        // Loop over all edges in the graph
+        auto distances = std::array<double, D>();
         for(auto i = rows[n]; i < rows[n + 1]; ++i)
         {
             // Compute pairwise distance and Q-value
@@ -104,40 +143,50 @@ Vector2D<double> TSNE::computeGradient(SparseMatrix & similarities)
             // Sum positive force
             for(unsigned int d = 0; d < D; ++d)
             {
-                positiveForces[n][d] += force * distances[d];
+                gradients[n][d] += force * distances[d];
             }
         }
+    }
 
-        tree.computeNonEdgeForces(n, squaredGradientAccuracy, negativeForces[n], sumQ);
+    sumQ = 0.0;
+    if (interpolate)
+    {
+        interpolation.computeNonEdgeForces(m_result, negativeForces[0], sumQ);
     }
+    else if (m_gradientMethod == GradientMethod::DualTree)
+    {
+        tree.computeNonEdgeForcesDualTree(squaredGradientAccuracy, negativeForces[0], sumQ);
+    }
+    else
+    {
+        tree.computeNonEdgeForcesGrouped(squaredGradientAccuracy, negativeForces[0], sumQ);
+    }
+    m_forceTime += std::chrono::steady_clock::now() - built;
 
-    auto result = Vector2D<double>(m_dataSize, m_outputDimensions);
     // Compute final t-SNE gradient
-
-    auto r = result[0];
-    auto p = positiveForces[0];
+    auto r = gradients[0];
     auto n = negativeForces[0];
 
     for (unsigned int i = 0; i < m_dataSize * m_outputDimensions; ++i)
     {
-        r[i] = p[i] - n[i] / sumQ;
+        r[i] -= n[i] / sumQ;
     }
-    return result;
+    return gradients;
 }
 
 // Compute gradient of the t-SNE cost function (exact)
-Vector2D<double> TSNE::computeGradientExact(const Vector2D<double> & Perplexity)
+const Vector2D<double> & TSNE::computeGradientExact(const Vector2D<double> & Perplexity, GradientWorkspace & workspace)
 {
-    auto gradients = Vector2D<double>(m_dataSize, m_outputDimensions, 0.0);
+    workspace.prepareExact(m_dataSize, m_outputDimensions);
+    auto & gradients = workspace.gradients;
 
     // Compute the squared Euclidean distance matrix
-    auto distances = computeSquaredEuclideanDistance(m_result);
-    assert(distances.height() == m_dataSize);
-    assert(distances.width() == m_dataSize);
+    auto & distances = workspace.distances;
+    computeSquaredEuclideanDistance(m_result, distances);
 
     // Compute Q-matrix and normalization sum
     // Q = similarities of low dimensional output data
-    auto Q = Vector2D<double>(m_dataSize, m_dataSize);
+    auto & Q = workspace.Q;
     double sumQ = 0.0;
     for (unsigned int n = 0; n < m_dataSize; ++n)
     {
@@ -172,16 +221,20 @@ Vector2D<double> TSNE::computeGradientExact(const Vector2D<double> & Perplexity)
 }
 
 // Evaluate t-SNE cost function (exactly)
-double TSNE::evaluateErrorExact(const Vector2D<double> & Perplexity)
+double TSNE::evaluateErrorExact(const Vector2D<double> & Perplexity, GradientWorkspace & workspace)
 {
     assert(Perplexity.height() == m_dataSize);
     assert(Perplexity.width() == m_dataSize);
 
     // Compute the squared Euclidean distance matrix
-    auto Q = Vector2D<double>(m_dataSize, m_dataSize, std::numeric_limits<double>::min());
-    auto distances = computeSquaredEuclideanDistance(m_result);
-    assert(distances.height() == m_result.height());
-    assert(distances.width() == m_result.height());
+    workspace.prepareExact(m_dataSize, m_outputDimensions);
+    auto & Q = workspace.Q;
+    auto & distances = workspace.distances;
+    computeSquaredEuclideanDistance(m_result, distances);
+    for (unsigned int n = 0; n < m_dataSize; ++n)
+    {
+        Q[n][n] = std::numeric_limits<double>::min();
+    }
 
     // Compute Q-matrix and normalization sum
     //TODO init to 0 (or evaluate consequences)
@@ -217,31 +270,22 @@ double TSNE::evaluateErrorExact(const Vector2D<double> & Perplexity)
 	return error;
 }
 
-// Evaluate t-SNE cost function (approximately)
-template<unsigned int D>
-double TSNE::evaluateError(SparseMatrix & similarities)
+// Evaluate t-SNE cost function (approximately) using the normalization term of the gradient computation
+double TSNE::evaluateError(const SparseMatrix & similarities, double sumQ) const
 {
-    // Get estimate of normalization term
-    auto tree = SpacePartitioningTree<D>(m_result);
-    auto buff = std::vector<double>(m_outputDimensions, 0.0);
-    double sumQ = 0.0;
-    const auto squaredGradientAccuracy = m_gradientAccuracy * m_gradientAccuracy;
-    for (unsigned int i = 0; i < m_dataSize; ++i)
-    {
-        tree.computeNonEdgeForces(i, squaredGradientAccuracy, buff.data(), sumQ);
-    }
-
     // Loop over all edges to compute t-SNE error
     double error = 0.0;
-    for (unsigned int n = 0; n < m_dataSize; ++n)
+    // omp version on windows (2.0) does only support signed loop variables, should be unsigned
+    #pragma omp parallel for reduction(+:error)
+    for (int n = 0; n < static_cast<int>(m_dataSize); ++n)
     {
         for (unsigned int i = similarities.rows[n]; i < similarities.rows[n + 1]; ++i)
         {
             double Q = 0.0;
             for (unsigned int d = 0; d < m_outputDimensions; d++)
             {
-                buff[d] = m_result[n][d] - m_result[similarities.columns[i]][d];
-                Q += buff[d] * buff[d];
+                auto distance = m_result[n][d] - m_result[similarities.columns[i]][d];
+                Q += distance * distance;
             }
 
             Q = (1.0 / (1.0 + Q)) / sumQ;
@@ -386,6 +430,42 @@ void TSNE::setPerplexity(double perplexity)
     }
 }
 
+std::vector<double> TSNE::perplexities() const
+{
+    return m_perplexities;
+}
+
+void TSNE::setPerplexities(const std::vector<double> & perplexities)
+{
+    m_perplexities = perplexities;
+    for (auto & perplexity : m_perplexities)
+    {
+        if (perplexity < 2.0)
+        {
+            std::cerr << "perplexities have to be at least 2.0, setting perplexity to 2.0" << std::endl;
+            perplexity = 2.0;
+        }
+    }
+}
+
+std::vector<double> TSNE::pointPerplexities() const
+{
+    return m_pointPerplexities;
+}
+
+void TSNE::setPointPerplexities(const std::vector<double> & perplexities)
+{
+    m_pointPerplexities = perplexities;
+    for (auto & perplexity : m_pointPerplexities)
+    {
+        if (perplexity < 2.0)
+        {
+            std::cerr << "perplexities have to be at least 2.0, setting perplexity to 2.0" << std::endl;
+            perplexity = 2.0;
+        }
+    }
+}
+
 double TSNE::gradientAccuracy() const
 {
 	return m_gradientAccuracy;
@@ -396,6 +476,86 @@ void TSNE::setGradientAccuracy(double accuracy)
 	m_gradientAccuracy = accuracy;
 }
 
+GradientMethod TSNE::gradientMethod() const
+{
+    return m_gradientMethod;
+}
+
+void TSNE::setGradientMethod(GradientMethod method)
+{
+    m_gradientMethod = method;
+}
+
+NeighborMethod TSNE::neighborMethod() const
+{
+    return m_neighborMethod;
+}
+
+void TSNE::setNeighborMethod(NeighborMethod method)
+{
+    m_neighborMethod = method;
+}
+
+DistanceMetric TSNE::distanceMetric() const
+{
+    return m_distanceMetric;
+}
+
+void TSNE::setDistanceMetric(DistanceMetric metric)
+{
+    m_distanceMetric = metric;
+}
+
+unsigned int TSNE::randomProjectionTrees() const
+{
+    return m_randomProjectionTrees;
+}
+
+void TSNE::setRandomProjectionTrees(unsigned int trees)
+{
+    m_randomProjectionTrees = std::max(trees, 1u);
+}
+
+unsigned int TSNE::neighborSearchBudget() const
+{
+    return m_neighborSearchBudget;
+}
+
+void TSNE::setNeighborSearchBudget(unsigned int candidates)
+{
+    m_neighborSearchBudget = candidates;
+}
+
+double TSNE::neighborDescentThreshold() const
+{
+    return m_neighborDescentThreshold;
+}
+
+void TSNE::setNeighborDescentThreshold(double threshold)
+{
+    m_neighborDescentThreshold = threshold;
+}
+
+std::string TSNE::neighborIndexFile() const
+{
+    return m_neighborIndexFile;
+}
+
+void TSNE::setNeighborIndexFile(const std::string & file)
+{
+    m_neighborIndexFile = file;
+}
+
+std::string TSNE::similarityCacheFile() const
+{
+    return m_similarityCacheFile;
+}
+
+void TSNE::setSimilarityCacheFile(const std::string & file)
+{
+    m_similarityCacheFile = file;
+}
+
 unsigned int TSNE::iterations() const
 {
 	return m_iterations;
@@ -406,6 +566,16 @@ void TSNE::setIterations(unsigned int iterations)
 	m_iterations = iterations;
 }
 
+unsigned int TSNE::reorderInterval() const
+{
+	return m_reorderInterval;
+}
+
+void TSNE::setReorderInterval(unsigned int iterations)
+{
+	m_reorderInterval = iterations;
+}
+
 unsigned int TSNE::outputDimensions() const
 {
 	return m_outputDimensions;
@@ -562,6 +732,119 @@ bool TSNE::loadTSNE(const std::string & file)
 	return true;
 }
 
+bool TSNE::loadNeighbors(const std::string & file)
+{
+    std::ifstream f(file, std::ios::binary);
+    if (!f.is_open())
+    {
+        std::cerr << "Could not open " << file << std::endl;
+        return false;
+    }
+
+    auto size = 0u;
+    auto neighbors = 0u;
+    f.read(reinterpret_cast<char *>(&size), sizeof(size));
+    f.read(reinterpret_cast<char *>(&neighbors), sizeof(neighbors));
+    if (!f || size == 0 || neighbors == 0)
+    {
+        std::cerr << "Could not read neighbors from " << file << std::endl;
+        return false;
+    }
+
+    //read neighbors
+    auto indices = Vector2D<unsigned int>(size, neighbors);
+    auto distances = Vector2D<double>(size, neighbors);
+    f.read(reinterpret_cast<char *>(indices[0]), indices.size() * sizeof(unsigned int));
+    f.read(reinterpret_cast<char *>(distances[0]), distances.size() * sizeof(double));
+    if (!f)
+    {
+        std::cerr << "Could not read neighbors from " << file << std::endl;
+        return false;
+    }
+
+    return setNeighbors(std::move(indices), std::move(distances));
+}
+
+bool TSNE::loadSimilarities(const std::string & file)
+{
+    std::ifstream f(file, std::ios::binary);
+    if (!f.is_open())
+    {
+        std::cerr << "Could not open " << file << std::endl;
+        return false;
+    }
+
+    auto size = 0u;
+    auto entries = 0u;
+    f.read(reinterpret_cast<char *>(&size), sizeof(size));
+    f.read(reinterpret_cast<char *>(&entries), sizeof(entries));
+    if (!f || size == 0)
+    {
+        std::cerr << "Could not read similarities from " << file << std::endl;
+        return false;
+    }
+
+    //read matrix
+    auto similarities = SparseMatrix();
+    similarities.rows.resize(size + 1);
+    similarities.columns.resize(entries);
+    similarities.values.resize(entries);
+    f.read(reinterpret_cast<char *>(similarities.rows.data()), similarities.rows.size() * sizeof(unsigned int));
+    f.read(reinterpret_cast<char *>(similarities.columns.data()), entries * sizeof(unsigned int));
+    f.read(reinterpret_cast<char *>(similarities.values.data()), entries * sizeof(double));
+    if (!f)
+    {
+        std::cerr << "Could not read similarities from " << file << std::endl;
+        return false;
+    }
+
+    return setSimilarities(std::move(similarities));
+}
+
+bool TSNE::setNeighbors(Vector2D<unsigned int> && indices, Vector2D<double> && distances)
+{
+    if (indices.size() == 0 || indices.size() != distances.size() || indices.width() != distances.width())
+    {
+        std::cerr << "neighbor indices and distances have to be of the same non-zero size" << std::endl;
+        return false;
+    }
+
+    const auto size = static_cast<unsigned int>(indices.height());
+    if (std::any_of(indices.begin(), indices.end(), [size](unsigned int index) { return index >= size; }))
+    {
+        std::cerr << "neighbor indices have to be smaller than the number of points (" << size << ")" << std::endl;
+        return false;
+    }
+
+    m_neighborIndices = std::move(indices);
+    m_neighborDistances = std::move(distances);
+    m_dataSize = size;
+    return true;
+}
+
+bool TSNE::setSimilarities(SparseMatrix && similarities)
+{
+    const auto & rows = similarities.rows;
+    const auto & columns = similarities.columns;
+    if (rows.size() < 2 || rows.front() != 0 || rows.back() != columns.size()
+        || columns.size() != similarities.values.size() || !std::is_sorted(rows.begin(), rows.end()))
+    {
+        std::cerr << "similarities have to be a sparse matrix with consistent rows" << std::endl;
+        return false;
+    }
+
+    const auto size = static_cast<unsigned int>(rows.size() - 1);
+    if (std::any_of(columns.begin(), columns.end(), [size](unsigned int column) { return column >= size; }))
+    {
+        std::cerr << "similarity columns have to be smaller than the number of points (" << size << ")" << std::endl;
+        return false;
+    }
+
+    m_inputSimilarities = std::move(similarities);
+    m_dataSize = size;
+    return true;
+}
+
 bool TSNE::loadCin()
 {
     return loadFromStream(std::cin);
@@ -571,9 +854,52 @@ bool TSNE::loadCin()
 //run method---------------------------------------------------------------------------------------
 void TSNE::run()
 {
-    if (m_dataSize - 1 < 3 * m_perplexity)
+    const auto precomputedSimilarities = !m_inputSimilarities.rows.empty();
+    const auto precomputedNeighbors = m_neighborIndices.size() > 0;
+    if ((precomputedSimilarities || precomputedNeighbors) && m_data.size() > 0 && m_data.height() != m_dataSize)
+    {
+        auto message = "precomputed input has " + std::to_string(m_dataSize) + " points, but the data has "
+            + std::to_string(m_data.height());
+        std::cerr << message << std::endl;
+        throw std::invalid_argument(message);
+    }
+    if ((precomputedSimilarities || precomputedNeighbors) && m_gradientAccuracy == 0.0)
+    {
+        auto message = std::string("exact t-SNE (gradient accuracy 0) needs the data instead of precomputed input");
+        std::cerr << message << std::endl;
+        throw std::invalid_argument(message);
+    }
+    if (!m_perplexities.empty() && !m_pointPerplexities.empty())
+    {
+        auto message = std::string("multi-scale perplexities and perplexities of the points can't be combined");
+        std::cerr << message << std::endl;
+        throw std::invalid_argument(message);
+    }
+    if ((!m_perplexities.empty() || !m_pointPerplexities.empty()) && m_gradientAccuracy == 0.0)
     {
-        auto message = "perplexity (perplexity=" + std::to_string(m_perplexity) +
+        auto message = std::string("exact t-SNE (gradient accuracy 0) needs a single perplexity");
+        std::cerr << message << std::endl;
+        throw std::invalid_argument(message);
+    }
+    if (!precomputedSimilarities && !m_pointPerplexities.empty() && m_pointPerplexities.size() != m_dataSize)
+    {
+        auto message = "there are " + std::to_string(m_pointPerplexities.size()) + " perplexities of the points, but "
+            + std::to_string(m_dataSize) + " points";
+        std::cerr << message << std::endl;
+        throw std::invalid_argument(message);
+    }
+    const auto perplexity = maximumPerplexity();
+    if (!precomputedSimilarities && precomputedNeighbors && m_neighborIndices.width() <= perplexity)
+    {
+        auto message = "perplexity (perplexity=" + std::to_string(perplexity) +
+            ") has to be smaller than the number of precomputed neighbors (neighbors="
+            + std::to_string(m_neighborIndices.width()) + ")";
+        std::cerr << message << std::endl;
+        throw std::invalid_argument(message);
+    }
+    if (!precomputedSimilarities && !precomputedNeighbors && m_dataSize - 1 < 3 * perplexity)
+    {
+        auto message = "perplexity (perplexity=" + std::to_string(perplexity) +
             ") has to be smaller than a third of the dataSize (dataSize=" + std::to_string(m_dataSize) + ")";
         std::cerr << message << std::endl;
         throw std::invalid_argument(message);
@@ -583,8 +909,20 @@ void TSNE::run()
         << "\ndata size " << m_dataSize
         << "\nin dimensions " << m_inputDimensions
         << "\nout dimensions " << m_outputDimensions
-        << "\nperplexity " << m_perplexity
-        << "\ngradient accuracy " << m_gradientAccuracy
+        << "\nperplexity " << m_perplexity;
+    if (!m_perplexities.empty())
+    {
+        std::cout << "\nmulti-scale perplexities";
+        for (const auto each : m_perplexities)
+        {
+            std::cout << " " << each;
+        }
+    }
+    if (!m_pointPerplexities.empty())
+    {
+        std::cout << "\nperplexities of the points up to " << perplexity;
+    }
+    std::cout << "\ngradient accuracy " << m_gradientAccuracy
         << std::endl;
 
     std::cout << "Using random seed: " << m_seed << std::endl;
@@ -604,19 +942,49 @@ void TSNE::run()
 
 void TSNE::runApproximation()
 {
-	// Normalize input data to prevent numerical problems
-	std::cout << "Computing input similarities..." << std::endl;
-    zeroMean(m_data);
-    normalize(m_data);
-
     // Compute input similarities for exact t-SNE
     auto inputSimilarities = SparseMatrix();
 
-	// Compute asymmetric pairwise input similarities
-	computeGaussianPerplexity(inputSimilarities);
+    if (!m_inputSimilarities.rows.empty())
+    {
+        // Precomputed similarities are symmetric already, they are kept for later runs
+        std::cout << "Using precomputed input similarities..." << std::endl;
+        inputSimilarities = m_inputSimilarities;
+    }
+    else
+    {
+        std::cout << "Computing input similarities..." << std::endl;
+        if (m_neighborIndices.size() > 0)
+        {
+            // Compute asymmetric pairwise input similarities of the precomputed neighbors
+            computeGaussianPerplexityFromNeighbors(inputSimilarities);
+            symmetrizeMatrix(inputSimilarities);
+        }
+        else
+        {
+            // The cache is keyed by the data as it is loaded, before it is normalized
+            const auto cacheKey = m_similarityCacheFile.empty() ? 0 : similarityCacheKey();
+            if (!m_similarityCacheFile.empty() && loadSimilarityCache(inputSimilarities, cacheKey))
+            {
+                std::cout << "loaded input similarities from " << m_similarityCacheFile << std::endl;
+            }
+            else
+            {
+                // Normalize input data to prevent numerical problems
+                normalizeInput();
+
+                // Compute asymmetric pairwise input similarities
+                computeGaussianPerplexity(inputSimilarities);
 
-	// Symmetrize input similarities
-	symmetrizeMatrix(inputSimilarities);
+                // Symmetrize input similarities
+                symmetrizeMatrix(inputSimilarities);
+                if (!m_similarityCacheFile.empty())
+                {
+                    saveSimilarityCache(inputSimilarities, cacheKey);
+                }
+            }
+        }
+    }
 
 	//normalize inputSimilarities so that sum of all values = 1
 	double sum_P = std::accumulate(inputSimilarities.values.begin(), inputSimilarities.values.end(), 0.0);
@@ -633,6 +1001,35 @@ void TSNE::runApproximation()
         each = gaussNumber() * 0.0001;
     }
 
+    switch (m_outputDimensions)
+    {
+    case 1:
+        // the trees do not support a single dimension, but the interpolation does
+        if (m_gradientMethod == GradientMethod::Interpolation)
+        {
+            learnEmbedding<1>(inputSimilarities);
+        }
+        else
+        {
+            learnEmbedding<0>(inputSimilarities);
+        }
+        break;
+    case 2:
+        learnEmbedding<2>(inputSimilarities);
+        break;
+    case 3:
+        learnEmbedding<3>(inputSimilarities);
+        break;
+    default:
+        learnEmbedding<0>(inputSimilarities); // assert(false)
+        break;
+    }
+}
+
+
+template<unsigned int D>
+void TSNE::learnEmbedding(SparseMatrix & inputSimilarities)
+{
     //TODO: documentation for all these magic numbers
     unsigned int stop_lying_iteration = 251;
     unsigned int momentum_switch_iteration = 251;
@@ -645,16 +1042,57 @@ void TSNE::runApproximation()
     auto uY = Vector2D<double>(m_dataSize, m_outputDimensions);
     auto gains = Vector2D<double>(m_dataSize, m_outputDimensions, 1.0);
 
+    // The tree (or the interpolation grid) and the gradient are computed into the same memory in every iteration
+    auto tree = SpacePartitioningTree<D>();
+    auto interpolation = FFTInterpolation<D>();
+    auto workspace = GradientWorkspace();
+
     // Perform main training loop
     std::cout << " Input similarities computed. Learning embedding..." << std::endl;
+    m_treeBuildTime = m_forceTime = std::chrono::duration<double>::zero();
+    auto reportedIteration = 0u;
+
+    // Input position of every point, if the points are reordered internally
+    auto order = std::vector<unsigned int>();
 
     for (unsigned int iteration = 1; iteration <= m_iterations; ++iteration)
     {
+        // Reorder the points along the Z-order curve of the embedding, so that points processed one after another
+        // (and their neighbors in the similarities) are close in memory
+        if (D > 0 && m_reorderInterval > 0 && (iteration - 1) % m_reorderInterval == 0)
+        {
+            tree.rebuildBulk(m_result);
+            const auto & permutation = tree.mortonOrder();
+            permuteRows(m_result, permutation);
+            permuteRows(uY, permutation);
+            permuteRows(gains, permutation);
+            permuteSimilarities(inputSimilarities, permutation);
+
+            auto newOrder = std::vector<unsigned int>(m_dataSize);
+            for (unsigned int i = 0; i < m_dataSize; ++i)
+            {
+                newOrder[i] = order.empty() ? permutation[i] : order[permutation[i]];
+            }
+            order = std::move(newOrder);
+        }
+
 		// Compute approximate gradient
-        auto gradients =
-            (m_outputDimensions == 2) ? computeGradient<2>(inputSimilarities) :
-            (m_outputDimensions == 3) ? computeGradient<3>(inputSimilarities) :
-            computeGradient<0>(inputSimilarities);
+        double sumQ = 0.0;
+        const auto & gradients = computeGradient<D>(inputSimilarities, tree, interpolation, workspace, sumQ);
+
+		// Print out progress; the error of the current embedding uses the normalization term of its gradient
+        if (iteration % 50 == 0 || iteration == m_iterations)
+        {
+			double error = evaluateError(inputSimilarities, sumQ);
+			std::cout << "Iteration " << iteration << ": error is " << error;
+
+            // Report the gradient timings per iteration since the last report
+            auto iterations = static_cast<double>(iteration - reportedIteration);
+            std::cout << " (tree build " << 1000.0 * m_treeBuildTime.count() / iterations << " ms, forces "
+                      << 1000.0 * m_forceTime.count() / iterations << " ms per iteration)" << std::endl;
+            m_treeBuildTime = m_forceTime = std::chrono::duration<double>::zero();
+            reportedIteration = iteration;
+        }
 
         // Update gains
         for (unsigned int i = 0; i < m_dataSize; ++i)
@@ -672,7 +1110,7 @@ void TSNE::runApproximation()
                 }
                 gains[i][j] = std::max(0.1, gains[i][j]);
 
-                // Perform gradient update (with momentum and gains)std::array<double, D>{}
+                // Perform gradient update (with momentum and gains)
 
                 uYij = momentum * uYij - eta * gains[i][j] * gradients[i][j];
                 m_result[i][j] += uYij;
@@ -695,18 +1133,18 @@ void TSNE::runApproximation()
         {
             momentum = final_momentum;
         }
+	}
 
-		// Print out progress
-        if (iteration % 50 == 0 || iteration == m_iterations)
+    // Restore the input order of the points
+    if (!order.empty())
+    {
+        auto inverse = std::vector<unsigned int>(m_dataSize);
+        for (unsigned int i = 0; i < m_dataSize; ++i)
         {
-			// doing approximate computation here!
-			double error =
-                (m_outputDimensions == 2) ? evaluateError<2>(inputSimilarities) :
-                (m_outputDimensions == 3) ? evaluateError<3>(inputSimilarities) :
-                evaluateError<0>(inputSimilarities); // assert(false)
-			std::cout << "Iteration " << iteration << ": error is " << error << std::endl;
+            inverse[order[i]] = i;
         }
-	}
+        permuteRows(m_result, inverse);
+    }
 }
 
 
@@ -722,8 +1160,7 @@ void TSNE::runExact()
 
     // Normalize input data (to prevent numerical problems)
     std::cout << "Computing input similarities..." << std::endl;
-    zeroMean(m_data);
-    normalize(m_data);
+    normalizeInput();
 
     // Compute input similarities for exact t-SNE
     auto P = computeGaussianPerplexityExact();
@@ -764,11 +1201,12 @@ void TSNE::runExact()
 
     auto uY    = Vector2D<double>(m_dataSize, m_outputDimensions, 0.0);
     auto gains = Vector2D<double>(m_dataSize, m_outputDimensions, 1.0);
+    auto workspace = GradientWorkspace();
 
     for (unsigned int iteration = 1; iteration <= m_iterations; ++iteration)
     {
         // Compute exact gradient
-        auto gradients = computeGradientExact(P);
+        const auto & gradients = computeGradientExact(P, workspace);
         assert(gradients.height() == m_dataSize);
         assert(gradients.width() == m_outputDimensions);
 
@@ -823,7 +1261,7 @@ void TSNE::runExact()
         // Print out progress
         if (iteration % 50 == 0 || iteration == m_iterations)
         {
-            double C = evaluateErrorExact(P);
+            double C = evaluateErrorExact(P, workspace);
             std::cout << "Iteration " << (iteration + 1) << ": error is " << C << std::endl;
         }
     }
@@ -966,6 +1404,46 @@ void TSNE::saveSVG()
 	f << "</svg>\n";
 }
 
+// Reorder the rows, so that row i holds the previous row permutation[i]
+void TSNE::permuteRows(Vector2D<double> & matrix, const std::vector<unsigned int> & permutation)
+{
+    const auto width = matrix.width();
+    auto permuted = Vector2D<double>(matrix.height(), width);
+    for (unsigned int i = 0; i < matrix.height(); ++i)
+    {
+        std::copy(matrix[permutation[i]], matrix[permutation[i]] + width, permuted[i]);
+    }
+    matrix = std::move(permuted);
+}
+
+// Reorder the rows and columns of the similarities like the rows of the points in permuteRows
+void TSNE::permuteSimilarities(SparseMatrix & similarities, const std::vector<unsigned int> & permutation)
+{
+    const auto size = static_cast<unsigned int>(permutation.size());
+    auto inverse = std::vector<unsigned int>(size);
+    for (unsigned int i = 0; i < size; ++i)
+    {
+        inverse[permutation[i]] = i;
+    }
+
+    auto permuted = SparseMatrix();
+    permuted.rows.reserve(size + 1);
+    permuted.columns.reserve(similarities.columns.size());
+    permuted.values.reserve(similarities.values.size());
+    permuted.rows.push_back(0);
+    for (unsigned int i = 0; i < size; ++i)
+    {
+        const auto row = permutation[i];
+        for (auto k = similarities.rows[row]; k < similarities.rows[row + 1]; ++k)
+        {
+            permuted.columns.push_back(inverse[similarities.columns[k]]);
+            permuted.values.push_back(similarities.values[k]);
+        }
+        permuted.rows.push_back(static_cast<unsigned int>(permuted.columns.size()));
+    }
+    similarities = std::move(permuted);
+}
+
 //make the mean of all data points equal 0 for each dimension -> zero mean
 void TSNE::zeroMean(Vector2D<double> & points)
 {
@@ -999,8 +1477,8 @@ void TSNE::normalize(Vector2D<double> & vec)
 
 Vector2D<double> TSNE::computeGaussianPerplexityExact()
 {
-	// Compute the squared Euclidean distance matrix
-	auto distances = computeSquaredEuclideanDistance(m_data);
+	// Compute the distance matrix of the input
+	auto distances = computeInputDistances();
     auto P = Vector2D<double>(m_dataSize, m_dataSize);
 
 	// Compute the Gaussian kernel row by row
@@ -1081,15 +1559,99 @@ Vector2D<double> TSNE::computeGaussianPerplexityExact()
     return P;
 }
 
+// The neighbor method in use, Automatic resolved for the size and dimensions of the input
+NeighborMethod TSNE::resolveNeighborMethod() const
+{
+    if (m_neighborMethod != NeighborMethod::Automatic)
+    {
+        return m_neighborMethod;
+    }
+
+    // Brute force computes all pairs of distances in tiles, which beats the tree on inputs with many dimensions
+    // (where the tree visits most points anyway) unless there are too many points for quadratic time
+    if (m_inputDimensions >= 32 && m_dataSize <= 50000)
+    {
+        return NeighborMethod::BruteForce;
+    }
+    return NeighborMethod::VantagePointTree;
+}
+
+std::unique_ptr<NeighborSearch> TSNE::createNeighborSearch(unsigned int neighbors) const
+{
+    const auto distance = Distance(m_distanceMetric);
+
+    switch (resolveNeighborMethod())
+    {
+    case NeighborMethod::BruteForce:
+        return std::make_unique<BruteForceSearch>(neighbors, distance);
+    case NeighborMethod::NearestNeighborDescent:
+        return std::make_unique<NearestNeighborDescent>(randomSeed(), neighbors, m_neighborDescentThreshold,
+                                                        distance);
+    case NeighborMethod::HierarchicalNavigableSmallWorld:
+        return std::make_unique<HierarchicalNavigableSmallWorld>(randomSeed(), m_neighborSearchBudget, distance);
+    case NeighborMethod::RandomProjectionForest:
+        return std::make_unique<RandomProjectionForest>(randomSeed(), m_randomProjectionTrees,
+                                                        m_neighborSearchBudget, distance);
+    default:
+        return std::make_unique<VantagePointTree>(randomSeed(), distance);
+    }
+}
+
+// Compute the matrix of the distances between the input points according to the distance metric
+Vector2D<double> TSNE::computeInputDistances() const
+{
+    if (m_distanceMetric == DistanceMetric::Euclidean)
+    {
+        return computeSquaredEuclideanDistance(m_data);
+    }
+
+    const auto distance = Distance(m_distanceMetric);
+    const auto packedData = m_distanceMetric == DistanceMetric::Hamming ? Distance::packBits(m_data)
+                                                                        : Vector2D<double>();
+    const auto & data = m_distanceMetric == DistanceMetric::Hamming ? packedData : m_data;
+    const auto dimensions = static_cast<unsigned int>(data.width());
+
+    auto distances = Vector2D<double>(m_dataSize, m_dataSize, 0.0);
+    for (unsigned int i = 0; i < m_dataSize; ++i)
+    {
+        for (unsigned int j = i + 1; j < m_dataSize; ++j)
+        {
+            distances[i][j] = distance(data[i], data[j], dimensions);
+            distances[j][i] = distances[i][j];
+        }
+    }
+    return distances;
+}
+
+// Zero-center and scale the input for the metrics that are based on differences of the values, the others would
+// change (binary inputs and directions) or are invariant to it
+void TSNE::normalizeInput()
+{
+    if (m_distanceMetric == DistanceMetric::Euclidean || m_distanceMetric == DistanceMetric::Manhattan)
+    {
+        zeroMean(m_data);
+        normalize(m_data);
+    }
+}
+
 Vector2D<double> TSNE::computeSquaredEuclideanDistance(const Vector2D<double> & points)
+{
+    auto distances = Vector2D<double>(points.height(), points.height(), 0.0);
+    computeSquaredEuclideanDistance(points, distances);
+    return distances;
+}
+
+// Compute the squared Euclidean distance matrix into distances, which must have a row and column per point
+void TSNE::computeSquaredEuclideanDistance(const Vector2D<double> & points, Vector2D<double> & distances)
 {
     auto dimensions = points.width();
     auto number = points.height();
-
-    auto distances = Vector2D<double>(number, number, 0.0);
+    assert(distances.height() == number);
+    assert(distances.width() == number);
 
     for (unsigned int i = 0; i < number; ++i)
     {
+        distances[i][i] = 0.0;
         for (unsigned int j = i + 1; j < number; ++j)
         {
             double distance = 0.0;
@@ -1103,8 +1665,6 @@ Vector2D<double> TSNE::computeSquaredEuclideanDistance(const Vector2D<double> &
             distances[j][i] = distance;
         }
     }
-
-    return distances;
 }
 
 void TSNE::computeGaussianPerplexity(SparseMatrix & similarities) const
@@ -1112,116 +1672,475 @@ void TSNE::computeGaussianPerplexity(SparseMatrix & similarities) const
     assert(m_data.height() == m_dataSize);
     assert(m_data.width() == m_inputDimensions);
 
-	auto K = static_cast<unsigned int>(3 * m_perplexity);
+	// The neighbors are searched once for the largest perplexity of all scales and points
+	auto K = static_cast<unsigned int>(3 * maximumPerplexity());
 
 	// Allocate the memory we need
     similarities.rows.resize(m_dataSize + 1);
-    similarities.columns.resize(m_dataSize * K);
-    similarities.values.resize(m_dataSize * K, 0.0);
-
     similarities.rows[0] = 0;
 	for (unsigned int n = 0; n < m_dataSize; ++n)
     {
-        similarities.rows[n + 1] = similarities.rows[n] + K;
+        similarities.rows[n + 1] = similarities.rows[n] + neighborCount(n, K);
     }
-
-	// Build ball tree on data set
-	auto vantagePointTree = VantagePointTree(randomSeed());
-	auto obj_X = std::vector<DataPoint>(m_dataSize, DataPoint(m_inputDimensions, 0, m_data[0]));
-	for (unsigned int n = 0; n < m_dataSize; ++n)
+    similarities.columns.resize(similarities.rows[m_dataSize]);
+    similarities.values.resize(similarities.rows[m_dataSize], 0.0);
+
+    // Hamming distances compare the input as bits
+    const auto packedData = m_distanceMetric == DistanceMetric::Hamming ? Distance::packBits(m_data)
+                                                                        : Vector2D<double>();
+    const auto & data = m_distanceMetric == DistanceMetric::Hamming ? packedData : m_data;
+
+	// Build the neighbor search index on data set, or load it from the index file
+    const auto start = std::chrono::steady_clock::now();
+	auto neighborSearch = createNeighborSearch(K);
+    auto indexLoaded = false;
+    if (!m_neighborIndexFile.empty())
     {
-        obj_X[n].index = n;
-        obj_X[n].data.assign(m_data[n], m_data[n] + m_inputDimensions);
+        std::ifstream indexInput(m_neighborIndexFile, std::ios::binary);
+        indexLoaded = indexInput && neighborSearch->load(indexInput, data);
     }
-    vantagePointTree.create(obj_X);
-
-	// Loop over all points to find nearest neighbors
-	std::cout << "building vantage point tree..." << std::endl;
-	auto indices = std::vector<DataPoint>();
-	auto distances = std::vector<double>();
-    auto cur_P = std::vector<double>(m_dataSize - 1);
-	for (unsigned int n = 0; n < m_dataSize; ++n)
+    if (indexLoaded)
     {
-		if (n % 10000 == 0)
+        std::cout << "loaded neighbor search index from " << m_neighborIndexFile << std::endl;
+    }
+    else
+    {
+        std::cout << "building neighbor search index..." << std::endl;
+        neighborSearch->create(data);
+        if (!m_neighborIndexFile.empty())
         {
-            std::cout << " - point " << n << " of " << m_dataSize << std::endl;
+            std::ofstream indexOutput(m_neighborIndexFile, std::ios::binary | std::ios::trunc);
+            if (!indexOutput || !neighborSearch->save(indexOutput))
+            {
+                std::cerr << "can't save neighbor search index to " << m_neighborIndexFile << std::endl;
+            }
         }
+    }
 
-		// Find nearest neighbors
-		vantagePointTree.search(obj_X[n], K + 1, indices, distances);
-
-		// Initialize some variables for binary search
-		double beta = 1.0;
-		double min_beta = std::numeric_limits<double>::lowest();
-		double max_beta = std::numeric_limits<double>::max();
-		double tolerance_threshold = 1e-5;
+	// Find the nearest neighbors of all points in parallel, their squared distances are stored in the values until
+	// they are replaced by the similarities
+    auto found = std::vector<unsigned int>(m_dataSize);
+    #pragma omp parallel
+    {
+        auto indices = std::vector<unsigned int>(K + 1);
+        auto distances = std::vector<double>(K + 1);
 
-		// Iterate until we found a good perplexity
-		double sum_P = 0.0;
-		for (unsigned int iteration = 0; iteration < 200u; iteration++)
+        // omp version on windows (2.0) does only support signed loop variables, should be unsigned
+        #pragma omp for schedule(dynamic, 64)
+        for (int n = 0; n < static_cast<int>(m_dataSize); ++n)
         {
-			// Compute Gaussian kernel row
-			for (unsigned int m = 0; m < K; ++m)
+            if (n % 10000 == 0)
             {
-                // distances are expected to be squared
-                cur_P[m] = exp(-beta * distances[m + 1]);
+                #pragma omp critical
+                std::cout << " - point " << n << " of " << m_dataSize << std::endl;
             }
 
-			// Compute entropy of current row
-			sum_P = std::numeric_limits<double>::min();
-			for (unsigned int m = 0; m < K; ++m)
+            // Find nearest neighbors, the first of them is the point itself
+            const auto count = similarities.rows[n + 1] - similarities.rows[n];
+            const auto results = neighborSearch->searchIndexed(n, count + 1, indices.data(), distances.data());
+            found[n] = std::min(count, results > 0 ? results - 1 : 0u);
+            for (unsigned int m = 0; m < found[n]; ++m)
             {
-                sum_P += cur_P[m];
+                similarities.columns[similarities.rows[n] + m] = indices[m + 1];
+                similarities.values[similarities.rows[n] + m] = distances[m + 1];
             }
+        }
+    }
+
+    // Approximate searches may find fewer neighbors than requested, their rows are shortened
+    auto offset = 0u;
+    for (unsigned int n = 0; n < m_dataSize; ++n)
+    {
+        const auto begin = similarities.rows[n];
+        similarities.rows[n] = offset;
+        if (begin != offset)
+        {
+            std::copy(similarities.columns.begin() + begin, similarities.columns.begin() + begin + found[n],
+                      similarities.columns.begin() + offset);
+            std::copy(similarities.values.begin() + begin, similarities.values.begin() + begin + found[n],
+                      similarities.values.begin() + offset);
+        }
+        offset += found[n];
+    }
+    similarities.rows[m_dataSize] = offset;
+    similarities.columns.resize(offset);
+    similarities.values.resize(offset);
+
+    const auto searched = std::chrono::steady_clock::now();
+    calibrateSimilarities(similarities);
+    std::cout << " Neighbors found in " << std::chrono::duration<double>(searched - start).count()
+        << " s, perplexities calibrated in "
+        << std::chrono::duration<double>(std::chrono::steady_clock::now() - searched).count() << " s" << std::endl;
+}
+
+void TSNE::computeGaussianPerplexityFromNeighbors(SparseMatrix & similarities) const
+{
+    assert(m_neighborIndices.height() == m_dataSize);
+
+    // Use up to 3 * perplexity of the precomputed neighbors of every point, so the rows may differ in length
+    const auto K = std::min(static_cast<unsigned int>(3 * maximumPerplexity()),
+                            static_cast<unsigned int>(m_neighborIndices.width()));
+    const auto squared = m_distanceMetric == DistanceMetric::Euclidean;
 
-			double H = 0.0;
-			for (unsigned int m = 0; m < K; ++m)
+    auto rowNeighbors = std::vector<std::vector<std::pair<double, unsigned int>>>(m_dataSize);
+    similarities.rows.resize(m_dataSize + 1);
+    similarities.rows[0] = 0;
+    for (unsigned int n = 0; n < m_dataSize; ++n)
+    {
+        // Ignore the point itself and keep the nearest of the others
+        auto & neighbors = rowNeighbors[n];
+        for (unsigned int m = 0; m < m_neighborIndices.width(); ++m)
+        {
+            if (m_neighborIndices[n][m] != n)
             {
-                // distances are expected to be squared
-                H += beta * (distances[m + 1] * cur_P[m]);
+                const auto distance = m_neighborDistances[n][m];
+                neighbors.emplace_back(squared ? distance * distance : distance, m_neighborIndices[n][m]);
             }
-			H = (H / sum_P) + log(sum_P);
+        }
+        const auto count = std::min(neighborCount(n, K), static_cast<unsigned int>(neighbors.size()));
+        std::partial_sort(neighbors.begin(), neighbors.begin() + count, neighbors.end());
+        neighbors.resize(count);
+        similarities.rows[n + 1] = similarities.rows[n] + count;
+    }
+    similarities.columns.resize(similarities.rows[m_dataSize]);
+    similarities.values.resize(similarities.rows[m_dataSize]);
+    for (unsigned int n = 0; n < m_dataSize; ++n)
+    {
+        for (unsigned int m = 0; m < rowNeighbors[n].size(); ++m)
+        {
+            similarities.columns[similarities.rows[n] + m] = rowNeighbors[n][m].second;
+            similarities.values[similarities.rows[n] + m] = rowNeighbors[n][m].first;
+        }
+    }
 
-			// Evaluate whether the entropy is within the tolerance level
-			double Hdiff = H - log(m_perplexity);
-			if (std::abs(Hdiff) < tolerance_threshold)
+    const auto start = std::chrono::steady_clock::now();
+    calibrateSimilarities(similarities);
+    std::cout << " Perplexities calibrated in "
+        << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+}
+
+// Replaces the distances in every row of the matrix by their similarities, the rows are computed in parallel;
+// multi-scale similarities are the mean of the similarities at all perplexities
+void TSNE::calibrateSimilarities(SparseMatrix & similarities) const
+{
+    #pragma omp parallel
+    {
+        auto distances = std::vector<double>();
+        auto scaleSimilarities = std::vector<double>();
+
+        // omp version on windows (2.0) does only support signed loop variables, should be unsigned
+        #pragma omp for schedule(dynamic, 64)
+        for (int n = 0; n < static_cast<int>(m_dataSize); ++n)
+        {
+            const auto row = similarities.values.data() + similarities.rows[n];
+            const auto count = similarities.rows[n + 1] - similarities.rows[n];
+            distances.assign(row, row + count);
+            if (m_perplexities.empty())
             {
-				break;
-			}
-            if (Hdiff > 0)
+                const auto perplexity = m_pointPerplexities.empty() ? m_perplexity : m_pointPerplexities[n];
+                computeConditionalSimilarities(distances.data(), count, perplexity, row);
+                continue;
+            }
+
+            std::fill(row, row + count, 0.0);
+            scaleSimilarities.resize(count);
+            for (const auto perplexity : m_perplexities)
             {
-                min_beta = beta;
-                if (max_beta == std::numeric_limits<double>::max()
-                    || max_beta == std::numeric_limits<double>::lowest())
+                computeConditionalSimilarities(distances.data(), count, perplexity, scaleSimilarities.data());
+                for (unsigned int m = 0; m < count; ++m)
                 {
-                    beta *= 2.0;
-                }
-                else
-                {
-                    beta = (beta + max_beta) / 2.0;
+                    row[m] += scaleSimilarities[m] / m_perplexities.size();
                 }
             }
-            else
+        }
+    }
+}
+
+// Finds the bandwidth of the Gaussian kernel for the distances to the neighbors of a point, so that the
+// similarities have the perplexity, and returns the row-normalized similarities. The result is the one of a
+// binary search from beta = 1, but the search is replayed on the bounds found by safeguarded Newton steps and
+// only evaluates the kernel where these bounds cannot tell the direction
+void TSNE::computeConditionalSimilarities(const double * distances, unsigned int neighbors, double perplexity,
+                                          double * similarities) const
+{
+    // A precomputed point may have no neighbors but itself
+    if (neighbors == 0)
+    {
+        return;
+    }
+
+    const auto gaussianKernel = kernels().similarities.gaussianKernel;
+    const auto targetEntropy = log(perplexity);
+    const auto tolerance = 1e-5;
+
+    // The entropy decreases with beta; the largest beta known to be below and the smallest beta known to be above
+    // the tolerance window decide the direction of the binary search without the kernel
+    auto belowWindow = 0.0;
+    auto aboveWindow = std::numeric_limits<double>::infinity();
+
+    // Compute Gaussian kernel row, its entropy and the variance of the distances in one pass; Euclidean distances
+    // are squared, the other metrics are used as they are
+    auto sum = 0.0;
+    auto variance = 0.0;
+    const auto evaluate = [&](double beta)
+    {
+        sum = std::numeric_limits<double>::min();
+        auto weightedSum = 0.0;
+        auto squaredWeightedSum = 0.0;
+        gaussianKernel(distances, neighbors, beta, similarities, sum, weightedSum, squaredWeightedSum);
+        const auto mean = weightedSum / sum;
+        variance = squaredWeightedSum / sum - mean * mean;
+        const auto entropyDifference = beta * weightedSum / sum + log(sum) - targetEntropy;
+        if (entropyDifference >= tolerance)
+        {
+            belowWindow = std::max(belowWindow, beta);
+        }
+        else if (entropyDifference <= -tolerance)
+        {
+            aboveWindow = std::min(aboveWindow, beta);
+        }
+        return entropyDifference;
+    };
+
+    // Start from the scale of the distances, which puts the weight of about perplexity of the neighbors within
+    // the mean distance; the search then does not depend on the units of precomputed distances
+    auto minDistance = std::numeric_limits<double>::max();
+    auto meanDistance = 0.0;
+    for (unsigned int m = 0; m < neighbors; ++m)
+    {
+        minDistance = std::min(minDistance, distances[m]);
+        meanDistance += distances[m];
+    }
+    meanDistance /= neighbors;
+    auto beta = 1.0;
+    if (meanDistance > minDistance)
+    {
+        beta = log(std::max(2.0, neighbors / perplexity)) / (meanDistance - minDistance);
+    }
+
+    // Newton steps with the derivative of the entropy -beta * variance into the tolerance window, bisection if
+    // they leave the bracket
+    auto entropyDifference = 0.0;
+    for (unsigned int iteration = 0; iteration < 200u; ++iteration)
+    {
+        entropyDifference = evaluate(beta);
+        if (std::abs(entropyDifference) < tolerance)
+        {
+            break;
+        }
+
+        const auto newtonBeta = beta + entropyDifference / (beta * variance);
+        if (newtonBeta > belowWindow && newtonBeta < aboveWindow)
+        {
+            beta = newtonBeta;
+        }
+        else if (aboveWindow == std::numeric_limits<double>::infinity())
+        {
+            beta *= 2.0;
+        }
+        else if (belowWindow == 0.0)
+        {
+            beta /= 2.0;
+        }
+        else
+        {
+            beta = (belowWindow + aboveWindow) / 2.0;
+        }
+    }
+
+    // Step just past both ends of the window, so that the bounds enclose it tightly
+    if (std::abs(entropyDifference) < tolerance)
+    {
+        const auto insideBeta = beta;
+        const auto insideDifference = entropyDifference;
+        const auto insideVariance = variance;
+        for (const auto end : { tolerance, -tolerance })
+        {
+            auto probe = insideBeta;
+            auto probeDifference = insideDifference;
+            variance = insideVariance;
+            for (unsigned int iteration = 0; iteration < 4u && std::abs(probeDifference) < tolerance; ++iteration)
             {
-                max_beta = beta;
-                if (min_beta == std::numeric_limits<double>::lowest()
-                    || min_beta == std::numeric_limits<double>::max())
-                {
-                    beta /= 2.0;
-                }
-                else
+                probe -= 1.01 * (end - probeDifference) / (probe * variance);
+                if (!(probe > belowWindow && probe < aboveWindow))
                 {
-                    beta = (beta + min_beta) / 2.0;
+                    break;
                 }
+                probeDifference = evaluate(probe);
             }
-		}
+        }
+    }
+
+    // Binary search from beta = 1 that stops at the first beta within the tolerance
+    beta = 1.0;
+    auto lowerBeta = 0.0;
+    auto upperBeta = std::numeric_limits<double>::infinity();
+    auto evaluatedBeta = std::numeric_limits<double>::quiet_NaN();
+    for (unsigned int iteration = 0; iteration < 200u; ++iteration)
+    {
+        auto increase = beta <= belowWindow;
+        if (!increase && beta < aboveWindow)
+        {
+            entropyDifference = evaluate(beta);
+            evaluatedBeta = beta;
+            if (std::abs(entropyDifference) < tolerance)
+            {
+                break;
+            }
+            increase = entropyDifference > 0;
+        }
 
-		// Row-normalize current row of P and store in matrix
-		for (unsigned int m = 0; m < K; ++m)
+        // The last beta of an unsuccessful search is the one the similarities are computed for
+        if (iteration + 1 == 200u)
         {
-            cur_P[m] /= sum_P;
-            similarities.columns[similarities.rows[n] + m] = indices[m + 1].index;
-            similarities.values[similarities.rows[n] + m] = cur_P[m];
-		}
-	}
+            break;
+        }
+        if (increase)
+        {
+            lowerBeta = beta;
+            beta = upperBeta == std::numeric_limits<double>::infinity() ? beta * 2.0 : (beta + upperBeta) / 2.0;
+        }
+        else
+        {
+            upperBeta = beta;
+            beta = lowerBeta == 0.0 ? beta / 2.0 : (beta + lowerBeta) / 2.0;
+        }
+    }
+    if (beta != evaluatedBeta)
+    {
+        evaluate(beta);
+    }
+
+    // Row-normalize current row of P
+    for (unsigned int m = 0; m < neighbors; ++m)
+    {
+        similarities[m] /= sum;
+    }
+}
+
+// Largest perplexity of the scales or the points, which determines the number of neighbors to search
+double TSNE::maximumPerplexity() const
+{
+    if (!m_perplexities.empty())
+    {
+        return *std::max_element(m_perplexities.begin(), m_perplexities.end());
+    }
+    if (!m_pointPerplexities.empty())
+    {
+        return *std::max_element(m_pointPerplexities.begin(), m_pointPerplexities.end());
+    }
+    return m_perplexity;
+}
+
+// Number of the nearest of the given neighbors the similarities of a point are computed for
+unsigned int TSNE::neighborCount(unsigned int point, unsigned int neighbors) const
+{
+    if (m_pointPerplexities.empty())
+    {
+        return neighbors;
+    }
+    return std::min(neighbors, static_cast<unsigned int>(3 * m_pointPerplexities[point]));
+}
+
+// Checksum of the input data and of all parameters the input similarities depend on
+std::uint64_t TSNE::similarityCacheKey() const
+{
+    const auto size = static_cast<std::uint32_t>(m_dataSize);
+    const auto dimensions = static_cast<std::uint32_t>(m_inputDimensions);
+    const auto metric = static_cast<std::uint32_t>(m_distanceMetric);
+    const auto neighborMethod = resolveNeighborMethod();
+    const auto method = static_cast<std::uint32_t>(neighborMethod);
+    const auto scales = static_cast<std::uint32_t>(m_perplexities.size());
+    const auto points = static_cast<std::uint32_t>(m_pointPerplexities.size());
+
+    auto key = checksum(&size, sizeof(size));
+    key = checksum(&dimensions, sizeof(dimensions), key);
+    if (m_perplexities.empty() && m_pointPerplexities.empty())
+    {
+        key = checksum(&m_perplexity, sizeof(m_perplexity), key);
+    }
+    key = checksum(&scales, sizeof(scales), key);
+    key = checksum(m_perplexities.data(), m_perplexities.size() * sizeof(double), key);
+    key = checksum(&points, sizeof(points), key);
+    key = checksum(m_pointPerplexities.data(), m_pointPerplexities.size() * sizeof(double), key);
+    key = checksum(&metric, sizeof(metric), key);
+    key = checksum(&method, sizeof(method), key);
+
+    // Only the parameters of the approximate methods change the neighbors they find
+    if (neighborMethod == NeighborMethod::RandomProjectionForest)
+    {
+        key = checksum(&m_randomProjectionTrees, sizeof(m_randomProjectionTrees), key);
+    }
+    if (neighborMethod == NeighborMethod::RandomProjectionForest
+        || neighborMethod == NeighborMethod::HierarchicalNavigableSmallWorld)
+    {
+        key = checksum(&m_neighborSearchBudget, sizeof(m_neighborSearchBudget), key);
+    }
+    if (neighborMethod == NeighborMethod::NearestNeighborDescent)
+    {
+        key = checksum(&m_neighborDescentThreshold, sizeof(m_neighborDescentThreshold), key);
+    }
+    return m_data.size() == 0 ? key : checksum(m_data[0], m_data.size() * sizeof(double), key);
+}
+
+bool TSNE::loadSimilarityCache(SparseMatrix & similarities, std::uint64_t key) const
+{
+    std::ifstream f(m_similarityCacheFile, std::ios::binary);
+    const auto read = [&f](void * value, std::size_t bytes) {
+        return static_cast<bool>(f.read(static_cast<char *>(value), bytes)); };
+
+    // The header has to match the data and the parameters
+    char magic[sizeof(s_cacheMagic)];
+    auto version = std::uint32_t(0);
+    auto cachedKey = std::uint64_t(0);
+    auto size = 0u;
+    auto entries = 0u;
+    if (!f || !read(magic, sizeof(magic)) || std::memcmp(magic, s_cacheMagic, sizeof(magic)) != 0
+        || !read(&version, sizeof(version)) || version != s_cacheVersion
+        || !read(&cachedKey, sizeof(cachedKey)) || cachedKey != key
+        || !read(&size, sizeof(size)) || size != m_dataSize
+        || !read(&entries, sizeof(entries)))
+    {
+        return false;
+    }
+
+    auto cached = SparseMatrix();
+    cached.rows.resize(size + 1);
+    cached.columns.resize(entries);
+    cached.values.resize(entries);
+    if (!read(cached.rows.data(), cached.rows.size() * sizeof(unsigned int))
+        || !read(cached.columns.data(), entries * sizeof(unsigned int))
+        || !read(cached.values.data(), entries * sizeof(double))
+        || cached.rows.front() != 0 || cached.rows.back() != entries
+        || !std::is_sorted(cached.rows.begin(), cached.rows.end())
+        || std::any_of(cached.columns.begin(), cached.columns.end(), [size](unsigned int column) {
+            return column >= size; }))
+    {
+        return false;
+    }
+
+    similarities = std::move(cached);
+    return true;
+}
+
+void TSNE::saveSimilarityCache(const SparseMatrix & similarities, std::uint64_t key) const
+{
+    std::ofstream f(m_similarityCacheFile, std::ios::binary | std::ios::trunc);
+    const auto write = [&f](const void * value, std::size_t bytes) {
+        f.write(static_cast<const char *>(value), bytes); };
+
+    const auto size = m_dataSize;
+    const auto entries = static_cast<unsigned int>(similarities.values.size());
+    write(s_cacheMagic, sizeof(s_cacheMagic));
+    write(&s_cacheVersion, sizeof(s_cacheVersion));
+    write(&key, sizeof(key));
+    write(&size, sizeof(size));
+    write(&entries, sizeof(entries));
+    write(similarities.rows.data(), similarities.rows.size() * sizeof(unsigned int));
+    write(similarities.columns.data(), entries * sizeof(unsigned int));
+    write(similarities.values.data(), entries * sizeof(double));
+    if (!f)
+    {
+        std::cerr << "can't save input similarities to " << m_similarityCacheFile << std::endl;
+    }
 }
@@ -2,155 +2,169 @@
 
 #include <cassert>
 #include <iostream>
+#include <limits>
+#include <numeric>
 
-#include "immintrin.h"
+#include "SimdKernels.h"
 
 
-DataPoint::DataPoint()
-: dimensions(0)
-, index(0)
-, data()
-{}
-
-DataPoint::DataPoint(const unsigned int dimensions, const unsigned int index, const double * x)
-: dimensions(dimensions)
-, index(index)
-, data(x, x + dimensions)
-{}
-
-double VantagePointTree::squaredEuclideanDistance(const DataPoint & a, const DataPoint & b)
+double VantagePointTree::squaredEuclideanDistance(const double * a, const double * b, unsigned int dimensions)
 {
-    /*
-    // this is the desired implementation but windows supports no omp simd with its omp 2.0
-    double squaredDistance = 0.0;
-    #pragma omp simd reduction(+:squaredDistance)
-    for (int i = 0; i < a.dimensions; ++i)
-    {
-        double difference = a.data[i] - b.data[i];
-        squaredDistance += difference * difference;
-    }
-    return sqrt(squaredDistance);
-    */
-
-    assert(a.dimensions == b.dimensions);
-    double squaredDistance = 0.0;
-    int i = 0;
-
-#ifdef AVX2_ENABLED
-    auto squared_accum = _mm256_set1_pd(0.0);
-    for (; i < a.dimensions - 3; i += 4)
-    {
-        auto diff = _mm256_sub_pd(_mm256_load_pd(a.data.data() + i), _mm256_load_pd(b.data.data() + i));
-        squared_accum = _mm256_add_pd(squared_accum, _mm256_mul_pd(diff, diff));
-    }
-    alignas(32) double buf[4];
-    _mm256_store_pd(buf, squared_accum);
-    squaredDistance = buf[0] + buf[1] + buf[2] + buf[3];
-#endif
+    return bhtsne::kernels().distances.squaredEuclideanDistance(a, b, dimensions);
+}
 
-    for (; i < a.dimensions; ++i)
-    {
-        double difference = a.data[i] - b.data[i];
-        squaredDistance += difference * difference;
-    }
+double VantagePointTree::dotProduct(const double * a, const double * b, unsigned int dimensions)
+{
+    return bhtsne::kernels().distances.dotProduct(a, b, dimensions);
+}
 
-    return squaredDistance;
+void VantagePointTree::dotProducts4(const double * a, const double * rows, unsigned int dimensions, double * products)
+{
+    bhtsne::kernels().distances.dotProducts4(a, rows, dimensions, products);
 }
 
-VantagePointTree::VantagePointTree(const unsigned long randomSeed)
-        : m_maxDistance(0.0)
-        , m_randomNumberGenerator(randomSeed)
-        , m_root(std::make_unique<Node>())
+VantagePointTree::VantagePointTree(const unsigned long randomSeed, const bhtsne::Distance & distance)
+        : m_data(nullptr)
+        , m_dimensions(0)
+        , m_seed(randomSeed)
+        , m_distance(distance)
 {}
 
-void VantagePointTree::create(const std::vector<DataPoint> & items)
+void VantagePointTree::create(const bhtsne::Vector2D<double> & data)
 {
-    m_items = items;
-    m_root = buildFromPoints(0, static_cast<unsigned int>(items.size()));
+    m_data = &data;
+    m_dimensions = static_cast<unsigned int>(data.width());
+
+    const auto size = static_cast<unsigned int>(data.size() / data.width());
+    m_indices.resize(size);
+    std::iota(m_indices.begin(), m_indices.end(), 0u);
+
+    // a node per point
+    m_nodes.resize(size);
+    auto items = std::vector<HeapItem>(size);
+    #pragma omp parallel
+    {
+        #pragma omp single
+        buildFromPoints(0, size, items.data());
+    }
 }
 
-void VantagePointTree::search(const DataPoint & target, unsigned int k, std::vector<DataPoint> & results,
-                              std::vector<double> & distances)
+unsigned int VantagePointTree::search(const double * target, unsigned int k, unsigned int * indices,
+                                      double * distances) const
 {
 
     // Use a priority queue to store intermediate results on
     std::priority_queue<HeapItem> heap;
 
-    m_maxDistance = std::numeric_limits<double>::max();
+    auto maxDistance = std::numeric_limits<double>::max();
 
     // Perform the search
-    search(*m_root, target, k, heap);
+    if (!m_nodes.empty())
+    {
+        search(m_nodes[0], target, k, heap, maxDistance);
+    }
 
-    // Gather final results
-    results.resize(heap.size());
-    distances.resize(heap.size());
-    auto index = heap.size()-1;
-    while(!heap.empty())
+    // Gather final results (the heap yields the farthest neighbor first)
+    const auto found = static_cast<unsigned int>(heap.size());
+    for (auto position = found; position > 0; --position)
     {
-        results[index] = m_items[heap.top().index];
-        distances[index] = heap.top().distance;
+        indices[position - 1] = m_indices[heap.top().index];
+        distances[position - 1] = heap.top().distance;
         heap.pop();
-        --index;
     }
+    return found;
+}
+
+unsigned int VantagePointTree::searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                                             double * distances) const
+{
+    return search((*m_data)[index], k, indices, distances);
 }
 
-std::unique_ptr<VantagePointTree::Node> VantagePointTree::buildFromPoints(unsigned int lower, unsigned int upper)
+void VantagePointTree::buildFromPoints(unsigned int lower, unsigned int upper, HeapItem * items)
 {
     if (upper == lower)
     {
-        // we're done here, return null pointer (default constructed unique_ptr)
-        return std::unique_ptr<Node>();
+        // we're done here
+        return;
     }
 
     // Lower index is center of current node
-    auto node = std::make_unique<Node>(lower);
+    auto & node = m_nodes[lower];
+    node = Node{ lower, 0.0, 0, 0 };
 
     if (upper - lower > 1)
     {      // if we did not arrive at leaf yet
 
         // Choose an arbitrary point and move it to the start
-        auto uniformDistribution = std::uniform_int_distribution<int>(lower, upper - 1);
-        auto random_index = uniformDistribution(m_randomNumberGenerator);
-        std::swap(m_items[lower], m_items[random_index]);
+        std::swap(m_indices[lower], m_indices[randomPosition(lower, upper)]);
 
-        // Partition around the median distance
+        // Partition around the median distance, every distance to the vantage point is computed once
         unsigned int median = (lower + upper) / 2;
-        std::nth_element(m_items.begin() + lower + 1,
-                         m_items.begin() + median,
-                         m_items.begin() + upper,
-                         [this, lower](const DataPoint & a, const DataPoint & b){
-                             return squaredEuclideanDistance(m_items[lower], a) < squaredEuclideanDistance(m_items[lower], b); });
-
-        // Threshold of the new node will be the distance to the median
-        node->threshold = squaredEuclideanDistance(m_items[lower], m_items[median]);
-
-        // Recursively build tree
-        node->leftChild = buildFromPoints(lower + 1, median);
-        node->rightChild = buildFromPoints(median, upper);
+        const auto vantagePoint = (*m_data)[m_indices[lower]];
+        for (auto i = lower + 1; i < upper; ++i)
+        {
+            const auto distance = m_distance(vantagePoint, (*m_data)[m_indices[i]], m_dimensions);
+            items[i] = HeapItem{ m_indices[i], distance };
+        }
+        std::nth_element(items + lower + 1, items + median, items + upper);
+        for (auto i = lower + 1; i < upper; ++i)
+        {
+            m_indices[i] = items[i].index;
+        }
+
+        // Threshold of the new node will be the distance to the median, pruning relies on the triangle inequality
+        node.threshold = m_distance.metricDistance(items[median].distance);
+        node.leftChild = median > lower + 1 ? lower + 1 : 0;
+        node.rightChild = median;
+
+        // Recursively build tree, large subtrees as separate tasks (requires OpenMP 3.0)
+#if defined(_OPENMP) && _OPENMP >= 200805
+        if (upper - lower > s_taskSize)
+        {
+            #pragma omp task
+            buildFromPoints(lower + 1, median, items);
+            buildFromPoints(median, upper, items);
+            #pragma omp taskwait
+            return;
+        }
+#endif
+        buildFromPoints(lower + 1, median, items);
+        buildFromPoints(median, upper, items);
     }
+}
 
-    return node;
+unsigned int VantagePointTree::randomPosition(unsigned int lower, unsigned int upper) const
+{
+    // SplitMix64 finalizer on the seed and the range
+    auto hash = static_cast<std::uint64_t>(m_seed) ^ (static_cast<std::uint64_t>(lower) << 32 | upper);
+    hash += 0x9e3779b97f4a7c15ull;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    return lower + static_cast<unsigned int>(hash % (upper - lower));
 }
 
-void VantagePointTree::search(const VantagePointTree::Node & node, const DataPoint & target, unsigned int k,
-                              std::priority_queue<VantagePointTree::HeapItem> & heap)
+void VantagePointTree::search(const VantagePointTree::Node & node, const double * target, unsigned int k,
+                              std::priority_queue<VantagePointTree::HeapItem> & heap, double & maxDistance) const
 {
     // Compute distance between target and current node
-    double distance = squaredEuclideanDistance(m_items[node.index], target);
+    const auto nodeDistance = m_distance((*m_data)[m_indices[node.index]], target, m_dimensions);
+    const auto distance = m_distance.metricDistance(nodeDistance);
 
     // If current node within radius tau
-    if(distance < m_maxDistance)
+    if(distance < maxDistance)
     {
         if(heap.size() == k)
         {
             // remove furthest node from result list (if we already have k results)
             heap.pop();
         }
-        heap.push(HeapItem{node.index, distance}); // add current node to result list
+        heap.push(HeapItem{node.index, nodeDistance}); // add current node to result list
         if(heap.size() == k)
         {
             // update value of tau (farthest point in result list)
-            m_maxDistance = heap.top().distance;
+            maxDistance = m_distance.metricDistance(heap.top().distance);
         }
     }
 
@@ -158,15 +172,15 @@ void VantagePointTree::search(const VantagePointTree::Node & node, const DataPoi
     if(distance < node.threshold)
     {
         // if there can still be neighbors inside the ball, recursively search left child first
-        if(distance - m_maxDistance <= node.threshold && node.leftChild)
+        if(distance - maxDistance <= node.threshold && node.leftChild)
         {
-            search(*node.leftChild, target, k, heap);
+            search(m_nodes[node.leftChild], target, k, heap, maxDistance);
         }
 
         // if there can still be neighbors outside the ball, recursively search right child
-        if(distance + m_maxDistance >= node.threshold && node.rightChild)
+        if(distance + maxDistance >= node.threshold && node.rightChild)
         {
-            search(*node.rightChild, target, k, heap);
+            search(m_nodes[node.rightChild], target, k, heap, maxDistance);
         }
 
         // If the target lies outsize the radius of the ball
@@ -174,24 +188,19 @@ void VantagePointTree::search(const VantagePointTree::Node & node, const DataPoi
     else
     {
         // if there can still be neighbors outside the ball, recursively search right child first
-        if(distance + m_maxDistance >= node.threshold && node.rightChild)
+        if(distance + maxDistance >= node.threshold && node.rightChild)
         {
-            search(*node.rightChild, target, k, heap);
+            search(m_nodes[node.rightChild], target, k, heap, maxDistance);
         }
 
         // if there can still be neighbors inside the ball, recursively search left child
-        if (distance - m_maxDistance <= node.threshold && node.leftChild)
+        if (distance - maxDistance <= node.threshold && node.leftChild)
         {
-            search(*node.leftChild, target, k, heap);
+            search(m_nodes[node.leftChild], target, k, heap, maxDistance);
         }
     }
 }
 
-VantagePointTree::Node::Node(unsigned int index)
-        : index(index)
-        , threshold(0.0)
-{}
-
 bool VantagePointTree::HeapItem::operator<(const VantagePointTree::HeapItem &other) const {
     return distance < other.distance;
 }
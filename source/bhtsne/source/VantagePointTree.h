@@ -36,58 +36,65 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
 #include <vector>
 #include <queue>
-#include <memory>
-#include <random>
 #include <functional>
 
-#include "Allocator.h"
+#include <bhtsne/Vector2D.h>
 
-struct DataPoint
-{
-    unsigned int dimensions;
-    unsigned int index;
-    std::vector<double, aligned_allocator<double, sizeof(double)*4>> data;
+#include "Distance.h"
+#include "NeighborSearch.h"
 
-    DataPoint();
-    DataPoint(const unsigned int dimensions, const unsigned int index, const double * x);
-};
 
-class VantagePointTree
+class VantagePointTree : public bhtsne::NeighborSearch
 {
 public:
-    explicit VantagePointTree(const unsigned long randomSeed);
+    // the tree is pruned by the metric distance of distance (see Distance::metricDistance())
+    VantagePointTree(const unsigned long randomSeed, const bhtsne::Distance & distance);
 
     // possible distance functions
-    static double squaredEuclideanDistance(const DataPoint & a, const DataPoint & b);
-    //TODO create some more common distance functions
-
-    // Function to create a new VantagePointTree from data
-    void create(const std::vector<DataPoint> & items);
-
-    // Function that uses the tree to find the k nearest neighbors of target
-    void search(const DataPoint & target, unsigned int k, std::vector<DataPoint> & results,
-                std::vector<double> & distances);
+    static double squaredEuclideanDistance(const double * a, const double * b, unsigned int dimensions);
+    static double dotProduct(const double * a, const double * b, unsigned int dimensions);
+    // Dot products of a with the 4 consecutive rows starting at rows, register-blocked to load a once for all
+    static void dotProducts4(const double * a, const double * rows, unsigned int dimensions, double * products);
+
+    // Function to create a new VantagePointTree on the rows of data, which are referenced and not copied
+    // (data must outlive the tree); subtrees are built in parallel, the tree only depends on data and seed
+    void create(const bhtsne::Vector2D<double> & data) override;
+
+    // Function that uses the tree to find the k nearest neighbors of target; writes their indices and distances,
+    // nearest first, to the caller-provided buffers of k values each and returns the number found;
+    // the search state is kept per query, so it can be called concurrently
+    unsigned int search(const double * target, unsigned int k, unsigned int * indices,
+                        double * distances) const override;
+    unsigned int searchIndexed(unsigned int index, unsigned int k, unsigned int * indices,
+                               double * distances) const override;
 
 private:
-    std::vector<DataPoint> m_items;
-    double m_maxDistance;
-    std::mt19937 m_randomNumberGenerator;
+    const bhtsne::Vector2D<double> * m_data;
+    unsigned int m_dimensions;
+    // Point indices in the order of the tree, every node partitions a range of them
+    std::vector<unsigned int> m_indices;
+    unsigned long m_seed;
+    bhtsne::Distance m_distance;
+
+    // Minimum number of points of a subtree that is built as a separate task
+    static constexpr unsigned int s_taskSize = 1u << 12;
 
 
-    // Single node of a VP tree (has a point and radius; left children are closer to point than the radius)
+    // Single node of a VP tree (has a point and radius; left children are closer to point than the radius);
+    // the node of the range of points starting at position p of m_indices is stored at position p of m_nodes,
+    // children are referenced by their position, 0 for no child (the root is never a child)
     struct Node
     {
         unsigned int index; // index of point in node
-        double threshold; // radius(?)
-        std::unique_ptr<Node> leftChild; // points closer by than threshold
-        std::unique_ptr<Node> rightChild; // points farther away than threshold
-
-        explicit Node(unsigned int index = 0);
+        double threshold; // radius as metric distance
+        unsigned int leftChild; // points closer by than threshold
+        unsigned int rightChild; // points farther away than threshold
     };
 
-    std::unique_ptr<Node> m_root;
+    std::vector<Node> m_nodes;
 
     // An item on the intermediate result queue
     struct HeapItem {
@@ -97,9 +104,13 @@ private:
         bool operator<(const HeapItem & other) const;
     };
 
-    // Function that (recursively) fills the tree
-    std::unique_ptr<Node> buildFromPoints(unsigned int lower, unsigned int upper);
+    // Function that (recursively) fills the tree, items is scratch space for the distances to the vantage points
+    void buildFromPoints(unsigned int lower, unsigned int upper, HeapItem * items);
+    // Random position in [lower, upper) that only depends on the seed and the range
+    unsigned int randomPosition(unsigned int lower, unsigned int upper) const;
 
-    // Helper function that searches the tree
-    void search(const Node & node, const DataPoint & target, unsigned int k, std::priority_queue<HeapItem> & heap);
+    // Helper function that searches the tree, maxDistance is the metric distance of the farthest neighbor found so
+    // far (the heap holds the distances)
+    void search(const Node & node, const double * target, unsigned int k, std::priority_queue<HeapItem> & heap,
+                double & maxDistance) const;
 };
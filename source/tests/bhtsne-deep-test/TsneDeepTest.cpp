@@ -1,9 +1,16 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <bhtsne/TSNE.h>
 #include <bhtsne/SparseMatrix.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 class PublicTSNE : public bhtsne::TSNE
 {
     FRIEND_TEST(TsneDeepTest, Constructor);
@@ -21,6 +28,8 @@ class PublicTSNE : public bhtsne::TSNE
     FRIEND_TEST(TsneDeepTest, SetGradientAccuracy);
     FRIEND_TEST(TsneDeepTest, Iterations);
     FRIEND_TEST(TsneDeepTest, SetIterations);
+    FRIEND_TEST(TsneDeepTest, ReorderInterval);
+    FRIEND_TEST(TsneDeepTest, SetReorderInterval);
     FRIEND_TEST(TsneDeepTest, OutputDimensions);
     FRIEND_TEST(TsneDeepTest, SetOutputDimensions);
     FRIEND_TEST(TsneDeepTest, InputDimensions);
@@ -32,6 +41,9 @@ class PublicTSNE : public bhtsne::TSNE
     FRIEND_TEST(TsneDeepTest, LoadCSV);
     FRIEND_TEST(TsneDeepTest, LoadTSNE);
     FRIEND_TEST(TsneDeepTest, LoadCin);
+    FRIEND_TEST(TsneDeepTest, LoadNeighbors);
+    FRIEND_TEST(TsneDeepTest, LoadSimilarities);
+    FRIEND_TEST(TsneDeepTest, SimilarityCache);
     FRIEND_TEST(TsneDeepTest, Run);
     FRIEND_TEST(TsneDeepTest, RunApproximation);
     FRIEND_TEST(TsneDeepTest, RunExact);
@@ -41,10 +53,19 @@ class PublicTSNE : public bhtsne::TSNE
     FRIEND_TEST(TsneDeepTest, SaveLegacy);
     FRIEND_TEST(TsneDeepTest, SaveSVG);
     FRIEND_TEST(TsneDeepTest, ZeroMean);
+    FRIEND_TEST(TsneDeepTest, PermuteRows);
+    FRIEND_TEST(TsneDeepTest, PermuteSimilarities);
     FRIEND_TEST(TsneDeepTest, Normalize);
     FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexityExact);
     FRIEND_TEST(TsneDeepTest, ComputeSquaredEuclideanDistance);
     FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexity);
+    FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexityBruteForce);
+    FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexityRandomProjectionForest);
+    FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexityNearestNeighborDescent);
+    FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexityHierarchicalNavigableSmallWorld);
+    FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexityDistanceMetrics);
+    FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexityMultiScale);
+    FRIEND_TEST(TsneDeepTest, ComputeGaussianPerplexityPointPerplexities);
 };
 
 class BinaryWriter
@@ -67,6 +88,71 @@ private:
     std::ofstream * fileStream;
 };
 
+// Number of the neighbors in the rows of the similarities that are among the exact nearest neighbors (by brute force)
+unsigned int countExactNeighbors(const std::vector<std::vector<double>> & data, const bhtsne::SparseMatrix & similarities)
+{
+	const auto K = similarities.rows[1];
+	auto found = 0u;
+	for (auto n = size_t(0); n < data.size(); ++n)
+	{
+		auto neighbors = std::vector<std::pair<double, unsigned int>>();
+		for (auto m = size_t(0); m < data.size(); ++m)
+		{
+			auto distance = 0.0;
+			for (auto d = size_t(0); d < data[n].size(); ++d)
+			{
+				distance += (data[n][d] - data[m][d]) * (data[n][d] - data[m][d]);
+			}
+			if (m != n)
+			{
+				neighbors.emplace_back(distance, static_cast<unsigned int>(m));
+			}
+		}
+		std::partial_sort(neighbors.begin(), neighbors.begin() + K, neighbors.end());
+
+		auto expected = std::vector<unsigned int>();
+		for (auto i = 0u; i < K; ++i)
+		{
+			expected.push_back(neighbors[i].second);
+		}
+		std::sort(expected.begin(), expected.end());
+		for (auto i = similarities.rows[n]; i < similarities.rows[n + 1]; ++i)
+		{
+			found += std::binary_search(expected.begin(), expected.end(), similarities.columns[i]) ? 1 : 0;
+		}
+	}
+	return found;
+}
+
+// Number of the neighbors in the rows of the similarities that are at most as far as the exact Kth nearest neighbor
+// by the given distance (by brute force), so that ties of the metric are no misses
+template<typename Distance>
+unsigned int countNearestNeighbors(const std::vector<std::vector<double>> & data,
+                                   const bhtsne::SparseMatrix & similarities, Distance distance)
+{
+	const auto K = similarities.rows[1];
+	auto found = 0u;
+	for (auto n = size_t(0); n < data.size(); ++n)
+	{
+		auto distances = std::vector<double>();
+		for (auto m = size_t(0); m < data.size(); ++m)
+		{
+			if (m != n)
+			{
+				distances.push_back(distance(data[n], data[m]));
+			}
+		}
+		std::nth_element(distances.begin(), distances.begin() + K - 1, distances.end());
+
+		for (auto i = similarities.rows[n]; i < similarities.rows[n + 1]; ++i)
+		{
+			const auto neighborDistance = distance(data[n], data[similarities.columns[i]]);
+			found += similarities.columns[i] != n && neighborDistance <= distances[K - 1] + 1e-12 ? 1 : 0;
+		}
+	}
+	return found;
+}
+
 class TsneDeepTest : public testing::Test
 {
 protected:
@@ -91,6 +177,36 @@ protected:
         m_writer = BinaryWriter(&m_fileStream);
     }
 
+    // Points with normally distributed coordinates, the same in every test
+    static std::vector<std::vector<double>> randomData(std::size_t points, std::size_t dimensions)
+    {
+        auto generator = std::mt19937(5);
+        auto distribution = std::normal_distribution<double>();
+        auto data = std::vector<std::vector<double>>(points, std::vector<double>(dimensions));
+        for (auto & point : data)
+        {
+            for (auto & value : point)
+            {
+                value = distribution(generator);
+            }
+        }
+        return data;
+    }
+
+    // The similarities of every row sum up to one
+    static void expectNormalizedRows(const bhtsne::SparseMatrix & similarities)
+    {
+        for (auto n = size_t(0); n + 1 < similarities.rows.size(); ++n)
+        {
+            auto sum = 0.0;
+            for (auto i = similarities.rows[n]; i < similarities.rows[n + 1]; ++i)
+            {
+                sum += similarities.values[i];
+            }
+            EXPECT_NEAR(1.0, sum, 1e-9);
+        }
+    }
+
     auto removeTempfile()
     {
         if (m_fileStream.is_open())
@@ -118,6 +234,8 @@ TEST_F(TsneDeepTest, Constructor)
     auto tsne = bhtsne::TSNE();
     EXPECT_EQ(50.0, tsne.perplexity());
     EXPECT_EQ(0.2, tsne.gradientAccuracy());
+    EXPECT_EQ(bhtsne::NeighborMethod::Automatic, tsne.neighborMethod());
+    EXPECT_EQ(bhtsne::DistanceMetric::Euclidean, tsne.distanceMetric());
     EXPECT_EQ(1000, tsne.iterations());
     EXPECT_EQ(2, tsne.outputDimensions());
     EXPECT_EQ(0, tsne.inputDimensions());
@@ -283,6 +401,24 @@ TEST_F(TsneDeepTest, SetIterations)
     }
 }
 
+TEST_F(TsneDeepTest, ReorderInterval)
+{
+    for (const auto & number : s_testValuesInt)
+    {
+        m_tsne.m_reorderInterval = number;
+        EXPECT_EQ(number, m_tsne.reorderInterval());
+    }
+}
+
+TEST_F(TsneDeepTest, SetReorderInterval)
+{
+    for (const auto & number : s_testValuesInt)
+    {
+        m_tsne.setReorderInterval(number);
+        EXPECT_EQ(number, m_tsne.m_reorderInterval);
+    }
+}
+
 TEST_F(TsneDeepTest, OutputDimensions)
 {
     for (const auto & number : s_testValuesInt)
@@ -508,6 +644,214 @@ TEST_F(TsneDeepTest, LoadCin)
     std::cin.rdbuf(cinBuf);
 }
 
+TEST_F(TsneDeepTest, LoadNeighbors)
+{
+    // all points are neighbors of every point, including itself, in reverse order and with unsquared distances
+    auto dataSize = static_cast<int>(s_testDataSet.size());
+    createTempfile();
+    m_writer << dataSize << dataSize;
+    for (auto n = 0; n < dataSize; ++n)
+    {
+        for (auto m = dataSize - 1; m >= 0; --m)
+        {
+            m_writer << static_cast<unsigned int>(m);
+        }
+    }
+    for (auto n = 0; n < dataSize; ++n)
+    {
+        for (auto m = dataSize - 1; m >= 0; --m)
+        {
+            auto distance = 0.0;
+            for (auto d = size_t(0); d < s_testDataSet[n].size(); ++d)
+            {
+                distance += (s_testDataSet[n][d] - s_testDataSet[m][d]) * (s_testDataSet[n][d] - s_testDataSet[m][d]);
+            }
+            m_writer << std::sqrt(distance);
+        }
+    }
+    m_fileStream.flush();
+    m_fileStream.close();
+
+    EXPECT_TRUE(m_tsne.loadNeighbors(m_tempFile));
+    EXPECT_EQ(dataSize, m_tsne.dataSize());
+    removeTempfile();
+
+    // the similarities equal those of the neighbor search
+    m_tsne.m_perplexity = 2.0;
+    auto loaded = bhtsne::SparseMatrix();
+    m_tsne.computeGaussianPerplexityFromNeighbors(loaded);
+
+    m_tsne.m_data = bhtsne::Vector2D<double>(s_testDataSet);
+    m_tsne.m_inputDimensions = m_tsne.m_data.width();
+    auto searched = bhtsne::SparseMatrix();
+    m_tsne.computeGaussianPerplexity(searched);
+
+    EXPECT_EQ(searched.rows, loaded.rows);
+    for (auto n = 0; n < dataSize; ++n)
+    {
+        for (auto i = searched.rows[n]; i < searched.rows[n + 1]; ++i)
+        {
+            const auto first = loaded.columns.begin() + loaded.rows[n];
+            const auto last = loaded.columns.begin() + loaded.rows[n + 1];
+            const auto column = std::find(first, last, searched.columns[i]);
+            ASSERT_NE(last, column);
+            EXPECT_NEAR(searched.values[i], loaded.values[column - loaded.columns.begin()], 1e-9);
+        }
+    }
+
+    // a point whose only neighbor is itself has no similarities, the other points are not affected
+    auto selfIndices = bhtsne::Vector2D<unsigned int>(3, 3);
+    auto selfDistances = bhtsne::Vector2D<double>(3, 3);
+    for (auto n = 0u; n < 3; ++n)
+    {
+        for (auto m = 0u; m < 3; ++m)
+        {
+            selfIndices[n][m] = n == 0 ? 0 : m;
+            selfDistances[n][m] = n == m ? 0.0 : 1.0;
+        }
+    }
+    EXPECT_TRUE(m_tsne.setNeighbors(std::move(selfIndices), std::move(selfDistances)));
+    auto isolated = bhtsne::SparseMatrix();
+    m_tsne.computeGaussianPerplexityFromNeighbors(isolated);
+    EXPECT_EQ(std::vector<unsigned int>({ 0, 0, 2, 4 }), isolated.rows);
+    for (const auto value : isolated.values)
+    {
+        EXPECT_TRUE(std::isfinite(value));
+    }
+
+    // indices out of range are rejected
+    auto indices = bhtsne::Vector2D<unsigned int>(2, 1);
+    auto distances = bhtsne::Vector2D<double>(2, 1);
+    indices[1][0] = 2;
+    EXPECT_FALSE(m_tsne.setNeighbors(std::move(indices), std::move(distances)));
+}
+
+TEST_F(TsneDeepTest, LoadSimilarities)
+{
+    // the similarities computed by runApproximation() lead to the same result when they are loaded
+    auto computed = PublicTSNE();
+    computed.m_data = s_testDataSet;
+    computed.m_dataSize = s_testDataSet.size();
+    computed.m_inputDimensions = s_testDataSet[0].size();
+    computed.m_perplexity = 2;
+    computed.normalizeInput();
+    auto similarities = bhtsne::SparseMatrix();
+    computed.computeGaussianPerplexity(similarities);
+    computed.symmetrizeMatrix(similarities);
+
+    createTempfile();
+    m_writer << static_cast<int>(s_testDataSet.size()) << static_cast<int>(similarities.values.size());
+    for (auto row : similarities.rows)
+    {
+        m_writer << row;
+    }
+    for (auto column : similarities.columns)
+    {
+        m_writer << column;
+    }
+    for (auto value : similarities.values)
+    {
+        m_writer << value;
+    }
+    m_fileStream.flush();
+    m_fileStream.close();
+
+    EXPECT_TRUE(m_tsne.loadSimilarities(m_tempFile));
+    EXPECT_EQ(s_testDataSet.size(), m_tsne.dataSize());
+    removeTempfile();
+
+    m_tsne.m_outputDimensions = 1;
+    m_tsne.m_seed = 1;
+    m_tsne.m_gradientAccuracy = 0;
+    EXPECT_THROW(m_tsne.run(), std::invalid_argument);
+
+    m_tsne.m_gradientAccuracy = 0.1;
+    auto expected = std::vector<double>{ 6.74018e-05, -5.00873e-06, -2.8833609e-05, -6.8209149e-05, -6.69799e-05, 3.64486e-05, 6.5181e-05 };
+    EXPECT_NO_THROW(m_tsne.run());
+    auto it = m_tsne.m_result.begin();
+    auto itExp = expected.begin();
+    while (it != m_tsne.m_result.end())
+    {
+        EXPECT_FLOAT_EQ(*(itExp++), *(it++));
+    }
+
+    // columns out of range are rejected
+    similarities.columns.back() = static_cast<unsigned int>(s_testDataSet.size());
+    EXPECT_FALSE(m_tsne.setSimilarities(std::move(similarities)));
+}
+
+TEST_F(TsneDeepTest, SimilarityCache)
+{
+    const auto cacheFile = m_tempFile + ".p";
+    auto expected = std::vector<double>{ 6.74018e-05, -5.00873e-06, -2.8833609e-05, -6.8209149e-05, -6.69799e-05, 3.64486e-05, 6.5181e-05 };
+
+    // the first run computes and saves the similarities, the second one loads them and leads to the same result
+    for (auto run = 0; run < 2; ++run)
+    {
+        auto tsne = PublicTSNE();
+        tsne.m_data = s_testDataSet;
+        tsne.m_dataSize = s_testDataSet.size();
+        tsne.m_inputDimensions = s_testDataSet[0].size();
+        tsne.m_perplexity = 2;
+        tsne.m_outputDimensions = 1;
+        tsne.m_seed = 1;
+        tsne.m_gradientAccuracy = 0.1;
+        tsne.m_similarityCacheFile = cacheFile;
+
+        auto cached = bhtsne::SparseMatrix();
+        EXPECT_EQ(run == 1, tsne.loadSimilarityCache(cached, tsne.similarityCacheKey()));
+
+        EXPECT_NO_THROW(tsne.run());
+        auto it = tsne.m_result.begin();
+        auto itExp = expected.begin();
+        while (it != tsne.m_result.end())
+        {
+            EXPECT_FLOAT_EQ(*(itExp++), *(it++));
+        }
+    }
+
+    // other data or parameters do not match the cache
+    m_tsne.m_data = s_testDataSet;
+    m_tsne.m_dataSize = s_testDataSet.size();
+    m_tsne.m_inputDimensions = s_testDataSet[0].size();
+    m_tsne.m_perplexity = 2;
+    m_tsne.m_similarityCacheFile = cacheFile;
+    auto cached = bhtsne::SparseMatrix();
+    EXPECT_TRUE(m_tsne.loadSimilarityCache(cached, m_tsne.similarityCacheKey()));
+    m_tsne.m_perplexity = 1.5;
+    EXPECT_FALSE(m_tsne.loadSimilarityCache(cached, m_tsne.similarityCacheKey()));
+    m_tsne.m_perplexity = 2;
+
+    // only the parameters of the neighbor method in use are part of the key, Automatic is the tree here
+    m_tsne.m_randomProjectionTrees = 3;
+    m_tsne.m_neighborSearchBudget = 7;
+    m_tsne.m_neighborDescentThreshold = 0.1;
+    EXPECT_TRUE(m_tsne.loadSimilarityCache(cached, m_tsne.similarityCacheKey()));
+    m_tsne.m_neighborMethod = bhtsne::NeighborMethod::VantagePointTree;
+    EXPECT_TRUE(m_tsne.loadSimilarityCache(cached, m_tsne.similarityCacheKey()));
+    m_tsne.m_neighborMethod = bhtsne::NeighborMethod::NearestNeighborDescent;
+    const auto key = m_tsne.similarityCacheKey();
+    m_tsne.m_randomProjectionTrees = 4;
+    m_tsne.m_neighborSearchBudget = 8;
+    EXPECT_EQ(key, m_tsne.similarityCacheKey());
+    m_tsne.m_neighborDescentThreshold = 0.2;
+    EXPECT_NE(key, m_tsne.similarityCacheKey());
+    m_tsne.m_neighborMethod = bhtsne::NeighborMethod::Automatic;
+
+    // the perplexity is not used with the perplexities of scales or points
+    m_tsne.m_perplexities = { 1.5, 2 };
+    const auto scalesKey = m_tsne.similarityCacheKey();
+    m_tsne.m_perplexity = 1.5;
+    EXPECT_EQ(scalesKey, m_tsne.similarityCacheKey());
+    m_tsne.m_perplexities.clear();
+    m_tsne.m_perplexity = 2;
+
+    m_tsne.m_data[3][1] = 0.5;
+    EXPECT_FALSE(m_tsne.loadSimilarityCache(cached, m_tsne.similarityCacheKey()));
+
+    EXPECT_EQ(0, remove(cacheFile.c_str()));
+}
+
 TEST_F(TsneDeepTest, Run)
 {
     m_tsne.m_dataSize = 3;
@@ -807,6 +1151,38 @@ TEST_F(TsneDeepTest, ZeroMean)
 	}
 }
 
+TEST_F(TsneDeepTest, PermuteRows)
+{
+	auto testSet = bhtsne::Vector2D<double>(s_testDataSet);
+	auto permutation = std::vector<unsigned int>{ 3, 6, 0, 2, 5, 1, 4 };
+
+	m_tsne.permuteRows(testSet, permutation);
+
+	for (auto i = size_t(0); i < permutation.size(); ++i)
+	{
+		for (auto j = size_t(0); j < s_testDataSet[0].size(); ++j)
+		{
+			EXPECT_DOUBLE_EQ(s_testDataSet[permutation[i]][j], testSet[i][j]);
+		}
+	}
+}
+
+TEST_F(TsneDeepTest, PermuteSimilarities)
+{
+	// rows 0: (1, 0.1) (2, 0.2), 1: (0, 0.3), 2: (0, 0.4) (1, 0.5)
+	auto similarities = bhtsne::SparseMatrix();
+	similarities.rows = { 0, 2, 3, 5 };
+	similarities.columns = { 1, 2, 0, 0, 1 };
+	similarities.values = { 0.1, 0.2, 0.3, 0.4, 0.5 };
+	auto permutation = std::vector<unsigned int>{ 2, 0, 1 };
+
+	m_tsne.permuteSimilarities(similarities, permutation);
+
+	EXPECT_EQ(std::vector<unsigned int>({ 0, 2, 4, 5 }), similarities.rows);
+	EXPECT_EQ(std::vector<unsigned int>({ 1, 2, 2, 0, 1 }), similarities.columns);
+	EXPECT_EQ(std::vector<double>({ 0.4, 0.5, 0.1, 0.2, 0.3 }), similarities.values);
+}
+
 TEST_F(TsneDeepTest, Normalize)
 {
 	auto testSet = bhtsne::Vector2D<double>(s_testDataSet);
@@ -899,3 +1275,338 @@ TEST_F(TsneDeepTest, ComputeGaussianPerplexity)
 		EXPECT_FLOAT_EQ(*(expectedRow++), row);
 	}
 }
+
+TEST_F(TsneDeepTest, ComputeGaussianPerplexityBruteForce)
+{
+	// random points in 40 dimensions (not a multiple of the blocks), brute force finds the exact neighbors
+	auto data = randomData(1999, 40);
+
+	m_tsne.m_data = bhtsne::Vector2D<double>(data);
+	m_tsne.m_dataSize = m_tsne.m_data.height();
+	m_tsne.m_inputDimensions = m_tsne.m_data.width();
+	m_tsne.m_perplexity = 5.0;
+
+	auto similarities = bhtsne::SparseMatrix();
+	m_tsne.m_neighborMethod = bhtsne::NeighborMethod::BruteForce;
+	m_tsne.computeGaussianPerplexity(similarities);
+
+	EXPECT_EQ(similarities.columns.size(), countExactNeighbors(data, similarities));
+}
+
+TEST_F(TsneDeepTest, ComputeGaussianPerplexityDistanceMetrics)
+{
+	// random points in 24 dimensions, their normalized and their binary copy; the exact searches find the exact
+	// neighbors of every metric
+	auto data = randomData(1000, 24);
+	auto normalized = data;
+	auto binary = data;
+	for (auto n = size_t(0); n < data.size(); ++n)
+	{
+		auto norm = 0.0;
+		for (const auto value : data[n])
+		{
+			norm += value * value;
+		}
+		for (auto d = size_t(0); d < data[n].size(); ++d)
+		{
+			normalized[n][d] = data[n][d] / std::sqrt(norm);
+			binary[n][d] = data[n][d] > 0.0 ? 1.0 : 0.0;
+		}
+	}
+
+	const auto dot = [](const std::vector<double> & a, const std::vector<double> & b)
+	{
+		auto product = 0.0;
+		for (auto d = size_t(0); d < a.size(); ++d)
+		{
+			product += a[d] * b[d];
+		}
+		return product;
+	};
+	const auto cosine = [&dot](const std::vector<double> & a, const std::vector<double> & b)
+	{
+		return 1.0 - dot(a, b) / std::sqrt(dot(a, a) * dot(b, b));
+	};
+	const auto innerProduct = [&dot](const std::vector<double> & a, const std::vector<double> & b)
+	{
+		return 1.0 - dot(a, b);
+	};
+	const auto manhattan = [](const std::vector<double> & a, const std::vector<double> & b)
+	{
+		auto distance = 0.0;
+		for (auto d = size_t(0); d < a.size(); ++d)
+		{
+			distance += std::abs(a[d] - b[d]);
+		}
+		return distance;
+	};
+
+	m_tsne.m_perplexity = 5.0;
+	for (const auto method : { bhtsne::NeighborMethod::VantagePointTree, bhtsne::NeighborMethod::BruteForce })
+	{
+		m_tsne.m_neighborMethod = method;
+		const auto nearestNeighbors = [this](const std::vector<std::vector<double>> & input,
+		                                     bhtsne::DistanceMetric metric)
+		{
+			m_tsne.m_data = bhtsne::Vector2D<double>(input);
+			m_tsne.m_dataSize = m_tsne.m_data.height();
+			m_tsne.m_inputDimensions = m_tsne.m_data.width();
+			m_tsne.m_distanceMetric = metric;
+			auto similarities = bhtsne::SparseMatrix();
+			m_tsne.computeGaussianPerplexity(similarities);
+			return similarities;
+		};
+
+		auto similarities = nearestNeighbors(data, bhtsne::DistanceMetric::Cosine);
+		EXPECT_EQ(similarities.columns.size(), countNearestNeighbors(data, similarities, cosine));
+		similarities = nearestNeighbors(normalized, bhtsne::DistanceMetric::NormalizedInnerProduct);
+		EXPECT_EQ(similarities.columns.size(), countNearestNeighbors(normalized, similarities, innerProduct));
+		similarities = nearestNeighbors(data, bhtsne::DistanceMetric::Manhattan);
+		EXPECT_EQ(similarities.columns.size(), countNearestNeighbors(data, similarities, manhattan));
+		similarities = nearestNeighbors(binary, bhtsne::DistanceMetric::Hamming);
+		EXPECT_EQ(similarities.columns.size(), countNearestNeighbors(binary, similarities, manhattan));
+	}
+}
+
+TEST_F(TsneDeepTest, ComputeGaussianPerplexityRandomProjectionForest)
+{
+	// random points in 10 dimensions, the forest should find most of the exact neighbors
+	auto data = randomData(2000, 10);
+
+	m_tsne.m_data = bhtsne::Vector2D<double>(data);
+	m_tsne.m_dataSize = m_tsne.m_data.height();
+	m_tsne.m_inputDimensions = m_tsne.m_data.width();
+	m_tsne.m_perplexity = 5.0;
+
+	auto approximated = bhtsne::SparseMatrix();
+	m_tsne.m_neighborMethod = bhtsne::NeighborMethod::RandomProjectionForest;
+	m_tsne.computeGaussianPerplexity(approximated);
+
+	EXPECT_GT(countExactNeighbors(data, approximated), 0.9 * approximated.columns.size());
+
+	// the similarities of every row still sum up to one
+	expectNormalizedRows(approximated);
+
+	// the smallest budget still finds distinct neighbors for every point, the budget counts distinct candidates
+	m_tsne.m_neighborSearchBudget = 1;
+	m_tsne.m_perplexity = 30.0;
+	auto budgeted = bhtsne::SparseMatrix();
+	m_tsne.computeGaussianPerplexity(budgeted);
+	for (auto n = size_t(0); n < data.size(); ++n)
+	{
+		EXPECT_EQ(90u, budgeted.rows[n + 1] - budgeted.rows[n]);
+		auto columns = std::vector<unsigned int>(budgeted.columns.begin() + budgeted.rows[n],
+		                                         budgeted.columns.begin() + budgeted.rows[n + 1]);
+		std::sort(columns.begin(), columns.end());
+		EXPECT_TRUE(std::unique(columns.begin(), columns.end()) == columns.end());
+		EXPECT_FALSE(std::binary_search(columns.begin(), columns.end(), static_cast<unsigned int>(n)));
+	}
+}
+
+TEST_F(TsneDeepTest, ComputeGaussianPerplexityNearestNeighborDescent)
+{
+	// random points in 10 dimensions, NN-Descent should find most of the exact neighbors
+	auto data = randomData(2000, 10);
+
+	m_tsne.m_data = bhtsne::Vector2D<double>(data);
+	m_tsne.m_dataSize = m_tsne.m_data.height();
+	m_tsne.m_inputDimensions = m_tsne.m_data.width();
+	m_tsne.m_perplexity = 5.0;
+
+	auto approximated = bhtsne::SparseMatrix();
+	m_tsne.m_neighborMethod = bhtsne::NeighborMethod::NearestNeighborDescent;
+	m_tsne.computeGaussianPerplexity(approximated);
+
+	EXPECT_GT(countExactNeighbors(data, approximated), 0.9 * approximated.columns.size());
+
+	// the similarities of every row still sum up to one
+	expectNormalizedRows(approximated);
+
+#ifdef _OPENMP
+	// the graph does not depend on the number of threads, also if fewer candidates than neighbors are sampled
+	m_tsne.m_perplexity = 30.0;
+	const auto threads = omp_get_max_threads();
+	omp_set_num_threads(1);
+	auto serial = bhtsne::SparseMatrix();
+	m_tsne.computeGaussianPerplexity(serial);
+	omp_set_num_threads(8);
+	auto parallel = bhtsne::SparseMatrix();
+	m_tsne.computeGaussianPerplexity(parallel);
+	omp_set_num_threads(threads);
+	EXPECT_EQ(serial.columns, parallel.columns);
+	EXPECT_EQ(serial.values, parallel.values);
+#endif
+}
+
+TEST_F(TsneDeepTest, ComputeGaussianPerplexityHierarchicalNavigableSmallWorld)
+{
+	// random points in 10 dimensions, the graph should find most of the exact neighbors
+	auto data = randomData(2000, 10);
+
+	m_tsne.m_data = bhtsne::Vector2D<double>(data);
+	m_tsne.m_dataSize = m_tsne.m_data.height();
+	m_tsne.m_inputDimensions = m_tsne.m_data.width();
+	m_tsne.m_perplexity = 5.0;
+
+	auto approximated = bhtsne::SparseMatrix();
+	m_tsne.m_neighborMethod = bhtsne::NeighborMethod::HierarchicalNavigableSmallWorld;
+	m_tsne.m_neighborIndexFile = m_tempFile + ".hnsw";
+	m_tsne.computeGaussianPerplexity(approximated);
+
+	EXPECT_GT(countExactNeighbors(data, approximated), 0.9 * approximated.columns.size());
+
+	// the similarities of every row still sum up to one
+	expectNormalizedRows(approximated);
+
+	// the saved index is loaded instead of built again (with another seed)
+	m_tsne.setRandomSeed(m_tsne.randomSeed() + 1);
+	auto loaded = bhtsne::SparseMatrix();
+	m_tsne.computeGaussianPerplexity(loaded);
+	EXPECT_EQ(approximated.columns, loaded.columns);
+	EXPECT_EQ(approximated.values, loaded.values);
+
+	// an inconsistent graph is built again instead of loaded: the entry point not on the top level, or a link on a
+	// level to a node below it
+	const auto readIndex = [this]() {
+		std::ifstream f(m_tempFile + ".hnsw", std::ios::binary);
+		auto words = std::vector<unsigned int>();
+		auto word = 0u;
+		while (f.read(reinterpret_cast<char *>(&word), sizeof(word)))
+		{
+			words.push_back(word);
+		}
+		return words; };
+	const auto writeIndex = [this](const std::vector<unsigned int> & words) {
+		std::ofstream f(m_tempFile + ".hnsw", std::ios::binary | std::ios::trunc);
+		f.write(reinterpret_cast<const char *>(words.data()), words.size() * sizeof(unsigned int)); };
+	const auto isLoaded = [this]() {
+		auto similarities = bhtsne::SparseMatrix();
+		testing::internal::CaptureStdout();
+		m_tsne.computeGaussianPerplexity(similarities);
+		return testing::internal::GetCapturedStdout().find("loaded neighbor search index") != std::string::npos; };
+
+	// words: magic, version, metric, size, dimensions, connections, checksum (2), entry point, maximum level, levels
+	auto words = readIndex();
+	const auto size = words[3];
+	const auto connections = words[5];
+	const auto levels = std::vector<unsigned int>(words.begin() + 10, words.begin() + 10 + size);
+	ASSERT_GT(words[9], 0u);
+	const auto lowNode = static_cast<unsigned int>(std::find(levels.begin(), levels.end(), 0u) - levels.begin());
+	words[8] = lowNode;
+	writeIndex(words);
+	EXPECT_FALSE(isLoaded());
+	EXPECT_TRUE(isLoaded());
+
+	words = readIndex();
+	auto offset = size_t(10) + size;
+	auto node = 0u;
+	for (; words[10 + node] == 0 || words[offset + 1 + 2 * connections] == 0; ++node)
+	{
+		offset += (1 + 2 * connections) + words[10 + node] * (1 + connections);
+	}
+	words[offset + 1 + 2 * connections + 1] = lowNode;
+	writeIndex(words);
+	EXPECT_FALSE(isLoaded());
+
+	EXPECT_EQ(0, remove((m_tempFile + ".hnsw").c_str()));
+}
+
+TEST_F(TsneDeepTest, ComputeGaussianPerplexityMultiScale)
+{
+	auto data = randomData(500, 10);
+
+	m_tsne.m_data = bhtsne::Vector2D<double>(data);
+	m_tsne.m_dataSize = m_tsne.m_data.height();
+	m_tsne.m_inputDimensions = m_tsne.m_data.width();
+	m_tsne.m_perplexity = 5.0;
+	m_tsne.setPerplexities({ 3.0, 10.0 });
+	EXPECT_EQ(std::vector<double>({ 3.0, 10.0 }), m_tsne.perplexities());
+
+	// all scales share the neighbors of the largest perplexity
+	auto similarities = bhtsne::SparseMatrix();
+	m_tsne.computeGaussianPerplexity(similarities);
+	auto single = bhtsne::SparseMatrix();
+	m_tsne.setPerplexities({});
+	m_tsne.m_perplexity = 10.0;
+	m_tsne.computeGaussianPerplexity(single);
+	EXPECT_EQ(single.rows, similarities.rows);
+	EXPECT_EQ(single.columns, similarities.columns);
+
+	// every row is the mean of the similarities at both perplexities
+	for (auto n = size_t(0); n < data.size(); ++n)
+	{
+		const auto count = similarities.rows[n + 1] - similarities.rows[n];
+		auto distances = std::vector<double>();
+		for (auto i = similarities.rows[n]; i < similarities.rows[n + 1]; ++i)
+		{
+			auto distance = 0.0;
+			for (auto d = size_t(0); d < data[n].size(); ++d)
+			{
+				distance += (data[n][d] - data[similarities.columns[i]][d]) * (data[n][d] - data[similarities.columns[i]][d]);
+			}
+			distances.push_back(distance);
+		}
+		auto small = std::vector<double>(count);
+		auto large = std::vector<double>(count);
+		m_tsne.computeConditionalSimilarities(distances.data(), count, 3.0, small.data());
+		m_tsne.computeConditionalSimilarities(distances.data(), count, 10.0, large.data());
+		for (auto m = 0u; m < count; ++m)
+		{
+			EXPECT_NEAR((small[m] + large[m]) / 2.0, similarities.values[similarities.rows[n] + m], 1e-10);
+			EXPECT_NEAR(large[m], single.values[single.rows[n] + m], 1e-10);
+		}
+	}
+}
+
+TEST_F(TsneDeepTest, ComputeGaussianPerplexityPointPerplexities)
+{
+	auto data = randomData(500, 10);
+
+	m_tsne.m_data = bhtsne::Vector2D<double>(data);
+	m_tsne.m_dataSize = m_tsne.m_data.height();
+	m_tsne.m_inputDimensions = m_tsne.m_data.width();
+	m_tsne.m_perplexity = 5.0;
+
+	// every point has the neighbors and the entropy of its own perplexity
+	auto perplexities = std::vector<double>(data.size());
+	for (auto n = size_t(0); n < data.size(); ++n)
+	{
+		perplexities[n] = n % 2 == 0 ? 4.0 : 10.0;
+	}
+	m_tsne.setPointPerplexities(perplexities);
+	EXPECT_EQ(perplexities, m_tsne.pointPerplexities());
+	auto similarities = bhtsne::SparseMatrix();
+	m_tsne.computeGaussianPerplexity(similarities);
+	expectNormalizedRows(similarities);
+	for (auto n = size_t(0); n < data.size(); ++n)
+	{
+		EXPECT_EQ(static_cast<unsigned int>(3 * perplexities[n]), similarities.rows[n + 1] - similarities.rows[n]);
+		auto entropy = 0.0;
+		for (auto i = similarities.rows[n]; i < similarities.rows[n + 1]; ++i)
+		{
+			entropy -= similarities.values[i] > 0.0 ? similarities.values[i] * std::log(similarities.values[i]) : 0.0;
+		}
+		EXPECT_NEAR(std::log(perplexities[n]), entropy, 1e-4);
+	}
+
+	// the same perplexity for all points is the perplexity
+	m_tsne.setPointPerplexities(std::vector<double>(data.size(), 5.0));
+	auto points = bhtsne::SparseMatrix();
+	m_tsne.computeGaussianPerplexity(points);
+	m_tsne.setPointPerplexities({});
+	auto single = bhtsne::SparseMatrix();
+	m_tsne.computeGaussianPerplexity(single);
+	EXPECT_EQ(single.rows, points.rows);
+	EXPECT_EQ(single.columns, points.columns);
+	EXPECT_EQ(single.values, points.values);
+
+	// a perplexity for every point, not combined with multi-scale perplexities or exact t-SNE
+	m_tsne.setPointPerplexities(std::vector<double>(data.size() - 1, 5.0));
+	EXPECT_THROW(m_tsne.run(), std::invalid_argument);
+	m_tsne.setPointPerplexities(std::vector<double>(data.size(), 5.0));
+	m_tsne.setPerplexities({ 5.0, 10.0 });
+	EXPECT_THROW(m_tsne.run(), std::invalid_argument);
+	m_tsne.setPerplexities({});
+	m_tsne.m_gradientAccuracy = 0.0;
+	EXPECT_THROW(m_tsne.run(), std::invalid_argument);
+}
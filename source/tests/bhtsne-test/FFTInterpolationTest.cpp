@@ -0,0 +1,89 @@
+#include <cmath>
+#include <random>
+
+#include <gmock/gmock.h>
+#include "../../bhtsne/source/FFTInterpolation.h"
+
+using namespace bhtsne;
+
+class FFTInterpolationTest : public testing::Test
+{
+public:
+    // Relative errors of the interpolated forces and normalization term compared to the exact ones
+    template<unsigned int D>
+    static std::pair<double, double> relativeErrors(const Vector2D<double> & data)
+    {
+        auto expectedForces = Vector2D<double>(data.height(), D, 0.0);
+        double expectedSumQ = 0.0;
+        for (unsigned int n = 0; n < data.height(); ++n)
+        {
+            for (unsigned int m = 0; m < data.height(); ++m)
+            {
+                if (m == n)
+                {
+                    continue;
+                }
+                double differences[D];
+                double denominator = 1.0;
+                for (unsigned int d = 0; d < D; ++d)
+                {
+                    differences[d] = data[n][d] - data[m][d];
+                    denominator += differences[d] * differences[d];
+                }
+                auto q = 1.0 / denominator;
+                expectedSumQ += q;
+                for (unsigned int d = 0; d < D; ++d)
+                {
+                    expectedForces[n][d] += q * q * differences[d];
+                }
+            }
+        }
+
+        auto interpolation = FFTInterpolation<D>();
+        auto forces = Vector2D<double>(data.height(), D, 0.0);
+        double sumQ = 0.0;
+        interpolation.computeNonEdgeForces(data, forces[0], sumQ);
+
+        double squaredError = 0.0;
+        double squaredNorm = 0.0;
+        for (unsigned int n = 0; n < data.height(); ++n)
+        {
+            for (unsigned int d = 0; d < D; ++d)
+            {
+                squaredError += (forces[n][d] - expectedForces[n][d]) * (forces[n][d] - expectedForces[n][d]);
+                squaredNorm += expectedForces[n][d] * expectedForces[n][d];
+            }
+        }
+        return std::make_pair(std::sqrt(squaredError / squaredNorm), std::abs(sumQ - expectedSumQ) / expectedSumQ);
+    }
+};
+
+TEST_F(FFTInterpolationTest, InterpolatedForcesMatchExactForces2D)
+{
+    auto gen = std::mt19937(3);
+    auto distribution = std::normal_distribution<double>(0.0, 10.0);
+    auto data = Vector2D<double>(2000, 2);
+    for (auto & each : data)
+    {
+        each = distribution(gen);
+    }
+
+    auto errors = relativeErrors<2>(data);
+    EXPECT_LT(errors.first, 1e-1);
+    EXPECT_LT(errors.second, 5e-3);
+}
+
+TEST_F(FFTInterpolationTest, InterpolatedForcesMatchExactForces1D)
+{
+    auto gen = std::mt19937(4);
+    auto distribution = std::normal_distribution<double>(0.0, 20.0);
+    auto data = Vector2D<double>(2000, 1);
+    for (auto & each : data)
+    {
+        each = distribution(gen);
+    }
+
+    auto errors = relativeErrors<1>(data);
+    EXPECT_LT(errors.first, 1e-1);
+    EXPECT_LT(errors.second, 5e-3);
+}
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include "../../bhtsne/source/SimdKernels.h"
+
+using namespace bhtsne;
+
+class SimdKernelsTest : public testing::Test
+{
+public:
+    // Kernels of all instruction sets supported by the compiler and the CPU
+    static std::vector<const Kernels *> supportedKernels()
+    {
+        auto result = std::vector<const Kernels *>{ &genericKernels() };
+        for (const auto candidate : { sse2Kernels(), avx2Kernels(), avx512Kernels() })
+        {
+            if (candidate != nullptr && candidate->instructionSet <= kernels().instructionSet)
+            {
+                result.push_back(candidate);
+            }
+        }
+        return result;
+    }
+
+    static std::vector<double> randomValues(std::size_t count, std::mt19937 & generator)
+    {
+        auto distribution = std::uniform_real_distribution<double>(-1.0, 1.0);
+        auto values = std::vector<double>(count);
+        for (auto & value : values)
+        {
+            value = distribution(generator);
+        }
+        return values;
+    }
+};
+
+TEST_F(SimdKernelsTest, DistancesMatchGeneric)
+{
+    auto generator = std::mt19937(7);
+    const auto & generic = genericKernels().distances;
+
+    // dimensions that are no multiple of the vector width test the remainder loops
+    for (unsigned int dimensions : { 1u, 3u, 8u, 13u, 50u })
+    {
+        const auto a = randomValues(dimensions, generator);
+        const auto rows = randomValues(4 * dimensions, generator);
+        auto expected = std::array<double, 4>();
+        generic.dotProducts4(a.data(), rows.data(), dimensions, expected.data());
+
+        for (const auto kernels : supportedKernels())
+        {
+            const auto & distances = kernels->distances;
+            EXPECT_NEAR(generic.squaredEuclideanDistance(a.data(), rows.data(), dimensions),
+                        distances.squaredEuclideanDistance(a.data(), rows.data(), dimensions), 1e-12);
+            EXPECT_NEAR(generic.dotProduct(a.data(), rows.data(), dimensions),
+                        distances.dotProduct(a.data(), rows.data(), dimensions), 1e-12);
+            EXPECT_NEAR(generic.cosineDistance(a.data(), rows.data(), dimensions),
+                        distances.cosineDistance(a.data(), rows.data(), dimensions), 1e-12);
+            EXPECT_NEAR(generic.innerProductDistance(a.data(), rows.data(), dimensions),
+                        distances.innerProductDistance(a.data(), rows.data(), dimensions), 1e-12);
+            EXPECT_NEAR(generic.manhattanDistance(a.data(), rows.data(), dimensions),
+                        distances.manhattanDistance(a.data(), rows.data(), dimensions), 1e-12);
+
+            auto products = std::array<double, 4>();
+            distances.dotProducts4(a.data(), rows.data(), dimensions, products.data());
+            for (unsigned int i = 0; i < 4; ++i)
+            {
+                EXPECT_NEAR(expected[i], products[i], 1e-12);
+            }
+        }
+    }
+}
+
+TEST_F(SimdKernelsTest, HammingDistance)
+{
+    // two words that differ in 3 + 64 bits
+    const std::uint64_t a[2] = { 0x0123456789abcdefull, 0ull };
+    const std::uint64_t b[2] = { 0x0123456789abcde8ull, ~0ull };
+    double packedA[2];
+    double packedB[2];
+    std::memcpy(packedA, a, sizeof(a));
+    std::memcpy(packedB, b, sizeof(b));
+
+    for (const auto kernels : supportedKernels())
+    {
+        EXPECT_EQ(67.0, kernels->distances.hammingDistance(packedA, packedB, 2));
+        EXPECT_EQ(0.0, kernels->distances.hammingDistance(packedA, packedA, 2));
+    }
+}
+
+TEST_F(SimdKernelsTest, GaussianKernel)
+{
+    // distances from 0 to far beyond the range of normal doubles of the kernel, counts that are no multiple of
+    // the vector width test the remainder
+    auto generator = std::mt19937(13);
+    auto distribution = std::uniform_real_distribution<double>(0.0, 800.0);
+    for (unsigned int count : { 1u, 5u, 16u, 91u })
+    {
+        auto distances = std::vector<double>(count);
+        for (auto & distance : distances)
+        {
+            distance = distribution(generator);
+        }
+        distances[0] = 0.0;
+
+        for (const auto kernels : supportedKernels())
+        {
+            auto similarities = std::vector<double>(count);
+            auto sum = 1.0;
+            auto weightedSum = 2.0;
+            auto squaredWeightedSum = 3.0;
+            kernels->similarities.gaussianKernel(distances.data(), count, 0.9, similarities.data(), sum, weightedSum,
+                                                 squaredWeightedSum);
+
+            auto expectedSum = 1.0;
+            auto expectedWeightedSum = 2.0;
+            auto expectedSquaredWeightedSum = 3.0;
+            for (unsigned int i = 0; i < count; ++i)
+            {
+                const auto expected = 0.9 * distances[i] > 708.0 ? 0.0 : std::exp(-0.9 * distances[i]);
+                EXPECT_NEAR(expected, similarities[i], 1e-15 * expected);
+                expectedSum += expected;
+                expectedWeightedSum += distances[i] * expected;
+                expectedSquaredWeightedSum += distances[i] * distances[i] * expected;
+            }
+            EXPECT_NEAR(expectedSum, sum, 1e-15 * expectedSum);
+            EXPECT_NEAR(expectedWeightedSum, weightedSum, 1e-15 * expectedWeightedSum);
+            EXPECT_NEAR(expectedSquaredWeightedSum, squaredWeightedSum, 1e-15 * expectedSquaredWeightedSum);
+        }
+    }
+}
+
+TEST_F(SimdKernelsTest, ForcesMatchGeneric)
+{
+    constexpr unsigned int groupSize = ForceKernels<2>::s_groupSize;
+    auto generator = std::mt19937(11);
+    const auto & generic = genericKernels().forces2;
+
+    // a group of points summarized by a node, every other lane takes part
+    alignas(64) std::array<double, 2 * groupSize> coordinates;
+    const auto values = randomValues(2 * groupSize, generator);
+    std::copy(values.begin(), values.end(), coordinates.begin());
+    const auto centerOfMass = std::array<double, 2>{ { 0.1, -0.2 } };
+    const auto lanes = 0x5555u;
+
+    alignas(64) std::array<double, 2 * groupSize> expectedForces = {};
+    alignas(64) std::array<double, groupSize> expectedForceSums = {};
+    const auto expectedLanes = generic.summarizeGroup(coordinates.data(), centerOfMass.data(), 0.01, 5.0, 0.25, lanes,
+                                                      false, expectedForces.data(), expectedForceSums.data());
+
+    // a bucket of 11 points that contains the point itself
+    const auto numberOfPoints = std::size_t(11);
+    const auto bucketCoordinates = randomValues(2 * numberOfPoints, generator);
+    const auto bucketIndices = std::vector<unsigned int>{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+    const auto point = std::array<double, 2>{ { bucketCoordinates[3], bucketCoordinates[numberOfPoints + 3] } };
+    auto expectedBucketForces = std::array<double, 2>();
+    auto expectedBucketSum = 0.0;
+    generic.bucketForces(point.data(), bucketCoordinates.data(), numberOfPoints, bucketIndices.data(), 0,
+                         static_cast<unsigned int>(numberOfPoints), 3, expectedBucketForces.data(), expectedBucketSum);
+
+    for (const auto kernels : supportedKernels())
+    {
+        const auto & forces = kernels->forces2;
+
+        alignas(64) std::array<double, 2 * groupSize> groupForces = {};
+        alignas(64) std::array<double, groupSize> forceSums = {};
+        EXPECT_EQ(expectedLanes, forces.summarizeGroup(coordinates.data(), centerOfMass.data(), 0.01, 5.0, 0.25,
+                                                       lanes, false, groupForces.data(), forceSums.data()));
+        for (unsigned int i = 0; i < 2 * groupSize; ++i)
+        {
+            EXPECT_NEAR(expectedForces[i], groupForces[i], 1e-12);
+        }
+        for (unsigned int i = 0; i < groupSize; ++i)
+        {
+            EXPECT_NEAR(expectedForceSums[i], forceSums[i], 1e-12);
+        }
+
+        auto bucketForces = std::array<double, 2>();
+        auto bucketSum = 0.0;
+        forces.bucketForces(point.data(), bucketCoordinates.data(), numberOfPoints, bucketIndices.data(), 0,
+                            static_cast<unsigned int>(numberOfPoints), 3, bucketForces.data(), bucketSum);
+        EXPECT_NEAR(expectedBucketSum, bucketSum, 1e-12);
+        EXPECT_NEAR(expectedBucketForces[0], bucketForces[0], 1e-12);
+        EXPECT_NEAR(expectedBucketForces[1], bucketForces[1], 1e-12);
+    }
+}
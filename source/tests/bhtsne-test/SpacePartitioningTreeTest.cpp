@@ -1,3 +1,6 @@
+#include <cmath>
+#include <random>
+
 #include <gmock/gmock.h>
 #include "../../bhtsne/source/SpacePartitioningTree.h"
 
@@ -61,3 +64,271 @@ TEST_F(SpacePartitioningTreeTest, OpenMPComputeNonEdgeForces)
         }
     }
 }
+
+TEST_F(SpacePartitioningTreeTest, RebuildMatchesFreshTree)
+{
+    const auto first = Vector2D<double>{ {
+        { 0.5, -1.0 },
+        { 2.0, 3.5 },
+        { -4.0, 1.25 },
+        { 0.75, 0.5 },
+        { -2.5, -3.0 }
+    } };
+    const auto second = Vector2D<double>{ {
+        { 1.0, 2.0 },
+        { -1.5, 0.25 },
+        { 3.0, -2.0 },
+        { 1.0, 2.0 },
+        { 0.0, -0.5 },
+        { -3.25, 4.0 }
+    } };
+    const auto squaredGradientAccuracy = 0.5 * 0.5;
+
+    // rebuild into the storage of a tree that was built on other data
+    auto reusedTree = SpacePartitioningTree<2>(first);
+    reusedTree.rebuild(second);
+    const auto freshTree = SpacePartitioningTree<2>(second);
+
+    for (unsigned int n = 0; n < second.height(); ++n)
+    {
+        double forces[2] = { 0.0, 0.0 };
+        double freshForces[2] = { 0.0, 0.0 };
+        double sumQ = 0.0;
+        double freshSumQ = 0.0;
+
+        reusedTree.computeNonEdgeForces(n, squaredGradientAccuracy, forces, sumQ);
+        freshTree.computeNonEdgeForces(n, squaredGradientAccuracy, freshForces, freshSumQ);
+
+        ASSERT_DOUBLE_EQ(freshSumQ, sumQ);
+        ASSERT_DOUBLE_EQ(freshForces[0], forces[0]);
+        ASSERT_DOUBLE_EQ(freshForces[1], forces[1]);
+    }
+}
+
+TEST_F(SpacePartitioningTreeTest, BulkBuildMatchesInsertion)
+{
+    auto gen = std::mt19937(42);
+    auto distribution = std::normal_distribution<double>(0.0, 10.0);
+    auto data = Vector2D<double>(200, 3);
+    for (auto & each : data)
+    {
+        each = distribution(gen);
+    }
+    auto insertedTree = SpacePartitioningTree<3>(data);
+    auto bulkTree = SpacePartitioningTree<3>();
+    bulkTree.rebuildBulk(data);
+
+    // without approximation both trees sum up the exact interactions
+    for (unsigned int n = 0; n < data.height(); ++n)
+    {
+        double forces[3] = { 0.0, 0.0, 0.0 };
+        double bulkForces[3] = { 0.0, 0.0, 0.0 };
+        double sumQ = 0.0;
+        double bulkSumQ = 0.0;
+
+        insertedTree.computeNonEdgeForces(n, 0.0, forces, sumQ);
+        bulkTree.computeNonEdgeForces(n, 0.0, bulkForces, bulkSumQ);
+
+        ASSERT_NEAR(sumQ, bulkSumQ, 1e-12);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            ASSERT_NEAR(forces[d], bulkForces[d], 1e-12);
+        }
+    }
+}
+
+TEST_F(SpacePartitioningTreeTest, LargeBulkBuildMatchesBruteForce)
+{
+    // enough points to build the lower levels of the tree in parallel
+    auto gen = std::mt19937(7);
+    auto distribution = std::normal_distribution<double>(0.0, 10.0);
+    auto data = Vector2D<double>(20000, 2);
+    for (auto & each : data)
+    {
+        each = distribution(gen);
+    }
+    auto tree = SpacePartitioningTree<2>();
+    tree.rebuildBulk(data);
+
+    for (unsigned int n = 0; n < data.height(); n += 997)
+    {
+        double forces[2] = { 0.0, 0.0 };
+        double sumQ = 0.0;
+        tree.computeNonEdgeForces(n, 0.0, forces, sumQ);
+
+        double expectedForces[2] = { 0.0, 0.0 };
+        double expectedSumQ = 0.0;
+        for (unsigned int m = 0; m < data.height(); ++m)
+        {
+            if (m == n)
+            {
+                continue;
+            }
+            auto dx = data[n][0] - data[m][0];
+            auto dy = data[n][1] - data[m][1];
+            auto q = 1.0 / (1.0 + dx * dx + dy * dy);
+            expectedSumQ += q;
+            expectedForces[0] += q * q * dx;
+            expectedForces[1] += q * q * dy;
+        }
+
+        ASSERT_NEAR(expectedSumQ, sumQ, 1e-9 * expectedSumQ);
+        ASSERT_NEAR(expectedForces[0], forces[0], 1e-9 * std::abs(expectedSumQ));
+        ASSERT_NEAR(expectedForces[1], forces[1], 1e-9 * std::abs(expectedSumQ));
+    }
+}
+
+TEST_F(SpacePartitioningTreeTest, LeafBucketsCountDuplicates)
+{
+    // every point is stored three times, so duplicates are both in and beyond leaf buckets
+    auto gen = std::mt19937(11);
+    auto distribution = std::normal_distribution<double>(0.0, 10.0);
+    auto data = Vector2D<double>(300, 3);
+    for (unsigned int n = 0; n < data.height(); n += 3)
+    {
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            data[n][d] = data[n + 1][d] = data[n + 2][d] = distribution(gen);
+        }
+    }
+
+    for (auto capacity : { 1u, 8u, 64u })
+    {
+        auto tree = SpacePartitioningTree<3>();
+        tree.setLeafCapacity(capacity);
+        tree.rebuildBulk(data);
+
+        for (unsigned int n = 0; n < data.height(); ++n)
+        {
+            double forces[3] = { 0.0, 0.0, 0.0 };
+            double sumQ = 0.0;
+            tree.computeNonEdgeForces(n, 0.0, forces, sumQ);
+
+            double expectedForces[3] = { 0.0, 0.0, 0.0 };
+            double expectedSumQ = 0.0;
+            for (unsigned int m = 0; m < data.height(); ++m)
+            {
+                if (m == n)
+                {
+                    continue;
+                }
+                double differences[3];
+                double denominator = 1.0;
+                for (unsigned int d = 0; d < 3; ++d)
+                {
+                    differences[d] = data[n][d] - data[m][d];
+                    denominator += differences[d] * differences[d];
+                }
+                auto q = 1.0 / denominator;
+                expectedSumQ += q;
+                for (unsigned int d = 0; d < 3; ++d)
+                {
+                    expectedForces[d] += q * q * differences[d];
+                }
+            }
+
+            ASSERT_NEAR(expectedSumQ, sumQ, 1e-12);
+            for (unsigned int d = 0; d < 3; ++d)
+            {
+                ASSERT_NEAR(expectedForces[d], forces[d], 1e-12);
+            }
+        }
+    }
+}
+
+TEST_F(SpacePartitioningTreeTest, DualTreeMatchesBruteForce)
+{
+    auto gen = std::mt19937(5);
+    auto distribution = std::normal_distribution<double>(0.0, 10.0);
+    auto data = Vector2D<double>(6000, 2);
+    for (auto & each : data)
+    {
+        each = distribution(gen);
+    }
+    auto tree = SpacePartitioningTree<2>();
+    tree.rebuildBulk(data);
+
+    auto expectedForces = Vector2D<double>(data.height(), 2, 0.0);
+    double expectedSumQ = 0.0;
+    for (unsigned int n = 0; n < data.height(); ++n)
+    {
+        for (unsigned int m = 0; m < data.height(); ++m)
+        {
+            if (m == n)
+            {
+                continue;
+            }
+            auto dx = data[n][0] - data[m][0];
+            auto dy = data[n][1] - data[m][1];
+            auto q = 1.0 / (1.0 + dx * dx + dy * dy);
+            expectedSumQ += q;
+            expectedForces[n][0] += q * q * dx;
+            expectedForces[n][1] += q * q * dy;
+        }
+    }
+
+    auto relativeError = [&expectedForces](const Vector2D<double> & forces)
+    {
+        double squaredError = 0.0;
+        double squaredNorm = 0.0;
+        for (unsigned int n = 0; n < forces.height(); ++n)
+        {
+            for (unsigned int d = 0; d < 2; ++d)
+            {
+                squaredError += (forces[n][d] - expectedForces[n][d]) * (forces[n][d] - expectedForces[n][d]);
+                squaredNorm += expectedForces[n][d] * expectedForces[n][d];
+            }
+        }
+        return std::sqrt(squaredError / squaredNorm);
+    };
+
+    // without approximation all interactions are exact
+    auto forces = Vector2D<double>(data.height(), 2, 0.0);
+    double sumQ = 0.0;
+    tree.computeNonEdgeForcesDualTree(0.0, forces[0], sumQ);
+    ASSERT_NEAR(expectedSumQ, sumQ, 1e-9 * expectedSumQ);
+    ASSERT_LT(relativeError(forces), 1e-9);
+
+    // with approximation the error is comparable to the one of the point-cell traversal
+    forces = Vector2D<double>(data.height(), 2, 0.0);
+    sumQ = 0.0;
+    tree.computeNonEdgeForcesDualTree(0.25, forces[0], sumQ);
+    auto pointForces = Vector2D<double>(data.height(), 2, 0.0);
+    double pointSumQ = 0.0;
+    for (unsigned int n = 0; n < data.height(); ++n)
+    {
+        tree.computeNonEdgeForces(n, 0.25, pointForces[n], pointSumQ);
+    }
+    ASSERT_NEAR(expectedSumQ, sumQ, 2.0 * std::abs(expectedSumQ - pointSumQ));
+    ASSERT_LT(relativeError(forces), 2.0 * relativeError(pointForces));
+}
+
+TEST_F(SpacePartitioningTreeTest, GroupedTraversalMatchesPointTraversal)
+{
+    auto gen = std::mt19937(9);
+    auto distribution = std::normal_distribution<double>(0.0, 10.0);
+    auto data = Vector2D<double>(1003, 3);
+    for (auto & each : data)
+    {
+        each = distribution(gen);
+    }
+    auto tree = SpacePartitioningTree<3>();
+    tree.rebuildBulk(data);
+
+    auto forces = Vector2D<double>(data.height(), 3, 0.0);
+    double sumQ = 0.0;
+    tree.computeNonEdgeForcesGrouped(0.25, forces[0], sumQ);
+
+    // every point visits the same nodes in the same order as in the recursive traversal
+    double expectedSumQ = 0.0;
+    for (unsigned int n = 0; n < data.height(); ++n)
+    {
+        double expectedForces[3] = { 0.0, 0.0, 0.0 };
+        tree.computeNonEdgeForces(n, 0.25, expectedForces, expectedSumQ);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            ASSERT_NEAR(expectedForces[d], forces[n][d], 1e-12);
+        }
+    }
+    ASSERT_NEAR(expectedSumQ, sumQ, 1e-12 * expectedSumQ);
+}
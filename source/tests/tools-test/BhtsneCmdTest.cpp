@@ -48,8 +48,18 @@ TEST_F(BhtsneCmdTest, SettingCommandLineParameters)
     auto parsedArguments = cppassist::ArgumentParser();
     parseArguments(parsedArguments, "./bhtsne_cmd "
                            "--perplexity 40.123 "
+                           "--perplexities 5,30.5,50 "
                            "--gradient-accuracy 2.123 "
+                           "--gradient-method dual-tree "
+                           "--neighbor-method random-projection-forest "
+                           "--metric cosine "
+                           "--random-projection-trees 12 "
+                           "--neighbor-search-budget 800 "
+                           "--nn-descent-threshold 0.0123 "
+                           "--neighbor-index-file index123.hnsw "
+                           "--similarity-cache similarities123.p "
                            "--iterations 4123 "
+                           "--reorder-interval 25 "
                            // "--data-size 3123 "
                            "--output-dimensions 2 "
                            "--output-file another_result.dat "
@@ -58,8 +68,18 @@ TEST_F(BhtsneCmdTest, SettingCommandLineParameters)
     applyCommandlineOptions(m_tsne, parsedArguments.options());
 
     EXPECT_EQ(40.123, m_tsne.perplexity()) << "perplexity was not set correctly via commandline option";
+    EXPECT_EQ(std::vector<double>({ 5.0, 30.5, 50.0 }), m_tsne.perplexities()) << "perplexities was not set correctly via commandline option";
     EXPECT_EQ(2.123, m_tsne.gradientAccuracy()) << "gradient-accuracy was not set correctly via commandline option";
+    EXPECT_EQ(bhtsne::GradientMethod::DualTree, m_tsne.gradientMethod()) << "gradient-method was not set correctly via commandline option";
+    EXPECT_EQ(bhtsne::NeighborMethod::RandomProjectionForest, m_tsne.neighborMethod()) << "neighbor-method was not set correctly via commandline option";
+    EXPECT_EQ(bhtsne::DistanceMetric::Cosine, m_tsne.distanceMetric()) << "metric was not set correctly via commandline option";
+    EXPECT_EQ(12, m_tsne.randomProjectionTrees()) << "random-projection-trees was not set correctly via commandline option";
+    EXPECT_EQ(800, m_tsne.neighborSearchBudget()) << "neighbor-search-budget was not set correctly via commandline option";
+    EXPECT_EQ(0.0123, m_tsne.neighborDescentThreshold()) << "nn-descent-threshold was not set correctly via commandline option";
+    EXPECT_EQ("index123.hnsw", m_tsne.neighborIndexFile()) << "neighbor-index-file was not set correctly via commandline option";
+    EXPECT_EQ("similarities123.p", m_tsne.similarityCacheFile()) << "similarity-cache was not set correctly via commandline option";
     EXPECT_EQ(4123, m_tsne.iterations()) << "iterations was not set correctly via commandline option";
+    EXPECT_EQ(25, m_tsne.reorderInterval()) << "reorder-interval was not set correctly via commandline option";
     // EXPECT_EQ(3123, m_tsne.dataSize()) << "number-of-samples was not set correctly via commandline option";
     EXPECT_EQ(2, m_tsne.outputDimensions()) << "output-dimensions was not set correctly via commandline option";
     EXPECT_EQ("another_result.dat", m_tsne.outputFile()) << "output-file was not set correctly via commandline option";
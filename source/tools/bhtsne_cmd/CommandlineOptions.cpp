@@ -1,4 +1,5 @@
 #include <iostream>
+#include <sstream>
 
 #include "CommandlineOptions.h"
 
@@ -13,14 +14,127 @@ namespace bhtsne
             {
                 tsne.setPerplexity(std::stod(optionValuePair.second));
             }
+            else if (optionValuePair.first == "--perplexities")
+            {
+                // comma-separated list of the perplexities of multi-scale similarities
+                auto perplexities = std::vector<double>();
+                auto stream = std::istringstream(optionValuePair.second);
+                auto value = std::string();
+                while (std::getline(stream, value, ','))
+                {
+                    perplexities.push_back(std::stod(value));
+                }
+                tsne.setPerplexities(perplexities);
+            }
             else if (optionValuePair.first == "--gradient-accuracy")
             {
                 tsne.setGradientAccuracy(std::stod(optionValuePair.second));
             }
+            else if (optionValuePair.first == "--gradient-method")
+            {
+                if (optionValuePair.second == "barnes-hut")
+                {
+                    tsne.setGradientMethod(GradientMethod::BarnesHut);
+                }
+                else if (optionValuePair.second == "dual-tree")
+                {
+                    tsne.setGradientMethod(GradientMethod::DualTree);
+                }
+                else if (optionValuePair.second == "interpolation")
+                {
+                    tsne.setGradientMethod(GradientMethod::Interpolation);
+                }
+                else
+                {
+                    std::cerr << "warning: ignored unexpected gradient method " << optionValuePair.second << "\n"
+                        << "allowed methods are: barnes-hut, dual-tree, interpolation\n";
+                }
+            }
+            else if (optionValuePair.first == "--neighbor-method")
+            {
+                if (optionValuePair.second == "automatic")
+                {
+                    tsne.setNeighborMethod(NeighborMethod::Automatic);
+                }
+                else if (optionValuePair.second == "vantage-point-tree")
+                {
+                    tsne.setNeighborMethod(NeighborMethod::VantagePointTree);
+                }
+                else if (optionValuePair.second == "brute-force")
+                {
+                    tsne.setNeighborMethod(NeighborMethod::BruteForce);
+                }
+                else if (optionValuePair.second == "random-projection-forest")
+                {
+                    tsne.setNeighborMethod(NeighborMethod::RandomProjectionForest);
+                }
+                else if (optionValuePair.second == "nn-descent")
+                {
+                    tsne.setNeighborMethod(NeighborMethod::NearestNeighborDescent);
+                }
+                else if (optionValuePair.second == "hnsw")
+                {
+                    tsne.setNeighborMethod(NeighborMethod::HierarchicalNavigableSmallWorld);
+                }
+                else
+                {
+                    std::cerr << "warning: ignored unexpected neighbor method " << optionValuePair.second << "\n"
+                        << "allowed methods are: automatic, vantage-point-tree, brute-force, random-projection-forest, "
+                        << "nn-descent, hnsw\n";
+                }
+            }
+            else if (optionValuePair.first == "--metric")
+            {
+                if (optionValuePair.second == "euclidean")
+                {
+                    tsne.setDistanceMetric(DistanceMetric::Euclidean);
+                }
+                else if (optionValuePair.second == "cosine")
+                {
+                    tsne.setDistanceMetric(DistanceMetric::Cosine);
+                }
+                else if (optionValuePair.second == "inner-product")
+                {
+                    tsne.setDistanceMetric(DistanceMetric::NormalizedInnerProduct);
+                }
+                else if (optionValuePair.second == "manhattan")
+                {
+                    tsne.setDistanceMetric(DistanceMetric::Manhattan);
+                }
+                else if (optionValuePair.second == "hamming")
+                {
+                    tsne.setDistanceMetric(DistanceMetric::Hamming);
+                }
+                else
+                {
+                    std::cerr << "warning: ignored unexpected metric " << optionValuePair.second << "\n"
+                        << "allowed metrics are: euclidean, cosine, inner-product, manhattan, hamming\n";
+                }
+            }
+            else if (optionValuePair.first == "--random-projection-trees")
+            {
+                tsne.setRandomProjectionTrees(static_cast<unsigned int>(std::stol(optionValuePair.second)));
+            }
+            else if (optionValuePair.first == "--neighbor-search-budget")
+            {
+                tsne.setNeighborSearchBudget(static_cast<unsigned int>(std::stol(optionValuePair.second)));
+            }
+            else if (optionValuePair.first == "--nn-descent-threshold")
+            {
+                tsne.setNeighborDescentThreshold(std::stod(optionValuePair.second));
+            }
+            else if (optionValuePair.first == "--neighbor-index-file")
+            {
+                tsne.setNeighborIndexFile(optionValuePair.second);
+            }
             else if (optionValuePair.first == "--iterations")
             {
                 tsne.setIterations(static_cast<unsigned int>(std::stol(optionValuePair.second)));
             }
+            else if (optionValuePair.first == "--reorder-interval")
+            {
+                tsne.setReorderInterval(static_cast<unsigned int>(std::stol(optionValuePair.second)));
+            }
             else if (optionValuePair.first == "--output-dimensions")
             {
                 tsne.setOutputDimensions(static_cast<unsigned int>(std::stol(optionValuePair.second)));
@@ -33,11 +147,21 @@ namespace bhtsne
             {
                 tsne.setRandomSeed(std::stoul(optionValuePair.second));
             }
+            else if (optionValuePair.first == "--similarity-cache")
+            {
+                tsne.setSimilarityCacheFile(optionValuePair.second);
+            }
+            else if (optionValuePair.first == "--neighbors" || optionValuePair.first == "--similarities")
+            {
+                // precomputed input is loaded together with the input file
+            }
             else if (optionValuePair.first.find("--") == 0)
             {
                 std::cerr << "warning: ignored unexpected command line option " << optionValuePair.first << "\n"
-                    << "allowed options are: --perplexity, --gradient-accuracy, --iterations, "
-                    << "--output-dimensions, --output-file, --random-seed\n";
+                    << "allowed options are: --perplexity, --perplexities, --gradient-accuracy, --gradient-method, "
+                    << "--neighbor-method, --metric, --random-projection-trees, --neighbor-search-budget, "
+                    << "--nn-descent-threshold, --neighbor-index-file, --similarity-cache, --neighbors, --similarities, "
+                    << "--iterations, --reorder-interval, --output-dimensions, --output-file, --random-seed\n";
             }
         }
     }
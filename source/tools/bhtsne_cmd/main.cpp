@@ -22,8 +22,20 @@ int main(int argc, char * argv[])
         {
             std::cout << "usage: bhtsne_cmd"
                 << " [--perplexity <value>]"
+                << " [--perplexities <value>,<value>,...]"
                 << " [--gradient-accuracy <value>]"
+                << " [--gradient-method barnes-hut|dual-tree|interpolation]"
+                << " [--neighbor-method automatic|vantage-point-tree|brute-force|random-projection-forest|nn-descent|hnsw]"
+                << " [--metric euclidean|cosine|inner-product|manhattan|hamming]"
+                << " [--random-projection-trees <value>]"
+                << " [--neighbor-search-budget <value>]"
+                << " [--nn-descent-threshold <value>]"
+                << " [--neighbor-index-file <value>]"
+                << " [--similarity-cache <value>]"
+                << " [--neighbors <value>]"
+                << " [--similarities <value>]"
                 << " [--iterations <value>]"
+                << " [--reorder-interval <value>]"
                 << " [--output-dimensions <value>]"
                 << " [--output-file <value>]"
                 << " [--random-seed <value>]"
@@ -36,7 +48,8 @@ int main(int argc, char * argv[])
             std::cout << "Options with two -- are parameter and require a value.\n"
                 << "Options with a single - are output formats. Multiple formats can be specified.\n"
                 << "The input file should have a .csv .dat or .tsne extension. For details see the documentation.\n"
-                << "If no filename is specified, the input is read from stdin in csv format.\n";
+                << "If no filename is specified, the input is read from stdin in csv format.\n"
+                << "Precomputed neighbors (.knn) or similarities (.p) replace the input file, see the documentation.\n";
             return 0;
         }
         else if (optionValuePair.first == "--version")
@@ -59,9 +72,30 @@ int main(int argc, char * argv[])
 
     auto loaded = false;
 
+    //load precomputed neighbors or similarities, which make the input file optional
+    auto precomputed = false;
+    if (parsedArguments.isSet("--neighbors"))
+    {
+        if (!tsne.loadNeighbors(parsedArguments.options().at("--neighbors")))
+        {
+            std::cerr << "failed to load neighbors\n";
+            return 5;
+        }
+        precomputed = true;
+    }
+    if (parsedArguments.isSet("--similarities"))
+    {
+        if (!tsne.loadSimilarities(parsedArguments.options().at("--similarities")))
+        {
+            std::cerr << "failed to load similarities\n";
+            return 5;
+        }
+        precomputed = true;
+    }
+
     if (params.empty())
     {
-        loaded = tsne.loadCin();
+        loaded = precomputed || tsne.loadCin();
     }
     else
     {